@@ -0,0 +1,656 @@
+/*
+ *
+ * kodivc-bench - measures how well and how fast kodivc decodes a labeled
+ * corpus of utterances
+ *
+ * Copyright (C) Michal Kepien, 2012-2015.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE. If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Decoders and the action table are set up by the same code kodivc uses,
+ * which is compiled into this program by including kodivc.c, so -a, -T and
+ * -O mean exactly what they mean to kodivc. The corpus is recorded at
+ * 16 kHz; with -8 it is decoded a second time after going through the same
+ * decimator kodivc -8 uses, so both rates are reported side by side, each on
+ * a line of its own. The corpus is split between
+ * as many threads as there are CPU cores, each with a decoder of its own.
+ * Utterances are fed in blocks with the live cepstral mean, like kodivc
+ * does, and every one starts from the same mean, so results do not depend
+ * on which thread happened to decode it. Hypotheses are scored by
+ * words and by the commands they compile to, as two hypotheses which differ
+ * in words may still make kodivc do the same thing.
+ */
+
+#include "kodivc-tools.c"
+
+#define BENCH_USAGE_MESSAGE		"\n" \
+					"Usage: kodivc-bench [ -a <filename> ] [ -T <profile> ] [ -O <option>=<value> ]\n" \
+					"                    [ -j <threads> ] [ -8 ] [ -s ] [ -u ] [ -v ] <corpus>\n" \
+					"\n" \
+					"    -a <filename>     Compile hypotheses with actions from supplied file\n" \
+					"    -T <profile>      Decode using supplied decoder profile\n" \
+					"    -O <option>=<value>\n" \
+					"                      Set a pocketsphinx option, overriding the profile\n" \
+					"    -j <threads>      Number of decoding threads (default: number of CPUs)\n" \
+					"    -8                Also decode audio decimated to 8 kHz, as kodivc -8 does\n" \
+					"    -s                Decode all utterances in spelling mode\n" \
+					"    -u                Also print results of every utterance\n" \
+					"    -v                Do not suppress pocketsphinx messages\n" \
+					"\n" \
+					"Every line of the corpus holds a path to an audio file (raw 16-bit samples or\n" \
+					"a 16-bit mono WAV file at 16 kHz), relative to the corpus, followed by the\n" \
+					"expected hypothesis. Results are printed as JSON, one line per sample rate.\n" \
+					"\n"
+
+/* Labeled utterance and what it was decoded to */
+typedef struct {
+	char*		path;
+	char*		expected;
+	char*		hypothesis;	/* NULL if audio could not be read */
+	double		length;		/* of audio (s) */
+	double		latency;	/* from start of decoding to hypothesis (ms) */
+	int		thread;
+	int		errors;		/* words substituted, deleted or inserted */
+	int		command_error;
+} utterance_t;
+
+typedef struct {
+	pthread_t	thread;
+	ps_decoder_t*	ps;
+	mfcc_t		cmn[JOURNAL_CMN_SIZE];
+	int		cmn_size;
+	int		index;
+} bench_thread_t;
+
+/* Word alignment totals */
+typedef struct {
+	int		words;
+	int		substitutions;
+	int		deletions;
+	int		insertions;
+} word_errors_t;
+
+utterance_t*		utterances = NULL;
+int			utterances_count = 0;
+int			next_utterance = 0;
+pthread_mutex_t		next_utterance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Return a newly allocated copy of words, separated with single spaces */
+char*
+normalize_words(const char* words)
+{
+
+	char*		normalized = malloc(strlen(words) + 1);
+	char*		dst = normalized;
+	const char*	src;
+
+	assert(normalized);
+
+	for (src = words; *src; src++)
+	{
+		if (*src == ' ' || *src == '\t')
+			continue;
+		if (dst != normalized && (src[-1] == ' ' || src[-1] == '\t'))
+			*dst++ = ' ';
+		*dst++ = *src;
+	}
+	*dst = '\0';
+
+	return normalized;
+
+}
+
+/* Read the corpus, resolving audio paths relative to its directory */
+void
+read_corpus(const char* corpus)
+{
+
+	FILE*		file;
+	char*		line = NULL;
+	size_t		size = 0;
+	char*		directory;
+	char*		slash;
+	char*		path;
+	char*		expected;
+	char*		end;
+	int		allocated = 0;
+
+	if ((file = fopen(corpus, "r")) == NULL)
+		die("Unable to open corpus %s: %s", corpus, strerror(errno));
+
+	directory = strdup(corpus);
+	assert(directory);
+	if ((slash = strrchr(directory, '/')) != NULL)
+		*slash = '\0';
+	else
+		strcpy(directory, ".");
+
+	while (getline(&line, &size, file) != -1)
+	{
+
+		line[strcspn(line, "\r\n")] = '\0';
+		path = line + strspn(line, " \t");
+		if (*path == '\0' || *path == '#')
+			continue;
+
+		/* Expected hypothesis is normalized to single spaces, as pocketsphinx separates words */
+		end = path + strcspn(path, " \t");
+		expected = end + strspn(end, " \t");
+		*end = '\0';
+
+		if (utterances_count == allocated)
+		{
+			allocated = (allocated ? allocated * 2 : 64);
+			utterances = realloc(utterances, allocated * sizeof(utterance_t));
+			assert(utterances);
+		}
+
+		memset(&utterances[utterances_count], 0, sizeof(utterance_t));
+		utterances[utterances_count].path = malloc(strlen(directory) + strlen(path) + 2);
+		assert(utterances[utterances_count].path);
+		sprintf(utterances[utterances_count].path, "%s%s%s", *path == '/' ? "" : directory, *path == '/' ? "" : "/", path);
+		utterances[utterances_count].expected = normalize_words(expected);
+		utterances_count++;
+
+	}
+
+	free(line);
+	free(directory);
+	fclose(file);
+
+	if (utterances_count == 0)
+		die("No utterances found in corpus %s", corpus);
+
+}
+
+/* Load samples of an utterance, either raw or from a WAV file; returns NULL on failure */
+int16*
+read_audio(const char* path, int* count)
+{
+
+	FILE*		file;
+	unsigned char*	data = NULL;
+	unsigned char*	chunk;
+	unsigned char*	samples = NULL;
+	int16*		result = NULL;
+	long		size;
+	uint32_t	chunk_size;
+	int		format_ok = 0;
+
+	if ((file = fopen(path, "r")) == NULL)
+	{
+		print_log(LOG_ERR, "Unable to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	if (fseek(file, 0, SEEK_END) == -1 || (size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) == -1)
+	{
+		print_log(LOG_ERR, "Unable to read %s: %s", path, strerror(errno));
+		fclose(file);
+		return NULL;
+	}
+	data = malloc(size + 1);
+	assert(data);
+	if (fread(data, 1, size, file) != (size_t) size)
+	{
+		print_log(LOG_ERR, "Unable to read %s", path);
+		fclose(file);
+		free(data);
+		return NULL;
+	}
+	fclose(file);
+
+	if (size >= 12 && memcmp(data, "RIFF", 4) == 0 && memcmp(data + 8, "WAVE", 4) == 0)
+	{
+		/* Walk the chunks, checking the format before taking the samples */
+		for (chunk = data + 12; chunk + 8 <= data + size; chunk += 8 + chunk_size + (chunk_size & 1))
+		{
+			memcpy(&chunk_size, chunk + 4, sizeof(chunk_size));
+			chunk_size = le32toh(chunk_size);
+			if (chunk_size > (uint32_t) (data + size - chunk - 8))
+				chunk_size = data + size - chunk - 8;
+			if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16)
+				format_ok = (chunk[8] | chunk[9] << 8) == 1 && (chunk[10] | chunk[11] << 8) == 1 &&
+					(int) (chunk[12] | chunk[13] << 8 | chunk[14] << 16 | (uint32_t) chunk[15] << 24) == SAMPLE_RATE &&
+					(chunk[22] | chunk[23] << 8) == 16;
+			else if (memcmp(chunk, "data", 4) == 0)
+			{
+				samples = chunk + 8;
+				size = chunk_size;
+				break;
+			}
+		}
+		if (!format_ok || samples == NULL)
+		{
+			print_log(LOG_ERR, "%s is not a 16-bit mono WAV file at %d Hz", path, SAMPLE_RATE);
+			free(data);
+			return NULL;
+		}
+	}
+	else
+	{
+		samples = data;
+	}
+
+	*count = size / sizeof(int16);
+	result = malloc(*count * sizeof(int16) + 1);
+	assert(result);
+	memcpy(result, samples, *count * sizeof(int16));
+	free(data);
+
+	return result;
+
+}
+
+/* Decode utterances until there are none left, reading audio just before decoding it */
+void*
+bench_worker(void* arg)
+{
+
+	bench_thread_t*	thread = arg;
+	feat_t*		feat = ps_get_feat(thread->ps);
+	utterance_t*	utterance;
+	decimator_t	filter;
+	const char*	hyp;
+	int16*		samples;
+	int		count;
+	int32		score;
+	double		started;
+
+	for (;;)
+	{
+
+		pthread_mutex_lock(&next_utterance_lock);
+		utterance = (next_utterance < utterances_count ? &utterances[next_utterance++] : NULL);
+		pthread_mutex_unlock(&next_utterance_lock);
+		if (utterance == NULL)
+			break;
+
+		utterance->thread = thread->index;
+		if ((samples = read_audio(utterance->path, &count)) == NULL)
+			continue;
+		utterance->length = (double) count / SAMPLE_RATE;
+
+		/* Every utterance starts with silence in the filter, as it does with the cepstral mean */
+		if (config_sample_rate != SAMPLE_RATE)
+		{
+			initialize_decimator(&filter);
+			resize_decimator(&filter, count / 2 + 4);
+		}
+
+		if (thread->cmn_size > 0)
+			cmn_prior_set(feat->cmn_struct, thread->cmn);
+
+		/* Decimation is timed with decoding, as kodivc -8 pays for it on every read */
+		started = get_time_ms();
+		if (config_sample_rate != SAMPLE_RATE)
+		{
+			/* Samples are split into phases before any output is written, so this works in place */
+			count /= 2;
+			decimate_pairs(&filter, samples, samples, count);
+		}
+		if (ps_start_utt(thread->ps, NULL) < 0 || process_utterance(thread->ps, samples, count) < 0 || ps_end_utt(thread->ps) < 0)
+			hyp = NULL;
+		else
+			hyp = ps_get_hyp(thread->ps, &score, NULL);
+		utterance->latency = get_time_ms() - started;
+		if (config_sample_rate != SAMPLE_RATE)
+			free_decimator(&filter);
+		utterance->hypothesis = strdup(hyp ? hyp : "");
+		assert(utterance->hypothesis);
+
+		free(samples);
+
+	}
+
+	return NULL;
+
+}
+
+/* Split words into an array pointing into the (modified) string */
+int
+split_words(char* string, char*** words)
+{
+
+	char*	saveptr;
+	char*	word;
+	int	count = 0;
+
+	*words = malloc((strlen(string) / 2 + 1) * sizeof(char*));
+	assert(*words);
+	for (word = strtok_r(string, " ", &saveptr); word; word = strtok_r(NULL, " ", &saveptr))
+		(*words)[count++] = word;
+
+	return count;
+
+}
+
+/* Align hypothesis with the expected words by edit distance, adding up the errors */
+int
+count_word_errors(const char* expected, const char* hypothesis, word_errors_t* totals)
+{
+
+	char*	ref_string = strdup(expected);
+	char*	hyp_string = strdup(hypothesis);
+	char**	ref;
+	char**	hyp;
+	int*	distance;
+	int	n;
+	int	m;
+	int	i;
+	int	j;
+	int	errors;
+
+	assert(ref_string && hyp_string);
+	n = split_words(ref_string, &ref);
+	m = split_words(hyp_string, &hyp);
+
+	distance = malloc((n + 1) * (m + 1) * sizeof(int));
+	assert(distance);
+#define D(i, j)	distance[(i) * (m + 1) + (j)]
+	for (i=0; i<=n; i++)
+		D(i, 0) = i;
+	for (j=0; j<=m; j++)
+		D(0, j) = j;
+	for (i=1; i<=n; i++)
+		for (j=1; j<=m; j++)
+		{
+			D(i, j) = D(i-1, j-1) + (strcmp(ref[i-1], hyp[j-1]) != 0);
+			if (D(i-1, j) + 1 < D(i, j))
+				D(i, j) = D(i-1, j) + 1;
+			if (D(i, j-1) + 1 < D(i, j))
+				D(i, j) = D(i, j-1) + 1;
+		}
+	errors = D(n, m);
+
+	/* Walk back along one of the best alignments to tell the kinds of errors apart */
+	for (i=n, j=m; i > 0 || j > 0; )
+	{
+		if (i > 0 && j > 0 && D(i, j) == D(i-1, j-1) + (strcmp(ref[i-1], hyp[j-1]) != 0))
+		{
+			totals->substitutions += (strcmp(ref[i-1], hyp[j-1]) != 0);
+			i--;
+			j--;
+		}
+		else if (i > 0 && D(i, j) == D(i-1, j) + 1)
+		{
+			totals->deletions++;
+			i--;
+		}
+		else
+		{
+			totals->insertions++;
+			j--;
+		}
+	}
+#undef D
+	totals->words += n;
+
+	free(distance);
+	free(ref);
+	free(hyp);
+	free(ref_string);
+	free(hyp_string);
+
+	return errors;
+
+}
+
+/* Hypotheses match as commands if kodivc would send Kodi the same requests for both */
+int
+same_commands(const char* expected, const char* hypothesis)
+{
+
+	command_list_t*	a;
+	command_list_t*	b;
+	int		clean;
+	int		same;
+	int		i;
+
+	if (mode == MODE_SPELLING || strcmp(expected, hypothesis) == 0)
+		return (strcmp(expected, hypothesis) == 0);
+
+	a = compile_actions(expected, &clean);
+	b = compile_actions(hypothesis, &clean);
+	same = (a->count == b->count);
+	for (i=0; same && i<a->count; i++)
+		same = strcmp(a->commands[i].method, b->commands[i].method) == 0 &&
+			strcmp(a->commands[i].params ? a->commands[i].params : "", b->commands[i].params ? b->commands[i].params : "") == 0 &&
+			a->commands[i].repeats == b->commands[i].repeats;
+	free_command_list(a);
+	free_command_list(b);
+
+	return same;
+
+}
+
+/* Decode the whole corpus at the configured sample rate and print its results; returns utterances decoded */
+int
+run_bench(FILE* results, const int threads_count, const int per_utterance)
+{
+
+	bench_thread_t*		threads;
+	feat_t*			feat;
+	utterance_t*		utterance;
+	word_errors_t		totals = { 0, 0, 0, 0 };
+	struct rusage		usage;
+	double*			latencies;
+	double			started;
+	double			elapsed;
+	double			cpu;
+	double			audio = 0;
+	double			decoding = 0;
+	int			decoded = 0;
+	int			command_errors = 0;
+	int			sentence_errors = 0;
+	char*			expected;
+	char*			hypothesis;
+	char*			name;
+	int			i;
+
+	/* Results of a previous pass are dropped */
+	next_utterance = 0;
+	for (i=0; i<utterances_count; i++)
+	{
+		free(utterances[i].hypothesis);
+		utterances[i].hypothesis = NULL;
+	}
+
+	threads = calloc(threads_count, sizeof(bench_thread_t));
+	assert(threads);
+	for (i=0; i<threads_count; i++)
+	{
+		threads[i].index = i;
+		threads[i].ps = init_decoder();
+		feat = ps_get_feat(threads[i].ps);
+		if (feat && feat->cmn_struct && feat->cmn_struct->veclen <= JOURNAL_CMN_SIZE)
+		{
+			cmn_prior_get(feat->cmn_struct, threads[i].cmn);
+			threads[i].cmn_size = feat->cmn_struct->veclen;
+		}
+	}
+
+	cpu = get_cpu_time();
+	started = get_time_ms();
+	for (i=0; i<threads_count; i++)
+		if (pthread_create(&threads[i].thread, NULL, bench_worker, &threads[i]) != 0)
+			die("Unable to start decoding thread");
+	for (i=0; i<threads_count; i++)
+		pthread_join(threads[i].thread, NULL);
+	elapsed = (get_time_ms() - started) / 1000;
+	cpu = get_cpu_time() - cpu;
+	getrusage(RUSAGE_SELF, &usage);
+
+	latencies = malloc(utterances_count * sizeof(double));
+	assert(latencies);
+
+	for (i=0; i<utterances_count; i++)
+	{
+
+		utterance = &utterances[i];
+		if (utterance->hypothesis == NULL)
+			continue;
+
+		utterance->errors = count_word_errors(utterance->expected, utterance->hypothesis, &totals);
+		utterance->command_error = !same_commands(utterance->expected, utterance->hypothesis);
+		command_errors += utterance->command_error;
+		sentence_errors += (utterance->errors > 0);
+		latencies[decoded++] = utterance->latency;
+		audio += utterance->length;
+		decoding += utterance->latency / 1000;
+
+		if (per_utterance)
+		{
+			expected = json_escape(utterance->expected);
+			hypothesis = json_escape(utterance->hypothesis);
+			name = json_escape(utterance->path);
+			fprintf(results, "{\"path\":\"%s\",\"sample_rate\":%d,\"expected\":\"%s\",\"hypothesis\":\"%s\",\"length_s\":%.3f,\"latency_ms\":%.1f,\"thread\":%d,\"word_errors\":%d,\"command_error\":%s}\n",
+				name, config_sample_rate, expected, hypothesis, utterance->length, utterance->latency, utterance->thread, utterance->errors, utterance->command_error ? "true" : "false");
+			free(expected);
+			free(hypothesis);
+			free(name);
+		}
+
+	}
+
+	qsort(latencies, decoded, sizeof(double), compare_doubles);
+
+	fprintf(results, "{\"profile\":\"%s\",\"sample_rate\":%d,\"mode\":\"%s\",\"threads\":%d,\"utterances\":%d,\"unreadable\":%d,"
+		"\"words\":%d,\"substitutions\":%d,\"deletions\":%d,\"insertions\":%d,\"wer\":%.4f,"
+		"\"sentence_error_rate\":%.4f,\"command_errors\":%d,\"command_error_rate\":%.4f,"
+		"\"audio_s\":%.3f,\"elapsed_s\":%.3f,\"cpu_s\":%.3f,\"rtf\":%.4f,\"cpu_rtf\":%.4f,\"throughput\":%.2f,"
+		"\"latency_ms\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p95\":%.1f,\"p99\":%.1f,\"max\":%.1f},"
+		"\"peak_rss_mb\":%.1f}\n",
+		config_profile ? config_profile->name : "default", config_sample_rate, modes[mode], threads_count, decoded, utterances_count - decoded,
+		totals.words, totals.substitutions, totals.deletions, totals.insertions,
+		totals.words > 0 ? (double) (totals.substitutions + totals.deletions + totals.insertions) / totals.words : 0,
+		decoded > 0 ? (double) sentence_errors / decoded : 0, command_errors, decoded > 0 ? (double) command_errors / decoded : 0,
+		audio, elapsed, cpu, audio > 0 ? decoding / audio : 0, audio > 0 ? cpu / audio : 0, elapsed > 0 ? audio / elapsed : 0,
+		decoded > 0 ? decoding * 1000 / decoded : 0,
+		decoded > 0 ? get_percentile(latencies, decoded, 50) : 0,
+		decoded > 0 ? get_percentile(latencies, decoded, 90) : 0,
+		decoded > 0 ? get_percentile(latencies, decoded, 95) : 0,
+		decoded > 0 ? get_percentile(latencies, decoded, 99) : 0,
+		decoded > 0 ? latencies[decoded-1] : 0,
+		usage.ru_maxrss / 1024.0);
+
+	for (i=0; i<threads_count; i++)
+		ps_free(threads[i].ps);
+	free(threads);
+	free(latencies);
+
+	return decoded;
+
+}
+
+int
+main(int argc, char* argv[])
+{
+
+	int			option;
+	int			threads_count = sysconf(_SC_NPROCESSORS_ONLN);
+	int			per_utterance = 0;
+	int			verbose = 0;
+	int			narrow = 0;
+	int			decoded;
+	FILE*			results;
+	char*			end;
+	int			fd;
+	int			i;
+
+	while ((option = getopt(argc, argv, "a:T:O:j:8suvh")) != -1)
+	{
+		switch (option)
+		{
+			case 'a':
+				free(config_actionfile);
+				config_actionfile = get_absolute_path(optarg);
+				break;
+			case 'T':
+				set_decoder_profile(optarg);
+				break;
+			case 'O':
+				parse_decoder_option(optarg);
+				break;
+			case 'j':
+				threads_count = strtol(optarg, &end, 10);
+				if (*end != '\0' || threads_count < 1)
+					die("Number of threads has to be a positive integer");
+				break;
+			case '8':
+				narrow = 1;
+				break;
+			case 's':
+				mode = MODE_SPELLING;
+				break;
+			case 'u':
+				per_utterance = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				fprintf(stderr, BENCH_USAGE_MESSAGE);
+				return (option == 'h' ? 0 : 1);
+		}
+	}
+
+	if (optind != argc - 1 || threads_count < 1)
+	{
+		fprintf(stderr, BENCH_USAGE_MESSAGE);
+		return 1;
+	}
+
+	/* Only results go to stdout; kodivc messages go to stderr and pocketsphinx messages nowhere */
+	config_loglevel = LOG_ERR;
+	if ((fd = dup(STDOUT_FILENO)) == -1 || (results = fdopen(fd, "w")) == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+		die("Failed to redirect stdout");
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	if (!verbose && freopen("/dev/null", "w", stderr) == NULL)
+		die("Failed to redirect stderr");
+	atexit(cleanup);
+
+	/* Every action kodivc knows of is available, as if Kodi was the newest supported version */
+	kodi_version = KODI_VERSION_MAX;
+	if ((action_table = load_action_table()) == NULL)
+		die("Unable to load actions");
+
+	read_corpus(argv[optind]);
+	if (threads_count > utterances_count)
+		threads_count = utterances_count;
+
+	/* Audio is decoded at the rate it was recorded at, then as kodivc -8 would decode it */
+	decoded = run_bench(results, threads_count, per_utterance);
+	if (narrow)
+	{
+		config_sample_rate = SAMPLE_RATE_NARROW;
+		decoded = run_bench(results, threads_count, per_utterance);
+	}
+
+	for (i=0; i<utterances_count; i++)
+	{
+		free(utterances[i].path);
+		free(utterances[i].expected);
+		free(utterances[i].hypothesis);
+	}
+	free(utterances);
+	fclose(results);
+
+	return (decoded == utterances_count ? 0 : 1);
+
+}
@@ -0,0 +1,320 @@
+/*
+ *
+ * kodivc-microbench - microbenchmarks for the hypothesis processing code
+ * of kodivc
+ *
+ * Copyright (C) Michal Kepien, 2012-2015.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE. If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmarked code is compiled into this program by including kodivc.c,
+ * with its memory allocation routines redirected to counting wrappers.
+ * Requests to Kodi are answered by a stub transport and requests queued
+ * for the worker threads are discarded after every operation, so only
+ * the cost of parsing and dispatching is measured.
+ */
+
+/* kodivc.c is included after the headers below, which have to see this first */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Allocations made by the benchmarked code */
+unsigned long	allocations = 0;
+
+void*
+counting_malloc(size_t size)
+{
+	allocations++;
+	return malloc(size);
+}
+
+void*
+counting_calloc(size_t count, size_t size)
+{
+	allocations++;
+	return calloc(count, size);
+}
+
+void*
+counting_realloc(void* ptr, size_t size)
+{
+	allocations++;
+	return realloc(ptr, size);
+}
+
+char*
+counting_strdup(const char* string)
+{
+	allocations++;
+	return strdup(string);
+}
+
+#undef strdup
+#define malloc		counting_malloc
+#define calloc		counting_calloc
+#define realloc		counting_realloc
+#define strdup		counting_strdup
+
+#include "kodivc-tools.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+#define BENCH_USAGE_MESSAGE		"\n" \
+					"Usage: kodivc-microbench [ -f <filter> ] [ -m <milliseconds> ] [ -r <runs> ]\n" \
+					"\n" \
+					"    -f <filter>       Only run benchmarks with names containing supplied text\n" \
+					"    -m <milliseconds> Minimum duration of a single run (default: 200)\n" \
+					"    -r <runs>         Number of runs, the median of which is reported\n" \
+					"                      (default: 5)\n" \
+					"\n"
+
+#define BENCH_RUNS			5
+#define BENCH_RUN_TIME			200
+#define BENCH_MAX_RUNS			99
+
+/* Results are stored here so that the compiler cannot skip computing them */
+volatile int	sink;
+
+/* Benchmarked operation, called with its argument */
+typedef struct {
+	const char*	name;
+	void		(*function)(const char* argument);
+	const char*	argument;
+} benchmark_t;
+
+/* Responses of the stub transport */
+#define STUB_RESPONSE_PLAYERS		"{\"id\":1,\"jsonrpc\":\"2.0\",\"result\":[{\"playerid\":1,\"type\":\"video\"}]}"
+#define STUB_RESPONSE_DEFAULT		"{\"id\":1,\"jsonrpc\":\"2.0\",\"result\":\"OK\"}"
+
+int
+stub_transport(const char* post, const long timeout, char** dst)
+{
+
+	const char* response = strstr(post, "Player.GetActivePlayers") ? STUB_RESPONSE_PLAYERS : STUB_RESPONSE_DEFAULT;
+
+	if (dst)
+	{
+		*dst = realloc(*dst, strlen(response) + 1);
+		assert(*dst);
+		strcpy(*dst, response);
+	}
+
+	return CURLE_OK;
+
+}
+
+/* Throw away requests queued for Kodi, as no worker threads are running */
+void
+drain_lane(lane_t* lane)
+{
+
+	request_t* request;
+
+	while ((request = lane->head) != NULL)
+	{
+		lane->head = request->next;
+		free_request(request);
+	}
+	lane->tail = NULL;
+
+}
+
+void
+bench_perform_actions(const char* hyp)
+{
+	perform_actions(hyp);
+}
+
+/* Parsing is measured on its own by compiling every time */
+void
+bench_perform_actions_uncached(const char* hyp)
+{
+	cache_flush();
+	perform_actions(hyp);
+}
+
+void
+bench_perform_spelling(const char* hyp)
+{
+	perform_spelling(hyp);
+	spelling.length = 0;
+}
+
+void
+bench_process_hypothesis(const char* hyp)
+{
+	/* Every hypothesis starts from the same, unlocked state */
+	locked = 0;
+	mode = MODE_NORMAL;
+	process_hypothesis(hyp);
+}
+
+void
+bench_find_cmap(const char* string)
+{
+	sink = find_cmap(string);
+}
+
+void
+bench_get_json_rpc_response_int(const char* method)
+{
+	sink = get_json_rpc_response_int(method, NULL, "playerid");
+}
+
+/* Enough words to fill the spelling buffer several times over */
+#define LONG_SPELLING	"ALPHA BRAVO CHARLIE DELTA ECHO FOXTROT GOLF HOTEL INDIA JULIET KILO LIMA MIKE NOVEMBER OSCAR PAPA " \
+			"QUEBEC ROMEO SIERRA TANGO UNIFORM VICTOR WHISKEY X_RAY YANKEE ZULU ZERO ONE TWO THREE FOUR FIVE " \
+			"SIX SEVEN EIGHT NINE COLON COMMA DOT HYPHEN SPACE UPPER ALPHA BRAVO CHARLIE DELTA ECHO FOXTROT " \
+			"GOLF HOTEL INDIA JULIET KILO LIMA MIKE NOVEMBER OSCAR PAPA QUEBEC ROMEO SIERRA TANGO UNIFORM " \
+			"VICTOR WHISKEY X_RAY YANKEE ZULU LOWER ZERO ONE TWO THREE FOUR FIVE SIX SEVEN EIGHT NINE DELETE"
+
+benchmark_t benchmarks[] = {
+	/* Representative hypotheses */
+	{ "actions/single",			bench_perform_actions,			"HOME" },
+	{ "actions/player",			bench_perform_actions,			"PAUSE" },
+	{ "actions/argument",			bench_perform_actions,			"VOLUME FIFTY" },
+	{ "actions/repeat",			bench_perform_actions,			"DOWNWARDS THREE" },
+	{ "actions/batch",			bench_perform_actions,			"DOWNWARDS THREE RIGHT TWO SELECT" },
+	{ "actions/uncached/single",		bench_perform_actions_uncached,		"HOME" },
+	{ "actions/uncached/batch",		bench_perform_actions_uncached,		"DOWNWARDS THREE RIGHT TWO SELECT" },
+	/* Adversarial hypotheses */
+	{ "actions/long",			bench_perform_actions_uncached,		"LEFT RIGHT LEFT RIGHT LEFT RIGHT LEFT RIGHT LEFT RIGHT LEFT RIGHT" },
+	{ "actions/unknown",			bench_perform_actions_uncached,		"THIRTY SEVENTY MAX ONE OFF OKAY" },
+	{ "actions/bad-repeat",			bench_perform_actions_uncached,		"TWO THREE HOME FIVE" },
+	{ "actions/bad-argument",		bench_perform_actions_uncached,		"VOLUME HOME VOLUME" },
+	/* Spelling */
+	{ "spelling/short",			bench_perform_spelling,			"KILO ECHO" },
+	{ "spelling/long",			bench_perform_spelling,			LONG_SPELLING },
+	/* Whole hypotheses, including notifications and mode keywords */
+	{ "process/command",			bench_process_hypothesis,		"NEXT" },
+	{ "process/unlock-batch",		bench_process_hypothesis,		"KODI DOWNWARDS TWO SELECT" },
+	{ "process/spell",			bench_process_hypothesis,		"SPELL" },
+	{ "process/empty",			bench_process_hypothesis,		"" },
+	/* Lookups */
+	{ "cmap/first",				bench_find_cmap,			"ALPHA" },
+	{ "cmap/last",				bench_find_cmap,			"SPACE" },
+	{ "cmap/missing",			bench_find_cmap,			"VOLUME" },
+	{ "rpc/response-int",			bench_get_json_rpc_response_int,	"Player.GetActivePlayers" },
+};
+
+/*
+ * Run the operation count times and return the time it took in nanoseconds.
+ * Freeing the requests an operation queued counts as part of it, just like
+ * it would be done by the worker threads after sending them.
+ */
+double
+run_benchmark(const benchmark_t* benchmark, const unsigned long count)
+{
+
+	unsigned long	i;
+	double		start = get_time_ms();
+
+	for (i=0; i<count; i++)
+	{
+		benchmark->function(benchmark->argument);
+		drain_lane(&action_lane);
+		drain_lane(&notification_lane);
+	}
+
+	return (get_time_ms() - start) * 1000000;
+
+}
+
+int
+main(int argc, char* argv[])
+{
+
+	int		option;
+	const char*	filter = NULL;
+	long		run_time = BENCH_RUN_TIME;
+	int		runs = BENCH_RUNS;
+	unsigned long	count;
+	unsigned long	allocations_start;
+	double		results[BENCH_MAX_RUNS];
+	double		ns;
+	int		i;
+	int		j;
+
+	while ((option = getopt(argc, argv, "f:m:r:h")) != -1)
+	{
+		switch (option)
+		{
+			case 'f':
+				filter = optarg;
+				break;
+			case 'm':
+				run_time = atol(optarg);
+				break;
+			case 'r':
+				runs = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr, BENCH_USAGE_MESSAGE);
+				return (option == 'h' ? 0 : 1);
+		}
+	}
+
+	if (run_time <= 0 || runs < 1 || runs > BENCH_MAX_RUNS)
+	{
+		fprintf(stderr, BENCH_USAGE_MESSAGE);
+		return 1;
+	}
+
+	/* Only the benchmarked code should produce work, not logging */
+	config_loglevel = LOG_CRIT;
+	atexit(cleanup);
+	json_rpc_transport = stub_transport;
+	kodi_version = KODI_VERSION_MAX;
+	action_table = load_action_table();
+
+	printf("%-28s %12s %12s %14s\n", "benchmark", "ns/op", "allocs/op", "ops/s");
+
+	for (i=0; i<ARRAY_SIZE(benchmarks); i++)
+	{
+
+		if (filter && strstr(benchmarks[i].name, filter) == NULL)
+			continue;
+
+		/* Warm up caches and find out how many operations fill a run */
+		for (count = 1; run_benchmark(&benchmarks[i], count) < run_time * 1000000.0 / 10; count *= 2);
+		count *= 10;
+
+		allocations_start = allocations;
+		for (j=0; j<runs; j++)
+			results[j] = run_benchmark(&benchmarks[i], count) / count;
+		qsort(results, runs, sizeof(double), compare_doubles);
+
+		ns = results[runs / 2];
+		printf("%-28s %12.1f %12.2f %14.0f\n", benchmarks[i].name, ns, (double) (allocations - allocations_start) / (runs * count), 1000000000.0 / ns);
+
+	}
+
+	/* Logging was only kept quiet for the benchmarks */
+	config_loglevel = LOG_INFO;
+	report_cache_statistics();
+	cache_flush();
+
+	return 0;
+
+}
@@ -0,0 +1,282 @@
+/*
+ *
+ * kodivc-replay - decodes utterances kept in the journal of kodivc again
+ *
+ * Copyright (C) Michal Kepien, 2012-2015.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE. If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * The decoder is set up by the same code kodivc uses, which is compiled
+ * into this program by including kodivc.c. Every utterance is decoded in
+ * the mode and with the cepstral mean it was originally heard with, so
+ * that hypotheses only differ if models, decoder options or code have
+ * changed. Every decoder profile can also be benchmarked on the journal,
+ * each in a process of its own so that peak memory use is its own too.
+ */
+
+#include "kodivc-tools.c"
+
+#include <sys/wait.h>
+
+#define REPLAY_USAGE_MESSAGE		"\n" \
+					"Usage: kodivc-replay [ -x <directory> ] [ -T <profile> ] [ -O <option>=<value> ]\n" \
+					"                     [ -b ] [ -v ] <journal>\n" \
+					"\n" \
+					"    -x <directory>    Also extract audio of every utterance to supplied\n" \
+					"                      directory as raw 16-bit samples\n" \
+					"    -T <profile>      Decode using supplied decoder profile\n" \
+					"    -O <option>=<value>\n" \
+					"                      Set a pocketsphinx option, overriding the profile\n" \
+					"    -b                Benchmark all decoder profiles instead, reporting\n" \
+					"                      CPU time, peak memory use and how many utterances\n" \
+					"                      were decoded to the original hypothesis (which is\n" \
+					"                      agreement, not accuracy - see kodivc-bench)\n" \
+					"    -v                Do not suppress pocketsphinx messages\n" \
+					"\n"
+
+/* Entries are replayed in the order they were heard in */
+int
+compare_entries(const void* a, const void* b)
+{
+
+	const journal_entry_t* x = *(journal_entry_t* const*) a;
+	const journal_entry_t* y = *(journal_entry_t* const*) b;
+
+	return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+
+}
+
+void
+extract_entry(const char* directory, const journal_entry_t* entry)
+{
+
+	char	path[PATH_MAX];
+	FILE*	file;
+
+	snprintf(path, sizeof(path), "%s/%llu.raw", directory, (unsigned long long) entry->sequence);
+	if ((file = fopen(path, "w")) == NULL || fwrite(entry->data, sizeof(int16_t), entry->samples, file) != entry->samples)
+		print_log(LOG_WARNING, "Unable to extract utterance to %s", path);
+	if (file)
+		fclose(file);
+
+}
+
+/* Decode an utterance in the mode and with the cepstral mean it was originally heard with */
+const char*
+decode_entry(ps_decoder_t* ps, const journal_entry_t* entry)
+{
+
+	feat_t*		feat = ps_get_feat(ps);
+	mfcc_t		cmn[JOURNAL_CMN_SIZE];
+	const char*	hyp;
+	int32		score;
+	int		i;
+
+	mode = (entry->mode == MODE_SPELLING ? MODE_SPELLING : MODE_NORMAL);
+	switch_mode_models(ps, mode);
+
+	if (entry->cmn_size > 0 && feat && feat->cmn_struct && feat->cmn_struct->veclen == entry->cmn_size)
+	{
+		for (i=0; i<entry->cmn_size; i++)
+			cmn[i] = (mfcc_t) entry->cmn[i];
+		cmn_prior_set(feat->cmn_struct, cmn);
+	}
+
+	if (ps_start_utt(ps, NULL) < 0 || process_utterance(ps, entry->data, entry->samples) < 0 || ps_end_utt(ps) < 0)
+		die("Failed to decode utterance %llu", (unsigned long long) entry->sequence);
+	hyp = ps_get_hyp(ps, &score, NULL);
+
+	return (hyp ? hyp : "");
+
+}
+
+/* Decode all utterances with a profile and print a line of results */
+void
+benchmark_profile(journal_header_t* header, journal_entry_t** entries, const int count)
+{
+
+	ps_decoder_t*	ps = init_decoder();
+	struct rusage	usage;
+	double		speech = 0;
+	double		cpu;
+	int		agree = 0;
+	int		i;
+
+	cpu = get_cpu_time();
+	for (i=0; i<count; i++)
+	{
+		agree += (strcmp(decode_entry(ps, entries[i]), entries[i]->hypothesis) == 0);
+		speech += (double) entries[i]->samples / header->sample_rate;
+	}
+	cpu = get_cpu_time() - cpu;
+	getrusage(RUSAGE_SELF, &usage);
+
+	printf("%-12s %10.2fs %8.3f %10.1fMB %7d/%d\n", config_profile ? config_profile->name : "default", cpu, speech > 0 ? cpu / speech : 0, usage.ru_maxrss / 1024.0, agree, count);
+	fflush(stdout);
+
+	ps_free(ps);
+
+}
+
+int
+main(int argc, char* argv[])
+{
+
+	int			option;
+	const char*		directory = NULL;
+	int			benchmark = 0;
+	int			verbose = 0;
+	int			fd;
+	struct stat		st;
+	journal_header_t*	header;
+	journal_entry_t**	entries;
+	journal_entry_t*	entry;
+	int			count = 0;
+	ps_decoder_t*		ps;
+	const char*		hyp;
+	time_t			heard;
+	char			heard_at[20];
+	double			started;
+	int			matched = 0;
+	pid_t			pid;
+	int			i;
+
+	while ((option = getopt(argc, argv, "x:T:O:bvh")) != -1)
+	{
+		switch (option)
+		{
+			case 'x':
+				directory = optarg;
+				break;
+			case 'T':
+				set_decoder_profile(optarg);
+				break;
+			case 'O':
+				parse_decoder_option(optarg);
+				break;
+			case 'b':
+				benchmark = 1;
+				break;
+			case 'v':
+				verbose = 1;
+				break;
+			default:
+				fprintf(stderr, REPLAY_USAGE_MESSAGE);
+				return (option == 'h' ? 0 : 1);
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		fprintf(stderr, REPLAY_USAGE_MESSAGE);
+		return 1;
+	}
+
+	config_loglevel = LOG_WARNING;
+	atexit(cleanup);
+
+	/* The journal is only read, so it can be replayed while kodivc is writing it */
+	if ((fd = open(argv[optind], O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		die("Unable to open utterance journal %s: %s", argv[optind], strerror(errno));
+	if ((size_t) st.st_size < sizeof(journal_header_t))
+		die("%s is not an utterance journal", argv[optind]);
+	header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (header == MAP_FAILED)
+		die("Unable to map utterance journal %s: %s", argv[optind], strerror(errno));
+	if (memcmp(header->magic, JOURNAL_MAGIC, sizeof(header->magic)) != 0 || (size_t) st.st_size < sizeof(journal_header_t) + (size_t) header->entries * header->entry_size)
+		die("%s is not an utterance journal", argv[optind]);
+
+	entries = malloc(header->entries * sizeof(journal_entry_t*));
+	assert(entries);
+	for (i=0; i<(int) header->entries; i++)
+		if (JOURNAL_ENTRY(header, i)->sequence != 0)
+			entries[count++] = JOURNAL_ENTRY(header, i);
+	qsort(entries, count, sizeof(journal_entry_t*), compare_entries);
+
+	/* Decode at the rate the utterances were captured at */
+	config_sample_rate = header->sample_rate;
+	if (!verbose && freopen("/dev/null", "w", stderr) == NULL)
+		die("Failed to redirect stderr");
+
+	if (benchmark)
+	{
+		/* Options given with -O apply to every profile */
+		/* The journal holds what was heard, not what was said, so profiles can only be compared with the original decoding */
+		printf("%-12s %11s %8s %12s %9s\n", "profile", "cpu", "xRT", "peak RSS", "agree");
+		fflush(stdout);
+		for (i=-1; i<(int) ARRAY_SIZE(profiles); i++)
+		{
+			config_profile = (i < 0 ? NULL : &profiles[i]);
+			if ((pid = fork()) == 0)
+			{
+				benchmark_profile(header, entries, count);
+				_exit(0);
+			}
+			if (pid == -1 || waitpid(pid, NULL, 0) == -1)
+				die("Unable to benchmark decoder profile");
+		}
+		printf("\nagree: utterances decoded to the hypothesis originally heard - this is not\n"
+			"accuracy, as that hypothesis may have been wrong; use kodivc-bench with a\n"
+			"labeled corpus to measure accuracy\n");
+		free(entries);
+		munmap(header, st.st_size);
+		return 0;
+	}
+
+	ps = init_decoder();
+
+	printf("%-8s %-19s %8s %10s %10s  %s\n", "sequence", "time", "length", "original", "replayed", "hypotheses");
+
+	for (i=0; i<count; i++)
+	{
+
+		entry = entries[i];
+
+		if (directory)
+			extract_entry(directory, entry);
+
+		started = get_time_ms();
+		hyp = decode_entry(ps, entry);
+		heard = entry->time;
+		strftime(heard_at, sizeof(heard_at), "%Y-%m-%d %H:%M:%S", localtime(&heard));
+
+		matched += (strcmp(hyp, entry->hypothesis) == 0);
+		printf("%-8llu %-19.19s %7.2fs %8.1fms %8.1fms  \"%s\"%s \"%s\"%s\n",
+			(unsigned long long) entry->sequence,
+			heard_at,
+			(double) entry->samples / header->sample_rate,
+			entry->decode_time,
+			get_time_ms() - started,
+			entry->hypothesis,
+			strcmp(hyp, entry->hypothesis) == 0 ? " ==" : " ->",
+			hyp,
+			entry->truncated ? " (truncated)" : "");
+
+	}
+
+	printf("%d of %d utterances decoded to the same hypothesis\n", matched, count);
+
+	ps_free(ps);
+	free(entries);
+	munmap(header, st.st_size);
+
+	return 0;
+
+}
@@ -0,0 +1,57 @@
+/*
+ *
+ * kodivc-tools - code shared by the programs built around kodivc
+ *
+ * Copyright (C) Michal Kepien, 2012-2015.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE. If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * kodivc-bench, kodivc-replay and kodivc-microbench include this file in
+ * place of kodivc.c, which it compiles in without its main(), so they all
+ * get the code of kodivc itself and the measuring helpers below.
+ */
+
+#define KODIVC_NO_MAIN
+#include "kodivc.c"
+
+/* User and system time used by the process so far (s) */
+double
+get_cpu_time(void)
+{
+
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+
+}
+
+int
+compare_doubles(const void* a, const void* b)
+{
+	return (*(const double *) a > *(const double *) b) - (*(const double *) a < *(const double *) b);
+}
+
+/* Nearest-rank percentile of sorted values */
+double
+get_percentile(const double* sorted, const int count, const int percentile)
+{
+	return sorted[(count * percentile + 99) / 100 - 1];
+}
@@ -24,24 +24,47 @@
  *
  */
 
+/* CPU affinity and real-time scheduling */
+#define _GNU_SOURCE
+
 /* CURL headers */
 #include <curl/curl.h>
 
 /* pocketsphinx headers */
 #include <sphinxbase/ad.h>
 #include <sphinxbase/cont_ad.h>
+#include <sphinxbase/feat.h>
+#include <sphinxbase/ngram_model.h>
 #include <pocketsphinx.h>
 
 /* Other headers */
+#include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -53,8 +76,15 @@
 #define VERSION				"0.5"
 #define USAGE_MESSAGE			"\n" \
 					"Usage: kodivc [ -H <host> ] [ -P <port> ] [ -u <username> ] [ -p <password> ]\n" \
-					"              [ -d ] [ -D <device> ] [ -l ] [ -L <file>|syslog ] [ -n ]\n" \
-					"              [ -r <pidfile> ] [ -t ] [ -V ] [ -h ]\n" \
+					"              [ -d ] [ -D <device> ] [ -l ] [ -L <file>|syslog ] [ -j ]\n" \
+					"              [ -v <level> ] [ -n ] [ -r <pidfile> ] [ -s <statefile> ]\n" \
+					"              [ -c <confidence>[,<confidence>] ] [ -a <actionfile> ]\n" \
+					"              [ -C <socket> ] [ -J <journal>[,<entries>] ]\n" \
+					"              [ -R <priority>[:<cpus>[:<cpus>]] ] [ -I <snapshotfile> ]\n" \
+					"              [ -N <decoders> ] [ -T <profile> ] [ -O <option>=<value> ]\n" \
+					"              [ -E <tracefile> ] [ -M <port> ] [ -S <port> ]\n" \
+					"              [ -F <host>:<port> ] [ -W <seconds> ] [ -8 ] [ -t ] [ -V ]\n" \
+					"              [ -h ]\n" \
 					"\n" \
 					"    -H <host>         Hostname or IP address of the Kodi instance you want\n" \
 					"                      to control (default: localhost)\n" \
@@ -67,8 +97,53 @@
 					"    -l                Disable locking/unlocking\n" \
 					"    -L <file>|syslog  Enable logging to file (supply path)\n" \
 					"                      or to syslog (supply \"syslog\")\n" \
+					"    -j                Write log file as JSON lines\n" \
+					"    -v <level>        Only log messages of supplied level or more severe:\n" \
+					"                      error, warning, notice, info (default) or debug;\n" \
+					"                      send SIGUSR1/SIGUSR2 to raise/lower it at runtime\n" \
 					"    -n                Disable GUI notifications\n" \
 					"    -r <pidfile>      Write PID to supplied pidfile\n" \
+					"    -s <statefile>    Save calibration state to supplied file and restore\n" \
+					"                      it at startup instead of recalibrating\n" \
+					"    -c <confidence>[,<confidence>]\n" \
+					"                      Ignore commands recognized with lower confidence\n" \
+					"                      (0-1) in normal mode and, if supplied separately,\n" \
+					"                      in spelling mode (default: 0, accept everything)\n" \
+					"    -a <actionfile>   Load actions from supplied file instead of using\n" \
+					"                      built-in ones; send SIGHUP to reload it\n" \
+					"    -C <socket>       Accept commands and control requests on supplied\n" \
+					"                      Unix socket while listening\n" \
+					"    -J <journal>[,<entries>]\n" \
+					"                      Keep audio of the last utterances (default: 32)\n" \
+					"                      in supplied file for replaying with kodivc-replay\n" \
+					"    -R <priority>[:<cpus>[:<cpus>]]\n" \
+					"                      Listen at supplied real-time priority (1-49) with\n" \
+					"                      memory locked, optionally pinned to a list of CPUs\n" \
+					"                      (e.g. 2,3), and send requests to Kodi from another\n" \
+					"                      list of CPUs\n" \
+					"    -I <snapshotfile> Save methods supported by Kodi to supplied file and\n" \
+					"                      use them at startup instead of asking Kodi first\n" \
+					"    -N <decoders>     Number of utterances decoded at the same time\n" \
+					"                      (1-8, default: 1)\n" \
+					"    -T <profile>      Tune the decoder for low-power, balanced or accurate\n" \
+					"                      recognition (default: pocketsphinx defaults)\n" \
+					"    -O <option>=<value>\n" \
+					"                      Set a pocketsphinx option, e.g. beam=1e-40,\n" \
+					"                      overriding the profile; may be given repeatedly\n" \
+					"    -E <tracefile>    Write a timeline of audio capture, decoding and\n" \
+					"                      requests to supplied file for viewing in Perfetto\n" \
+					"    -M <port>         Index Kodi libraries to play titles by name, keeping\n" \
+					"                      the index current using notifications Kodi sends to\n" \
+					"                      TCP port supplied (usually 9090)\n" \
+					"    -S <port>         Run as a decode server for capture clients connecting\n" \
+					"                      to supplied TCP port, which act on what it hears\n" \
+					"    -F <host>:<port>  Run as a capture client, streaming audio to a decode\n" \
+					"                      server instead of decoding it here\n" \
+					"    -W <seconds>      Warm up decoders at startup by loading models into\n" \
+					"                      memory and decoding synthetic audio, and again after\n" \
+					"                      supplied seconds idle (0: only at startup)\n" \
+					"    -8                Process audio at 8 kHz, which is all the acoustic\n" \
+					"                      model uses, halving decoding work\n" \
 					"    -t                Enable test mode - enter commands on stdin\n" \
 					"    -V                Print version information and exit\n" \
 					"    -h                Print this help message\n" \
@@ -82,8 +157,63 @@
 #define JSON_RPC_URL_AUTH		"http://%s:%s@%s:%s/jsonrpc"
 #define JSON_RPC_POST			"{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"id\":1}"
 #define JSON_RPC_POST_WITH_PARAMS	"{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":{%s},\"id\":1}"
+#define JSON_RPC_PING			"{\"jsonrpc\":\"2.0\",\"method\":\"JSONRPC.Ping\",\"id\":1}"
+#define HEALTH_FAILURE_THRESHOLD	3
+#define HEALTH_TIMEOUT_MIN		250
+#define HEALTH_TIMEOUT_MAX		2000
+#define HEALTH_PROBE_INTERVAL_MIN	1000
+#define HEALTH_PROBE_INTERVAL_MAX	30000
+#define JSON_RPC_BULK_TIMEOUT		30000
+#define NOTIFICATION_INTERVAL		500
+#define REPEAT_INTERVAL			200
+#define REPEAT_UNTIL_STOPPED		150
+#define LOG_RING_SIZE			256
+#define LOG_MESSAGE_SIZE		496
+#define TRACE_BUFFER_EVENTS		4096	/* per thread */
+#define TRACE_DETAIL_SIZE		64
+#define TRACE_FLUSH_INTERVAL		250
+#define STATE_SAVE_INTERVAL		600000
+#define STATE_NOISE_DRIFT		8
+#define NBEST_SIZE			5
 #define MAX_ACTIONS			5
-#define SPELLING_BUFFER_SIZE		256
+#define ACTION_FILE_MAX_TOKENS		64
+#define CONTROL_CLIENTS			8
+#define CONTROL_LINE_SIZE		4096
+#define COMMAND_CACHE_SIZE		32
+#define SPELLING_BUFFER_SIZE		64
+#define SPELLING_DEBOUNCE		400
+#define MEDIA_PAGE_SIZE			500
+#define MEDIA_NOTIFICATION_SIZE		65536
+#define MEDIA_POLL_INTERVAL		500
+#define MEDIA_RECONNECT_INTERVAL	60000
+#define MEDIA_QUERY_MAX			64
+#define SERVER_SESSIONS			16
+#define SERVER_MESSAGE_SIZE		16384
+#define SERVER_CALIBRATION_TIME		2	/* seconds of audio a session is calibrated on */
+#define SERVER_SEND_TIMEOUT		1000
+#define SERVER_CONNECT_TIMEOUT		3000	/* for a capture client to connect and learn the rate */
+#define SERVER_QUEUE_SIZE		(4*SERVER_MESSAGE_SIZE)	/* about 2 s of audio a capture client holds back */
+#define SERVER_RECONNECT_INTERVAL	5000
+#define MESSAGE_HEADER_SIZE		5	/* type and big-endian length of payload */
+#define MESSAGE_RATE			'R'	/* from server: sample rate to stream at */
+#define MESSAGE_MODE			'M'	/* from client: mode of utterances from now on */
+#define MESSAGE_AUDIO			'A'	/* from client: little-endian 16-bit samples */
+#define MESSAGE_HYPOTHESIS		'Y'	/* from server: mode, confidence, timings and hypothesis */
+#define JOURNAL_MAGIC			"KODIVCJ1"
+#define JOURNAL_ENTRIES			32
+#define JOURNAL_SECONDS			10	/* longest utterance kept in full */
+#define JOURNAL_CMN_SIZE		16
+#define JOURNAL_HYPOTHESIS_SIZE		256
+#define DECODERS_MAX			8
+#define DECODER_IDLE_TIME		300000	/* after which a decoder counts as cold again */
+#define WARMUP_DURATION			300	/* of synthetic audio (ms) */
+#define AUDIO_BLOCK_SIZE		4096	/* samples read at once while listening */
+#define RT_PRIORITY_MAX			49	/* stay below threaded interrupt handlers */
+#define LATENCY_BUCKETS			8
+#define SAMPLE_RATE			16000
+#define SAMPLE_RATE_NARROW		8000
+#define DECIMATOR_TAPS			16	/* non-zero taps of the even phase of a 31-tap half-band filter */
+#define DECIMATOR_ODD_DELAY		8	/* the odd phase is a single 0.5 tap delayed by this many samples */
 #define KODI_VERSION_EDEN		11
 #define KODI_VERSION_FRODO		12
 #define KODI_VERSION_GOTHAM		13
@@ -94,11 +224,12 @@
 
 /* Language model files */
 #define MODEL_HMM			MODELDIR "/hmm/en_US/hub4wsj_sc_8k"
-#define MODEL_LM			MODELDIR "/lm/en/kodivc/kodivc.lm"
-#define MODEL_DICT			MODELDIR "/lm/en/kodivc/normal.dic"
+#define MODEL_MODE_DIR			MODELDIR "/lm/en/kodivc"
+#define MODEL_LM			MODEL_MODE_DIR "/normal.lm"
 
 /* Macros */
 #define ARRAY_SIZE(array)		(sizeof(array) / sizeof(array[0]))
+#define JOURNAL_ENTRY(header, i)	((journal_entry_t*) ((char*) (header) + sizeof(journal_header_t) + (size_t) (i) * (header)->entry_size))
 
 /* Modes of operation */
 enum mode_t {
@@ -107,12 +238,128 @@ enum mode_t {
 	MODE_NONE,
 };
 
+/* Utterances whose decoding latency is reported separately */
+enum latency_class_t {
+	LATENCY_FIRST,		/* first utterance of a decoder */
+	LATENCY_IDLE,		/* first one after a decoder sat idle */
+	LATENCY_STEADY,
+	LATENCY_NONE,
+};
+
+/* Circuit breaker states */
+enum circuit_t {
+	CIRCUIT_CLOSED,
+	CIRCUIT_OPEN,
+	CIRCUIT_HALF_OPEN,
+};
+
+/* Log record passed to the background log writer */
+typedef struct {
+	unsigned int	sequence;	/* ring slot sequence number */
+	int		level;
+	double		time;		/* monotonic time (ms) */
+	char		message[LOG_MESSAGE_SIZE];
+} log_record_t;
+
+/* Lock-free multi-producer ring of log records with a single writer thread */
+typedef struct {
+	log_record_t	ring[LOG_RING_SIZE];
+	unsigned int	head;		/* next record to write out */
+	unsigned int	tail;		/* next free slot */
+	unsigned int	dropped;	/* records lost because the ring was full */
+	sem_t		pending;
+	pthread_t	writer;
+	int		running;
+	int		stopping;
+	pid_t		pid;
+	double		wall_offset;	/* wall clock minus monotonic clock (ms) */
+} logger_t;
+
+/* Span, instant event or thread name recorded for the trace file */
+typedef struct {
+	char		phase;		/* 'X' span, 'i' instant event, 'M' thread name */
+	int		tid;
+	const char*	category;	/* static strings only */
+	const char*	name;		/* static strings only */
+	double		start;		/* monotonic time (ms) */
+	double		duration;	/* ms */
+	char		detail[TRACE_DETAIL_SIZE];
+} trace_event_t;
+
+/* Single-producer ring of trace events recorded by one thread */
+typedef struct trace_buffer_s {
+	trace_event_t	ring[TRACE_BUFFER_EVENTS];
+	unsigned int	head;		/* next event to write out */
+	unsigned int	tail;		/* next free slot */
+	int		tid;
+	int		owned;		/* by a running thread, otherwise free for the next one */
+	struct trace_buffer_s* next;
+} trace_buffer_t;
+
+/* Trace-event JSON file filled from per-thread buffers by a writer thread */
+typedef struct {
+	FILE*		file;
+	pthread_mutex_t	lock;		/* guards the list of buffers */
+	pthread_cond_t	wakeup;
+	pthread_t	writer;
+	pthread_key_t	key;		/* buffer of the calling thread */
+	int		running;
+	int		stopping;
+	int		threads;	/* thread IDs handed out */
+	unsigned int	dropped;	/* events lost because a buffer was full */
+	unsigned long	written;
+	pid_t		pid;
+	trace_buffer_t*	buffers;
+} tracer_t;
+
 /* Structure passed to CURL callback */
 typedef struct {
 	char**	dst;	/* destination buffer */
 	int	dst_s;	/* destination buffer size */
 } curl_userdata_t;
 
+/* Health of the Kodi instance being controlled */
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wakeup;
+	pthread_t	prober;		/* background half-open prober */
+	int		prober_started;
+	int		stopping;
+	int		circuit;	/* circuit breaker state */
+	int		failures;	/* consecutive failed requests */
+	int		samples;	/* number of RTT samples collected */
+	double		srtt;		/* smoothed round-trip time (ms) */
+	double		rttvar;		/* round-trip time variation (ms) */
+	long		probe_interval;	/* delay before next probe (ms) */
+} health_t;
+
+/* Outgoing JSON-RPC request */
+typedef struct request_s {
+	char*			method;
+	char*			params;
+	int			repeats;
+	int			sent;		/* number of times already sent */
+	long			interval;	/* delay between repeats (ms) */
+	double			due;		/* when to send next repeat (ms) */
+	struct request_s*	next;
+} request_t;
+
+/* Queue of outgoing requests served by a dedicated worker thread */
+typedef struct {
+	pthread_mutex_t	lock;
+	pthread_cond_t	wakeup;
+	pthread_t	worker;
+	const char*	name;
+	int		started;
+	int		stopping;
+	int		droppable;	/* keep only the latest request, drop it at exit */
+	long		interval;	/* minimum delay between requests (ms) */
+	double		last_sent;
+	request_t*	current;	/* request being sent right now */
+	request_t*	head;
+	request_t*	tail;
+} lane_t;
+
 /* Structure describing an action */
 typedef struct {
 	char*		word;
@@ -121,19 +368,361 @@ typedef struct {
 	const char**	req;
 	int		req_size;
 	int		repeats;
+	long		interval;
 	int		needs_player_id;
 	int		needs_argument;
 } action_t;
 
+/* Command compiled from a hypothesis, ready to be sent */
+typedef struct {
+	char*		word;
+	char*		method;
+	char*		params;		/* params without player ID */
+	int		repeats;
+	long		interval;
+	int		needs_player_id;
+} command_t;
+
+/* List of compiled commands */
+typedef struct {
+	command_t*	commands;
+	int		count;
+} command_list_t;
+
+/* Entry in compiled command cache */
+typedef struct cache_entry_s {
+	char*			key;		/* normalized hypothesis */
+	unsigned int		hash;
+	command_list_t*		list;
+	struct cache_entry_s*	prev;
+	struct cache_entry_s*	next;
+} cache_entry_t;
+
+/* Compiled command cache, ordered from most to least recently used */
+typedef struct {
+	cache_entry_t*	head;
+	cache_entry_t*	tail;
+	int		count;
+	int		generation;	/* action table generation entries were compiled for */
+	unsigned long	hits;
+	unsigned long	misses;
+} command_cache_t;
+
+/* Listening state persisted across restarts */
+typedef struct {
+	int		calibrated;	/* VAD calibration values are valid */
+	int32		noise_level;
+	int32		thresh_sil;
+	int32		thresh_speech;
+	mfcc_t*		cmn;		/* cepstral mean vector */
+	int		cmn_size;
+	double		saved_at;
+	int		sample_rate;	/* rate the values above were computed at */
+} state_t;
+
+/* Outcome of commands processed on behalf of a control client */
+typedef struct {
+	int		recording;
+	char*		commands;	/* comma-separated JSON objects, one per command */
+	int		cached;
+	int		invalid;
+} dispatch_t;
+
+/* Connection to the control socket */
+typedef struct {
+	int		fd;
+	char		buffer[CONTROL_LINE_SIZE];
+	int		length;
+} control_client_t;
+
+/* How late the listening loop woke up from sleeps */
+typedef struct {
+	unsigned long	count;
+	double		total;		/* ms */
+	double		max;		/* ms */
+	unsigned long	buckets[LATENCY_BUCKETS];
+} latency_t;
+
+/* Layout of the utterance journal file, shared with kodivc-replay */
+typedef struct {
+	char		magic[8];
+	uint32_t	entries;
+	uint32_t	max_samples;	/* per entry */
+	uint32_t	sample_rate;
+	uint32_t	entry_size;
+	uint64_t	sequence;	/* of the last complete entry */
+} journal_header_t;
+
+typedef struct {
+	uint64_t	sequence;	/* 0 while the entry is being written */
+	int64_t		time;
+	double		decode_time;	/* from start of utterance to hypothesis (ms) */
+	double		confidence;
+	int32_t		score;
+	uint32_t	samples;
+	int32_t		truncated;
+	int32_t		mode;
+	int32_t		cmn_size;
+	float		cmn[JOURNAL_CMN_SIZE];	/* cepstral mean at the start of the utterance */
+	char		hypothesis[JOURNAL_HYPOTHESIS_SIZE];
+	int16_t		data[];
+} journal_entry_t;
+
+/* Mapped utterance journal */
+typedef struct {
+	journal_header_t*	header;
+	size_t			size;
+	uint64_t		next;		/* entries begun, including ones still being decoded */
+} journal_t;
+
+/* Utterance handed from capture to a decoder, and its hypothesis once decoded */
+typedef struct decoder_job_s {
+	int16*		samples;
+	int		count;
+	int		size;
+	int		complete;	/* no more samples will be appended */
+	int		done;		/* hypothesis is ready */
+	int		restart;	/* mode changed while decoding, start over */
+	mode_t		mode;		/* mode the utterance is decoded in */
+	double		started;
+	journal_entry_t* entry;
+	char*		hyp;
+	int32		score;
+	double		confidence;
+	double		times[3];	/* speech, CPU and wall time (s) */
+	mfcc_t		cmn[JOURNAL_CMN_SIZE];	/* cepstral mean the utterance was decoded with */
+	int		cmn_size;
+	struct decoder_job_s* worker_next;	/* in the queue of its decoder */
+	struct decoder_job_s* next;	/* in the order utterances were heard in */
+	struct decoder_worker_s* worker;
+	struct session_s* session;	/* capture client which heard it, if decoded for one */
+	double		finished;	/* when speech ended (ms) */
+	double		decoded;	/* when the hypothesis was ready (ms) */
+	int		latency_class;
+} decoder_job_t;
+
+/* Capture client of the decode server, whose audio goes through voice activity detection of its own */
+typedef struct session_s {
+	ad_rec_t	ad;		/* read by voice activity detection, see read_session_audio() */
+	int		fd;
+	char		name[NI_MAXHOST + NI_MAXSERV + 1];	/* address of the client */
+	mode_t		mode;
+	cont_ad_t*	cont;
+	int		calibrated;
+	decoder_job_t*	job;		/* utterance being heard */
+	int32		timestamp;	/* when speech was last heard */
+	int		utterances;
+	int16*		samples;	/* received, not yet read by voice activity detection */
+	int		start;
+	int		count;
+	int		size;
+	char		buffer[SERVER_MESSAGE_SIZE];	/* partial message */
+	int		length;
+} session_t;
+
+/* Connection of a capture client to its decode server */
+typedef struct {
+	int		fd;
+	struct addrinfo* addresses;	/* of the server, while connecting */
+	struct addrinfo* address;	/* being connected to, NULL once connected */
+	double		deadline;	/* for connecting and receiving the rate */
+	int		ready;		/* rate received, audio is streamed */
+	mode_t		mode;		/* last mode queued */
+	char		buffer[SERVER_MESSAGE_SIZE];	/* partial message */
+	int		length;
+	char		queue[SERVER_QUEUE_SIZE];	/* messages not sent yet */
+	int		queued;
+	int		dropping;	/* audio was dropped since the queue last ran empty */
+} uplink_t;
+
+/* Decoder instance with a thread of its own */
+typedef struct decoder_worker_s {
+	ps_decoder_t*	ps;
+	pthread_t	thread;
+	int		started;
+	mode_t		mode;		/* mode its models are switched to */
+	pthread_cond_t	wakeup;
+	decoder_job_t*	head;
+	decoder_job_t*	tail;
+	unsigned long	decoded;	/* utterances */
+	double		last_decoded;	/* ms */
+} decoder_worker_t;
+
+/* Time from the end of speech to its hypothesis */
+typedef struct {
+	unsigned long	count;
+	double		total;		/* ms */
+	double		max;		/* ms */
+} decode_latency_t;
+
+/* Model file mapped to keep its pages in memory */
+typedef struct {
+	void*		data;
+	size_t		size;
+	int		locked;
+} model_mapping_t;
+
+/* Decoders utterances are handed to round-robin */
+typedef struct {
+	decoder_worker_t* workers;
+	int		size;
+	int		next;
+	int		stopping;
+	pthread_mutex_t	lock;
+	int		notify[2];	/* written to whenever a hypothesis is ready */
+	decoder_job_t*	head;		/* oldest utterance not delivered yet */
+	decoder_job_t*	tail;
+} decoder_pool_t;
+
+/* SIMD vector of samples being filtered */
+typedef float v4sf __attribute__ ((vector_size (16)));
+
+/* Anti-aliasing decimator from 16 kHz to 8 kHz, split into even and odd phases */
+typedef struct {
+	v4sf		taps[DECIMATOR_TAPS];	/* even phase taps, each broadcast to all lanes */
+	float*		even;			/* history followed by even input samples */
+	float*		odd;			/* history followed by odd input samples */
+	int16*		input;
+	int		size;			/* capacity in output samples */
+	int		pending;		/* an even sample is waiting for its odd pair */
+	int16		carry;
+} decimator_t;
+
+/* Text entered in spelling mode */
+typedef struct {
+	char*		text;
+	int		length;
+	int		size;
+	char*		sent;		/* text last sent to Kodi */
+	double		due;		/* when to send pending changes (ms), 0 if none */
+} spelling_t;
+
 /* Command to character mapping */
 typedef struct {
 	char*		string;
 	int		character;
 } cmap_t;
 
+/* Named set of decoder options */
+typedef struct {
+	const char*	name;
+	const char**	options;	/* name/value pairs, NULL-terminated */
+} profile_t;
+
+/* Methods supported by a Kodi instance, as reported by JSONRPC.Introspect */
+typedef struct {
+	char*		host;		/* host:port the snapshot was taken of */
+	int		version;
+	char**		methods;	/* sorted */
+	int		methods_count;
+} capabilities_t;
+
+/* What a word does to the commands compiled so far */
+enum grammar_op_t {
+	GRAMMAR_UNKNOWN,
+	GRAMMAR_ACTION,
+	GRAMMAR_ARGUMENT,
+	GRAMMAR_REPEAT,
+	GRAMMAR_NOT_REPEATABLE,
+	GRAMMAR_NOTHING_TO_REPEAT,
+	GRAMMAR_INVALID_ARGUMENT
+};
+
+/* Transition of the grammar state machine on a single word */
+typedef struct {
+	int		op;		/* GRAMMAR_* */
+	int		next;		/* state after the word */
+	int		index;		/* action, or argument of the pending action */
+} transition_t;
+
+/* Command grammar compiled from an action table: state 0 is the start,
+   states 1..n follow action n-1, states n+1..2n wait for an argument to it */
+typedef struct {
+	char**		words;		/* sorted */
+	int		words_count;
+	int		states_count;
+	transition_t*	transitions;	/* a row per state, a column per word plus one for unknown words */
+} grammar_t;
+
+/* Action and character mapping databases, swapped as a whole when reloaded */
+typedef struct {
+	action_t**	actions;
+	int		actions_count;
+	grammar_t	grammar;
+	cmap_t**	cmap;
+	int		cmap_count;
+	char**		strings;	/* argument strings owned by the table */
+	int		strings_count;
+	int		generation;
+	capabilities_t*	capabilities;	/* methods actions may use, NULL if unknown */
+} action_table_t;
+
+/* Kind of library item which can be played by name */
+typedef struct {
+	const char*	type;		/* as reported by library notifications */
+	const char*	library;	/* namespace of the methods below */
+	const char*	list_method;
+	const char*	list_key;	/* array of items in the listing */
+	const char*	details_method;
+	const char*	details_key;	/* item in the details */
+	const char*	id_key;		/* also used to open the item */
+} media_type_t;
+
+/* Item of the media library index */
+typedef struct {
+	const media_type_t* type;
+	int		id;
+	char*		key;		/* normalized title */
+	char*		label;		/* title as shown by Kodi */
+} media_item_t;
+
+/* Local index of Kodi libraries, kept current by library notifications */
+typedef struct {
+	pthread_mutex_t	lock;		/* guards items */
+	pthread_cond_t	wakeup;
+	media_item_t**	items;		/* sorted by key */
+	int		count;
+	int		size;
+	pthread_t	listener;
+	int		started;
+	int		stopping;
+	int		indexed;	/* libraries were indexed at least once */
+} media_index_t;
+
 /* Names of modes of operation */
 const char*	loglevels[] = { "EMERGENCY", "ALERT", "CRITICAL", "ERROR", "WARNING", "NOTICE", "INFO", "DEBUG" };
+const char*	loglevel_names[] = { "emergency", "alert", "critical", "error", "warning", "notice", "info", "debug" };
 const char*	modes[] = { "normal", "spelling" };
+const char*	latency_classes[] = { "first utterance", "after idle", "steady state" };
+const char*	latency_keys[] = { "first", "idle", "steady" };
+
+/* Decoder tuning profiles - narrower beams, fewer Gaussians and skipped frames trade accuracy for CPU time and memory */
+const char*	profile_low_power[] = {
+	"-beam", "1e-30", "-wbeam", "1e-20", "-pbeam", "1e-30", "-lpbeam", "1e-20", "-lponlybeam", "1e-20",
+	"-maxhmmpf", "1500", "-maxwpf", "10", "-topn", "2", "-ds", "2", "-fwdflat", "no", "-bestpath", "no",
+	NULL
+};
+const char*	profile_balanced[] = {
+	"-beam", "1e-40", "-wbeam", "1e-25", "-pbeam", "1e-40", "-lpbeam", "1e-30", "-lponlybeam", "1e-25",
+	"-maxhmmpf", "3000", "-maxwpf", "20", "-topn", "3", "-ds", "1", "-fwdflat", "no", "-bestpath", "yes",
+	NULL
+};
+const char*	profile_accurate[] = {
+	"-beam", "1e-60", "-wbeam", "1e-40", "-pbeam", "1e-60", "-lpbeam", "1e-50", "-lponlybeam", "1e-40",
+	"-maxhmmpf", "-1", "-maxwpf", "-1", "-topn", "4", "-ds", "1", "-fwdflat", "yes", "-bestpath", "yes",
+	NULL
+};
+const media_type_t media_types[] = {
+	{ "movie", "VideoLibrary", "VideoLibrary.GetMovies", "movies", "VideoLibrary.GetMovieDetails", "moviedetails", "movieid" },
+	{ "musicvideo", "VideoLibrary", "VideoLibrary.GetMusicVideos", "musicvideos", "VideoLibrary.GetMusicVideoDetails", "musicvideodetails", "musicvideoid" },
+	{ "album", "AudioLibrary", "AudioLibrary.GetAlbums", "albums", "AudioLibrary.GetAlbumDetails", "albumdetails", "albumid" },
+	{ "artist", "AudioLibrary", "AudioLibrary.GetArtists", "artists", "AudioLibrary.GetArtistDetails", "artistdetails", "artistid" },
+};
+profile_t	profiles[] = {
+	{ "low-power", profile_low_power },
+	{ "balanced", profile_balanced },
+	{ "accurate", profile_accurate },
+};
 
 /* Global configuration variables */
 char*		config_json_rpc_host;
@@ -145,34 +734,118 @@ char*		config_audio_device;
 int		config_locking = 1;
 FILE*		config_logfile;
 int		config_syslog = 0;
+int		config_log_json = 0;
+volatile sig_atomic_t config_loglevel = LOG_INFO;
 int		config_notifications = 1;
 char*		config_pidfile;
+char*		config_statefile;
 int		config_test_mode = 0;
+int		config_sample_rate = SAMPLE_RATE;
+char*		config_actionfile;
+char*		config_control_socket;
+char*		config_journalfile;
+int		config_journal_entries = JOURNAL_ENTRIES;
+int		config_rt_priority = 0;
+int		config_decoders = 1;
+profile_t*	config_profile = NULL;
+char**		config_decoder_options;	/* name/value pairs given with -O */
+int		config_decoder_options_count = 0;
+cpu_set_t*	config_listening_cpus;
+cpu_set_t*	config_dispatch_cpus;
+char*		config_capabilitiesfile;
+char*		config_tracefile;
+char*		config_media_port;
+char*		config_server_port;
+char*		config_decode_server;
+int		config_warmup_interval = -1;	/* s, disabled if negative */
+double		config_min_confidence[MODE_NONE] = { 0, 0 };
 
 /* Action database */
-action_t**	actions = NULL;
-int		actions_count = 0;
+action_table_t*	action_table = NULL;
+action_table_t*	pending_action_table = NULL;
+pthread_t	reload_thread;
+int		reloading = 0;		/* reload_thread still has to be joined */
+int		reload_done = 0;	/* set by reload_thread when it is finished */
+int		action_tables_created = 0;
+capabilities_t*	capabilities = NULL;
+capabilities_t*	stale_capabilities = NULL;
+capabilities_t*	revalidated_capabilities = NULL;	/* handed over by revalidator when Kodi changed */
+pthread_t	revalidator;
+int		revalidating = 0;	/* revalidator still has to be joined */
+media_index_t	media_index = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+};
+command_cache_t	command_cache;
 const char*	repeatable[] = { "DOWNWARDS", "LEFT", "NEXT", "PREVIOUS", "RIGHT", "UPWARDS" };
 int		repeatable_size = ARRAY_SIZE(repeatable);
+const char*	repeat_intervals[] = { "NEXT:500", "PREVIOUS:500" };
+int		repeat_intervals_size = ARRAY_SIZE(repeat_intervals);
 const char*	repeat_args[] = { "ALL:all", "ONE:one", "OFF:off", "cycle" };
 int		repeat_args_size = ARRAY_SIZE(repeat_args);
 const char*	volume_args[] = { "TEN:10", "TWENTY:20", "THIRTY:30", "FORTY:40", "FIFTY:50", "SIXTY:60", "SEVENTY:70", "EIGHTY:80", "NINETY:90", "MAX:100" };
 int		volume_args_size = ARRAY_SIZE(volume_args);
 
-/* Command to character mapping database */
-cmap_t**	cmap = NULL;
-int		cmap_count = 0;
-
 /* Miscellaneous variables */
 int		locked = 1;
 mode_t		mode = MODE_NORMAL;
-char		spelling_buffer[SPELLING_BUFFER_SIZE];
+spelling_t	spelling;
 int		spelling_case = 0;
 int		kodi_version;
+unsigned long	hypotheses_accepted[MODE_NONE];
+unsigned long	hypotheses_rejected[MODE_NONE];
+state_t		state;
+decimator_t	decimator;
+dispatch_t	dispatch;
+journal_t	journal;
+latency_t	wakeups;
+decoder_pool_t	pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.notify = { -1, -1 },
+};
+const double	latency_bounds[LATENCY_BUCKETS-1] = { 1, 2, 5, 10, 20, 50, 100 };
+decode_latency_t decode_latency[LATENCY_NONE];
+model_mapping_t* model_mappings;
+int		model_mappings_count = 0;
+int		control_socket = -1;
+control_client_t control_clients[CONTROL_CLIENTS];
+int		server_socket = -1;
+session_t*	sessions[SERVER_SESSIONS];
+lane_t		action_lane = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.name = "actions",
+};
+lane_t		notification_lane = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.name = "notifications",
+	.droppable = 1,
+	.interval = NOTIFICATION_INTERVAL,
+};
+char*		json_rpc_url;
+health_t	kodi_health = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+	.circuit = CIRCUIT_CLOSED,
+	.probe_interval = HEALTH_PROBE_INTERVAL_MIN,
+};
+
+/* Logger */
+logger_t	logger;
+
+/* Tracer */
+tracer_t	tracer = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.wakeup = PTHREAD_COND_INITIALIZER,
+};
 
 /* Exit flag */
 volatile sig_atomic_t exit_flag = 0;
 
+/* Action file reload flag */
+volatile sig_atomic_t reload_flag = 0;
+
 /*---------------------------------------------------------------------------*/
 
 void
@@ -181,12 +854,167 @@ set_exit_flag(int signal)
 	exit_flag = 1;
 }
 
+void
+set_reload_flag(int signal)
+{
+	reload_flag = 1;
+}
+
+/* SIGUSR1 makes logging more verbose, SIGUSR2 less verbose */
+void
+change_loglevel(int signal)
+{
+	if (signal == SIGUSR1 && config_loglevel < LOG_DEBUG)
+		config_loglevel++;
+	else if (signal == SIGUSR2 && config_loglevel > LOG_ERR)
+		config_loglevel--;
+}
+
+double
+get_time_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+action_table_t*
+new_action_table(void)
+{
+	action_table_t* table = calloc(1, sizeof(action_table_t));
+	assert(table);
+	/* Tables may be created by the reloading thread */
+	table->generation = __atomic_add_fetch(&action_tables_created, 1, __ATOMIC_RELAXED);
+	table->capabilities = __atomic_load_n(&capabilities, __ATOMIC_ACQUIRE);
+	return table;
+}
+
+void
+free_action_table(action_table_t* table)
+{
+
+	int i;
+
+	if (!table)
+		return;
+
+	for (i=0; i<table->actions_count; i++)
+	{
+		free(table->actions[i]->word);
+		free(table->actions[i]->method);
+		free(table->actions[i]->params);
+		free(table->actions[i]->req);
+		free(table->actions[i]);
+	}
+	free(table->actions);
+
+	for (i=0; i<table->cmap_count; i++)
+	{
+		free(table->cmap[i]->string);
+		free(table->cmap[i]);
+	}
+	free(table->cmap);
+
+	for (i=0; i<table->strings_count; i++)
+		free(table->strings[i]);
+	free(table->strings);
+
+	for (i=0; i<table->grammar.words_count; i++)
+		free(table->grammar.words[i]);
+	free(table->grammar.words);
+	free(table->grammar.transitions);
+
+	free(table);
+
+}
+
+void
+free_capabilities(capabilities_t* caps)
+{
+
+	int i;
+
+	if (!caps)
+		return;
+
+	for (i=0; i<caps->methods_count; i++)
+		free(caps->methods[i]);
+	free(caps->methods);
+	free(caps->host);
+	free(caps);
+
+}
+
+void
+free_media_item(media_item_t* item)
+{
+	free(item->key);
+	free(item->label);
+	free(item);
+}
+
+void
+free_media_items(media_item_t** items, const int count)
+{
+
+	int i;
+
+	for (i=0; i<count; i++)
+		free_media_item(items[i]);
+	free(items);
+
+}
+
+/* Wait for a reload in progress, so that it never outlives the action table */
+void
+finish_reload(void)
+{
+
+	if (!reloading)
+		return;
+
+	pthread_join(reload_thread, NULL);
+	reloading = 0;
+
+}
+
+void
+finish_revalidation(void)
+{
+
+	if (!revalidating)
+		return;
+
+	pthread_join(revalidator, NULL);
+	revalidating = 0;
+
+}
+
+/* Buffers may outlive the threads which filled them, so they are only freed at exit */
+void
+free_trace_buffers(void)
+{
+
+	trace_buffer_t* buffer;
+
+	while (tracer.buffers)
+	{
+		buffer = tracer.buffers;
+		tracer.buffers = buffer->next;
+		free(buffer);
+	}
+
+}
+
 void
 cleanup(void)
 {
 
 	int i;
 
+	/* The revalidator still talks to Kodi and logs with this configuration */
+	finish_revalidation();
+
 	/* Pidfile */
 	if (config_pidfile)
 		unlink(config_pidfile);
@@ -204,64 +1032,257 @@ cleanup(void)
 	free(config_json_rpc_password);
 	free(config_audio_device);
 	free(config_pidfile);
+	free(config_statefile);
+	free(config_actionfile);
+	free(config_control_socket);
+	free(config_journalfile);
+	free(config_listening_cpus);
+	free(config_dispatch_cpus);
+	free(config_capabilitiesfile);
+	free(config_tracefile);
+	free(config_media_port);
+	free(config_server_port);
+	free(config_decode_server);
+	for (i=0; i<2*config_decoder_options_count; i++)
+		free(config_decoder_options[i]);
+	free(config_decoder_options);
+	free(decimator.even);
+	free(decimator.odd);
+	free(decimator.input);
+	free(json_rpc_url);
+	curl_global_cleanup();
+
+	/* Actions and command to character mapping databases */
+	finish_reload();
+	free_action_table(action_table);
+	free_action_table(__atomic_exchange_n(&pending_action_table, NULL, __ATOMIC_ACQ_REL));
+	free_capabilities(capabilities);
+	free_capabilities(stale_capabilities);
+	free_capabilities(revalidated_capabilities);
+
+	/* Trace buffers */
+	free_trace_buffers();
+
+	/* Media library index */
+	free_media_items(media_index.items, media_index.count);
+
+	/* Listening state */
+	free(state.cmn);
+
+	/* Spelling buffer */
+	free(spelling.text);
+	free(spelling.sent);
 
-	/* Actions database */
-	for (i=0; i<actions_count; i++)
-	{
-		free(actions[i]->word);
-		free(actions[i]->method);
-		free(actions[i]->params);
-		free(actions[i]->req);
-		free(actions[i]);
-	}
-	free(actions);
+}
+
+/* Return a newly allocated copy of string, escaped for use inside a JSON string */
+char*
+json_escape(const char* string)
+{
+
+	const char*	src;
+	char*		escaped;
+	char*		dst;
 
-	/* Command to character mapping */
-	for (i=0; i<cmap_count; i++)
+	/* Worst case: every character becomes a \u00XX sequence */
+	escaped = malloc(strlen(string) * 6 + 1);
+	assert(escaped);
+
+	for (src = string, dst = escaped; *src; src++)
 	{
-		free(cmap[i]->string);
-		free(cmap[i]);
+		if (*src == '"' || *src == '\\')
+		{
+			*dst++ = '\\';
+			*dst++ = *src;
+		}
+		else if ((unsigned char) *src < 0x20)
+		{
+			dst += sprintf(dst, "\\u%04x", (unsigned char) *src);
+		}
+		else
+		{
+			*dst++ = *src;
+		}
 	}
-	free(cmap);
+	*dst = '\0';
+
+	return escaped;
 
 }
 
+/* Output a single log message to all enabled destinations */
 void
-vprint_log(const int level, const char* format, va_list args)
+write_log_record(const int level, const double time, const char* message)
 {
 
-	time_t	now;
-	char	timestamp[32];
-	va_list	args_copy;
+	time_t		now;
+	struct tm	tm;
+	char		timestamp[64];
+	char		zone[8];
+	char*		escaped;
 
 	if (!config_daemon)
-	{
-		printf("%s: ", loglevels[level]);
-		va_copy(args_copy, args);
-		vprintf(format, args_copy);
-		va_end(args_copy);
-		printf("\n");
-	}
+		printf("%s: %s\n", loglevels[level], message);
 
 	if (config_logfile)
 	{
-		now = time(NULL);
-		snprintf(timestamp, 32, "%s", asctime(localtime(&now)));
-		/* Trim newline */
-		*(timestamp + strlen(timestamp) - 1) = '\0';
-		fprintf(config_logfile, "%s kodivc[%d]: %s: ", timestamp, getpid(), loglevels[level]);
-		va_copy(args_copy, args);
-		vfprintf(config_logfile, format, args_copy);
-		va_end(args_copy);
-		fprintf(config_logfile, "\n");
+		now = (time_t) ((logger.wall_offset + time) / 1000);
+		localtime_r(&now, &tm);
+		if (config_log_json)
+		{
+			strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%S", &tm);
+			strftime(zone, sizeof(zone), "%z", &tm);
+			escaped = json_escape(message);
+			fprintf(config_logfile, "{\"time\":\"%s.%03d%s\",\"pid\":%d,\"level\":\"%s\",\"message\":\"%s\"}\n",
+				timestamp, (int) fmod(logger.wall_offset + time, 1000), zone, logger.pid, loglevel_names[level], escaped);
+			free(escaped);
+		}
+		else
+		{
+			/* Same format as asctime() */
+			strftime(timestamp, sizeof(timestamp), "%a %b %e %H:%M:%S %Y", &tm);
+			fprintf(config_logfile, "%s kodivc[%d]: %s: %s\n", timestamp, logger.pid, loglevels[level], message);
+		}
+		fflush(config_logfile);
 	}
 	else if (config_syslog)
 	{
-		va_copy(args_copy, args);
-		vsyslog(level, format, args_copy);
-		va_end(args_copy);
+		syslog(level, "%s", message);
+	}
+
+}
+
+/* Background thread writing out queued log records */
+void*
+log_writer(void* arg)
+{
+
+	log_record_t*	record;
+	unsigned int	dropped;
+	char		message[64];
+
+	for (;;)
+	{
+
+		sem_wait(&logger.pending);
+
+		/* Write out every record which is ready */
+		for (;;)
+		{
+			record = &logger.ring[logger.head % LOG_RING_SIZE];
+			if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != logger.head + 1)
+				break;
+			write_log_record(record->level, record->time, record->message);
+			/* Hand slot back to producers */
+			__atomic_store_n(&record->sequence, logger.head + LOG_RING_SIZE, __ATOMIC_RELEASE);
+			logger.head++;
+		}
+
+		if ((dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED)) > 0)
+		{
+			snprintf(message, sizeof(message), "%u log messages dropped", dropped);
+			write_log_record(LOG_WARNING, get_time_ms(), message);
+		}
+
+		if (__atomic_load_n(&logger.stopping, __ATOMIC_ACQUIRE))
+			break;
+
+	}
+
+	return NULL;
+
+}
+
+void
+start_logger(void)
+{
+
+	struct timespec	now;
+	unsigned int	i;
+
+	for (i=0; i<LOG_RING_SIZE; i++)
+		logger.ring[i].sequence = i;
+
+	/* PID and clock offset are cached as neither changes from now on */
+	logger.pid = getpid();
+	clock_gettime(CLOCK_REALTIME, &now);
+	logger.wall_offset = now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0 - get_time_ms();
+
+	if (sem_init(&logger.pending, 0, 0) != 0 || pthread_create(&logger.writer, NULL, log_writer, NULL) != 0)
+		return;
+
+	__atomic_store_n(&logger.running, 1, __ATOMIC_RELEASE);
+
+}
+
+void
+stop_logger(void)
+{
+
+	if (!logger.running)
+		return;
+
+	/* Log synchronously from now on */
+	__atomic_store_n(&logger.running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&logger.stopping, 1, __ATOMIC_RELEASE);
+	sem_post(&logger.pending);
+	pthread_join(logger.writer, NULL);
+	sem_destroy(&logger.pending);
+
+}
+
+void
+vprint_log(const int level, const char* format, va_list args)
+{
+
+	log_record_t*	record;
+	unsigned int	position;
+	unsigned int	sequence;
+	char		message[LOG_MESSAGE_SIZE];
+
+	if (level > config_loglevel)
+		return;
+
+	/* Before the writer starts and after it stops, log synchronously */
+	if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+	{
+		if (!logger.pid)
+			logger.pid = getpid();
+		vsnprintf(message, sizeof(message), format, args);
+		write_log_record(level, get_time_ms(), message);
+		return;
+	}
+
+	/* Claim a free slot in the ring */
+	position = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		record = &logger.ring[position % LOG_RING_SIZE];
+		sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == position)
+		{
+			if (__atomic_compare_exchange_n(&logger.tail, &position, position + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if ((int) (sequence - position) < 0)
+		{
+			/* Ring is full - never block the caller */
+			__atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		else
+		{
+			position = __atomic_load_n(&logger.tail, __ATOMIC_RELAXED);
+		}
 	}
 
+	/* Fill the slot and publish it to the writer */
+	record->level = level;
+	record->time = get_time_ms();
+	vsnprintf(record->message, LOG_MESSAGE_SIZE, format, args);
+	__atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+	sem_post(&logger.pending);
+
 }
 
 void
@@ -283,33 +1304,191 @@ die(const char* format, ...)
 	exit(1);
 }
 
-void
-parse_options(int argc, char* argv[])
+/* Daemon mode changes directory, so paths given on the command line have to be absolute */
+char*
+get_absolute_path(const char* path)
 {
 
-	int	option;
-	int	quit = 0;
-	FILE*	pidfile;
+	char	cwd[4096];
+	char*	absolute;
 
-	/* Initialize default values */
-	config_json_rpc_host = malloc(strlen(JSON_RPC_DEFAULT_HOST) + 1);
-	config_json_rpc_port = malloc(6);
-	config_json_rpc_username = NULL;
-	config_json_rpc_password = NULL;
-	config_audio_device = NULL;
-	config_logfile = NULL;
-	config_pidfile = NULL;
+	if (*path == '/' || getcwd(cwd, sizeof(cwd)) == NULL)
+		*cwd = '\0';
+	absolute = malloc(strlen(cwd) + strlen(path) + 2);
+	assert(absolute);
+	sprintf(absolute, "%s%s%s", cwd, *cwd ? "/" : "", path);
 
-	assert(config_json_rpc_host);
-	sprintf(config_json_rpc_host, "%s", JSON_RPC_DEFAULT_HOST);
-	assert(config_json_rpc_port);
-	snprintf(config_json_rpc_port, 6, "%d", JSON_RPC_DEFAULT_PORT);
+	return absolute;
 
-	/* Process command line options */
-	while ((option = getopt(argc, argv, "H:P:u:p:dD:lL:nr:tVh")) != -1 && !quit)
-	{
-		switch(option)
-		{
+}
+
+/* Parse a list of CPUs such as "2,3" or "0-1,4" */
+int
+parse_cpu_list(const char* list, cpu_set_t* set)
+{
+
+	char*	end;
+	long	first;
+	long	last;
+
+	CPU_ZERO(set);
+	for (;;)
+	{
+		first = last = strtol(list, &end, 10);
+		if (end == list || first < 0)
+			return -1;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtol(list, &end, 10);
+			if (end == list || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first<=last; first++)
+			CPU_SET(first, set);
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			return -1;
+		list = end + 1;
+	}
+
+}
+
+cpu_set_t*
+new_cpu_set(const char* list)
+{
+
+	cpu_set_t* set;
+
+	if (*list == '\0')
+		return NULL;
+
+	set = malloc(sizeof(cpu_set_t));
+	assert(set);
+	if (parse_cpu_list(list, set) == -1)
+		die("Invalid list of CPUs %s", list);
+
+	return set;
+
+}
+
+profile_t*
+find_profile(const char* name)
+{
+
+	int i;
+
+	for (i=0; i<ARRAY_SIZE(profiles); i++)
+	{
+		if (strcmp(profiles[i].name, name) == 0)
+			return &profiles[i];
+	}
+
+	return NULL;
+
+}
+
+/* Options are stored the way pocketsphinx expects them, with a leading dash; the last value given wins */
+void
+add_decoder_option(const char* name, const int length, const char* value)
+{
+
+	char*	option = malloc(length + 2);
+	int	i;
+
+	assert(option);
+	sprintf(option, "-%.*s", length, name);
+
+	for (i=0; i<config_decoder_options_count; i++)
+	{
+		if (strcmp(config_decoder_options[2*i], option) == 0)
+		{
+			free(option);
+			free(config_decoder_options[2*i+1]);
+			config_decoder_options[2*i+1] = strdup(value);
+			assert(config_decoder_options[2*i+1]);
+			return;
+		}
+	}
+
+	config_decoder_options = realloc(config_decoder_options, 2 * (config_decoder_options_count + 1) * sizeof(char*));
+	assert(config_decoder_options);
+	config_decoder_options[2 * config_decoder_options_count] = option;
+	config_decoder_options[2 * config_decoder_options_count + 1] = strdup(value);
+	assert(config_decoder_options[2 * config_decoder_options_count + 1]);
+	config_decoder_options_count++;
+
+}
+
+/* Select a decoder profile given with -T */
+void
+set_decoder_profile(const char* name)
+{
+	if ((config_profile = find_profile(name)) == NULL)
+		die("Unknown decoder profile %s", name);
+}
+
+/* Add a pocketsphinx option given with -O as <option>=<value> */
+void
+parse_decoder_option(const char* argument)
+{
+
+	/* The dash pocketsphinx options start with is optional */
+	const char*	name = argument + (*argument == '-');
+	const char*	end;
+
+	if ((end = strchr(name, '=')) == NULL || end == name)
+		die("Decoder options have to be given as <option>=<value>");
+	add_decoder_option(name, end - name, end + 1);
+
+}
+
+void
+parse_options(int argc, char* argv[])
+{
+
+	int	option;
+	int	quit = 0;
+	int	i;
+	FILE*	pidfile;
+	char*	end;
+	char*	cpus;
+	char*	name;
+
+	/* Initialize default values */
+	config_json_rpc_host = malloc(strlen(JSON_RPC_DEFAULT_HOST) + 1);
+	config_json_rpc_port = malloc(6);
+	config_json_rpc_username = NULL;
+	config_json_rpc_password = NULL;
+	config_audio_device = NULL;
+	config_logfile = NULL;
+	config_pidfile = NULL;
+	config_statefile = NULL;
+	config_actionfile = NULL;
+	config_control_socket = NULL;
+	config_journalfile = NULL;
+	config_listening_cpus = NULL;
+	config_dispatch_cpus = NULL;
+	config_capabilitiesfile = NULL;
+	config_tracefile = NULL;
+	config_media_port = NULL;
+	config_server_port = NULL;
+	config_decode_server = NULL;
+	config_decoder_options = NULL;
+
+	assert(config_json_rpc_host);
+	sprintf(config_json_rpc_host, "%s", JSON_RPC_DEFAULT_HOST);
+	assert(config_json_rpc_port);
+	snprintf(config_json_rpc_port, 6, "%d", JSON_RPC_DEFAULT_PORT);
+
+	/* Process command line options */
+	while ((option = getopt(argc, argv, "H:P:u:p:dD:lL:jv:nr:s:c:a:C:J:R:I:N:T:O:E:M:S:F:W:8tVh")) != -1 && !quit)
+	{
+		switch(option)
+		{
 
 			/* Kodi host */
 			case 'H':
@@ -369,6 +1548,22 @@ parse_options(int argc, char* argv[])
 				}
 				break;
 
+			/* JSON log format */
+			case 'j':
+				config_log_json = 1;
+				break;
+
+			/* Log level */
+			case 'v':
+				for (i=LOG_ERR; i<=LOG_DEBUG; i++)
+				{
+					if (strcmp(optarg, loglevel_names[i]) == 0)
+						config_loglevel = i;
+				}
+				if (strcmp(optarg, loglevel_names[config_loglevel]) != 0)
+					die("Unknown log level %s", optarg);
+				break;
+
 			/* Notifications */
 			case 'n':
 				config_notifications = 0;
@@ -388,6 +1583,141 @@ parse_options(int argc, char* argv[])
 				sprintf(config_pidfile, "%s", optarg);
 				break;
 
+			/* State file */
+			case 's':
+				free(config_statefile);
+				config_statefile = get_absolute_path(optarg);
+				break;
+
+			/* Confidence thresholds */
+			case 'c':
+				config_min_confidence[MODE_NORMAL] = strtod(optarg, &end);
+				if (*end == ',')
+					config_min_confidence[MODE_SPELLING] = strtod(end + 1, &end);
+				else
+					config_min_confidence[MODE_SPELLING] = config_min_confidence[MODE_NORMAL];
+				if (end == optarg || *end != '\0')
+					die("Invalid confidence threshold %s", optarg);
+				if (config_min_confidence[MODE_NORMAL] < 0 || config_min_confidence[MODE_NORMAL] > 1 || config_min_confidence[MODE_SPELLING] < 0 || config_min_confidence[MODE_SPELLING] > 1)
+					die("Confidence threshold must be between 0 and 1");
+				break;
+
+			/* Action file */
+			case 'a':
+				free(config_actionfile);
+				config_actionfile = get_absolute_path(optarg);
+				break;
+
+			/* Control socket */
+			case 'C':
+				free(config_control_socket);
+				config_control_socket = get_absolute_path(optarg);
+				break;
+
+			/* Utterance journal */
+			case 'J':
+				free(config_journalfile);
+				if ((end = strchr(optarg, ',')) != NULL)
+				{
+					*end = '\0';
+					config_journal_entries = strtol(end + 1, &end, 10);
+					if (*end != '\0' || config_journal_entries < 1)
+						die("Invalid number of journal entries");
+				}
+				config_journalfile = get_absolute_path(optarg);
+				break;
+
+			/* Scheduling profile */
+			case 'R':
+				config_rt_priority = strtol(optarg, &end, 10);
+				if (end == optarg || (*end != '\0' && *end != ':') || config_rt_priority < 1 || config_rt_priority > RT_PRIORITY_MAX)
+					die("Real-time priority must be between 1 and %d", RT_PRIORITY_MAX);
+				free(config_listening_cpus);
+				free(config_dispatch_cpus);
+				config_listening_cpus = config_dispatch_cpus = NULL;
+				if (*end == ':')
+				{
+					cpus = end + 1;
+					if ((end = strchr(cpus, ':')) != NULL)
+					{
+						*end = '\0';
+						config_dispatch_cpus = new_cpu_set(end + 1);
+					}
+					config_listening_cpus = new_cpu_set(cpus);
+				}
+				break;
+
+			/* Capability snapshot */
+			case 'I':
+				free(config_capabilitiesfile);
+				config_capabilitiesfile = get_absolute_path(optarg);
+				break;
+
+			/* Decoder pool */
+			case 'N':
+				config_decoders = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || config_decoders < 1 || config_decoders > DECODERS_MAX)
+					die("Number of decoders must be between 1 and %d", DECODERS_MAX);
+				break;
+
+			/* Decoder tuning */
+			case 'T':
+				set_decoder_profile(optarg);
+				break;
+
+			case 'O':
+				parse_decoder_option(optarg);
+				break;
+
+			/* Trace file */
+			case 'E':
+				free(config_tracefile);
+				config_tracefile = get_absolute_path(optarg);
+				break;
+
+			/* Media library index */
+			case 'M':
+				i = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || i < 1 || i > 65535)
+					die("Invalid notification port %s", optarg);
+				free(config_media_port);
+				config_media_port = strdup(optarg);
+				assert(config_media_port);
+				break;
+
+			/* Decode server */
+			case 'S':
+				i = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || i < 1 || i > 65535)
+					die("Invalid decode server port %s", optarg);
+				free(config_server_port);
+				config_server_port = strdup(optarg);
+				assert(config_server_port);
+				break;
+
+			/* Capture client */
+			case 'F':
+				end = strrchr(optarg, ':');
+				i = (end ? strtol(end + 1, &name, 10) : 0);
+				if (!end || end == optarg || *name != '\0' || i < 1 || i > 65535)
+					die("Decode server has to be given as <host>:<port>");
+				free(config_decode_server);
+				config_decode_server = strdup(optarg);
+				assert(config_decode_server);
+				break;
+
+			/* Decoder warm-up */
+			case 'W':
+				config_warmup_interval = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || config_warmup_interval < 0)
+					die("Invalid warm-up interval %s", optarg);
+				break;
+
+			/* Narrowband processing */
+			case '8':
+				config_sample_rate = SAMPLE_RATE_NARROW;
+				break;
+
 			/* Test mode */
 			case 't':
 				config_test_mode = 1;
@@ -415,6 +1745,10 @@ parse_options(int argc, char* argv[])
 	/* Error checks */
 	if (config_test_mode && config_daemon)
 		die("Daemon mode and test mode are mutually exclusive");
+	if (config_server_port && config_decode_server)
+		die("Decode server and capture client modes are mutually exclusive");
+	if (config_test_mode && (config_server_port || config_decode_server))
+		die("Test mode does not capture audio, so it cannot be combined with -S or -F");
 	if (config_json_rpc_username && !config_json_rpc_password)
 		die("Password must be provided along with username");
 	if (config_json_rpc_password && !config_json_rpc_username)
@@ -471,783 +1805,6047 @@ save_response_in_memory(const char* ptr, const size_t size, const size_t nmemb,
 	return size * nmemb;
 }
 
-int
-send_json_rpc_request(const char* method, const char* params, char** dst)
+/* Convert a delay in milliseconds to an absolute deadline for pthread_cond_timedwait() */
+void
+get_deadline(struct timespec* deadline, const long delay)
 {
-
-	CURL*			curl;
-	CURLcode		result;
-	char*			url;
-	char*			post;
-	char*			response = NULL;
-	curl_userdata_t		cud;
-	struct curl_slist*	headers = NULL;
-
-	/* Prepare JSON-RPC URL  */
-	if (config_json_rpc_username && config_json_rpc_password)
-	{
-		url = malloc(
-			  strlen(JSON_RPC_URL_AUTH)
-			+ strlen(config_json_rpc_username)
-			+ strlen(config_json_rpc_password)
-			+ strlen(config_json_rpc_host)
-			+ strlen(config_json_rpc_port)
-		);
-		assert(url);
-		sprintf(url, JSON_RPC_URL_AUTH, config_json_rpc_username, config_json_rpc_password, config_json_rpc_host, config_json_rpc_port);
-	}
-	else
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += delay / 1000;
+	deadline->tv_nsec += (delay % 1000) * 1000000;
+	if (deadline->tv_nsec >= 1000000000)
 	{
-		url = malloc(
-			  strlen(JSON_RPC_URL)
-			+ strlen(config_json_rpc_host)
-			+ strlen(config_json_rpc_port)
-		);
-		assert(url);
-		sprintf(url, JSON_RPC_URL, config_json_rpc_host, config_json_rpc_port);
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000;
 	}
+}
 
-	/* Prepare POST data with or without parameters */
-	if (params == NULL)
-	{
-		post = malloc(strlen(JSON_RPC_POST) + strlen(method));
-		assert(post);
-		sprintf(post, JSON_RPC_POST, method);
-	}
-	else
-	{
-		post = malloc(strlen(JSON_RPC_POST_WITH_PARAMS) + strlen(method) + strlen(params));
-		assert(post);
-		sprintf(post, JSON_RPC_POST_WITH_PARAMS, method, params);
-	}
+/* Hand the buffer of an exiting thread over to the next thread which traces */
+void
+release_trace_buffer(void* arg)
+{
 
-	/* Initialize userdata structure passed to callback */
-	cud.dst = &response;
-	cud.dst_s = 0;
+	trace_buffer_t* buffer = arg;
 
-	/* Initialize libcurl */
-	if ((curl = curl_easy_init()) == NULL)
-		die("Error initializing libcurl");
+	pthread_mutex_lock(&tracer.lock);
+	buffer->owned = 0;
+	pthread_mutex_unlock(&tracer.lock);
 
-	/* Set request options */
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
-	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 2);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, save_response_in_memory);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &cud);
+}
 
-	/* Add proper Content-Type header */
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+void
+record_trace_event(trace_buffer_t* buffer, const char phase, const char* category, const char* name, const double start, const double duration, const char* format, va_list args)
+{
 
-	/* Send JSON-RPC request */
-	result = curl_easy_perform(curl);
-	if (result != 0)
-		print_log(LOG_WARNING, "Kodi instance at %s:%s is not responding", config_json_rpc_host, config_json_rpc_port);
+	trace_event_t*	event;
+	unsigned int	tail = buffer->tail;
 
-	/* If caller provided a pointer, save response there (if it exists) */
-	if (dst && response)
+	/* A full buffer never blocks the caller */
+	if (tail - __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE) >= TRACE_BUFFER_EVENTS)
 	{
-		*dst = realloc(*dst, strlen(response) + 1);
-		assert(*dst);
-		strcpy(*dst, response);
+		__atomic_add_fetch(&tracer.dropped, 1, __ATOMIC_RELAXED);
+		return;
 	}
 
-	/* Cleanup */
-	free(response);
-	free(post);
-	free(url);
-	curl_slist_free_all(headers);
-	curl_easy_cleanup(curl);
-
-	return (int) result;
+	event = &buffer->ring[tail % TRACE_BUFFER_EVENTS];
+	event->phase = phase;
+	event->tid = buffer->tid;
+	event->category = category;
+	event->name = name;
+	event->start = start;
+	event->duration = duration;
+	if (format)
+		vsnprintf(event->detail, TRACE_DETAIL_SIZE, format, args);
+	else
+		event->detail[0] = '\0';
+	__atomic_store_n(&buffer->tail, tail + 1, __ATOMIC_RELEASE);
 
 }
 
 void
-send_gui_notification(const char* title, const char* message, const char* icon)
+record_thread_name(trace_buffer_t* buffer, const char* format, ...)
 {
-
-	const char*	format = "\"title\":\"%s\",\"message\":\"%s\",\"image\":\"%s\"";
-	char*		params;
-
-	if (kodi_version >= KODI_VERSION_FRODO && config_notifications)
-	{
-		params = malloc(strlen(format) + strlen(title) + strlen(message) + strlen(icon));
-		assert(params);
-		sprintf(params, format, title, message, icon);
-		send_json_rpc_request("GUI.ShowNotification", params, NULL);
-		free(params);
-	}
-
+	va_list args;
+	va_start(args, format);
+	record_trace_event(buffer, 'M', NULL, NULL, 0, 0, format, args);
+	va_end(args);
 }
 
-int
-get_json_rpc_response_int(const char* method, const char* params, const char* param)
+/* Buffer of the calling thread, which is given a name the first time it traces */
+trace_buffer_t*
+get_trace_buffer(const char* name)
 {
 
-	char*		response = NULL;
-	char*		result;
-	char*		param_search = NULL;
-	char*		param_string;
-	char		param_value[4];
-	unsigned int	i = 0;
-	int		retval = -1;
+	trace_buffer_t* buffer;
 
-	if (send_json_rpc_request(method, params, &response) != 0 || !response)
-		return -2;
+	if ((buffer = pthread_getspecific(tracer.key)) != NULL)
+		return buffer;
 
-	result = strstr(response, "\"result\":");
-	if (result)
+	pthread_mutex_lock(&tracer.lock);
+	for (buffer = tracer.buffers; buffer && buffer->owned; buffer = buffer->next);
+	if (buffer == NULL)
 	{
-		result += strlen("\"result\":") + 1;
-		param_search = malloc(strlen(param) + 4);
-		assert(param_search);
-		sprintf(param_search, "\"%s\":", param);
-		param_string = strstr(result, param_search);
-		if (param_string)
-		{
-			memset(param_value, 0, sizeof(param_value));
-			param_string += strlen(param) + 3;
-			while(i < sizeof(param_value) && *param_string >= '0' && *param_string <= '9')
-			{
-				param_value[i] = *param_string;
-				param_string++;
-				i++;
-			}
-			if (i == 0)
-				retval = -1;
-			else
-				retval = atoi(param_value);
-		}
-		free(param_search);
+		buffer = calloc(1, sizeof(trace_buffer_t));
+		assert(buffer);
+		buffer->next = tracer.buffers;
+		tracer.buffers = buffer;
 	}
-	free(response);
+	buffer->owned = 1;
+	/* Events of the previous owner may still be waiting, so every thread gets an ID of its own */
+	buffer->tid = ++tracer.threads;
+	pthread_mutex_unlock(&tracer.lock);
+
+	pthread_setspecific(tracer.key, buffer);
+	if (name)
+		record_thread_name(buffer, "%s", name);
+	else
+		record_thread_name(buffer, "thread %d", buffer->tid);
 
-	return retval;
+	return buffer;
 
 }
 
+/* Name the calling thread in the trace, unless it already recorded something */
 void
-register_action(const char* word, const char* method, const char* params, const char* req[], const int req_size, const int repeats, const int needs_player_id, const int needs_argument)
+trace_thread(const char* name)
 {
+	if (__atomic_load_n(&tracer.running, __ATOMIC_ACQUIRE))
+		get_trace_buffer(name);
+}
 
-	/* Allocate memory for action structure */
-	action_t* a = malloc(sizeof(action_t));
-	assert(a);
+/* Start of a span, 0 if not tracing */
+double
+trace_begin(void)
+{
+	return (__atomic_load_n(&tracer.running, __ATOMIC_ACQUIRE) ? get_time_ms() : 0);
+}
 
-	/* Copy function arguments to structure fields */
-	a->word = strdup(word);
+void
+trace_end(const double started, const char* category, const char* name, const char* format, ...)
+{
 
-	if (method)
-		a->method = strdup(method);
+	va_list	args;
+	double	now;
+
+	if (started == 0 || !__atomic_load_n(&tracer.running, __ATOMIC_ACQUIRE))
+		return;
+
+	now = get_time_ms();
+	va_start(args, format);
+	record_trace_event(get_trace_buffer(NULL), 'X', category, name, started, now - started, format, args);
+	va_end(args);
+
+}
+
+void
+trace_instant(const char* category, const char* name, const char* format, ...)
+{
+
+	va_list args;
+
+	if (!__atomic_load_n(&tracer.running, __ATOMIC_ACQUIRE))
+		return;
+
+	va_start(args, format);
+	record_trace_event(get_trace_buffer(NULL), 'i', category, name, get_time_ms(), 0, format, args);
+	va_end(args);
+
+}
+
+void
+write_trace_event(const trace_event_t* event)
+{
+
+	char* detail = json_escape(event->detail);
+
+	fputs(tracer.written++ ? ",\n" : "\n", tracer.file);
+	if (event->phase == 'M')
+		fprintf(tracer.file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			tracer.pid, event->tid, detail);
 	else
-		a->method = NULL;
+	{
+		/* Timestamps are in microseconds */
+		fprintf(tracer.file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,", event->name, event->category, event->phase, event->start * 1000);
+		if (event->phase == 'X')
+			fprintf(tracer.file, "\"dur\":%.3f,", event->duration * 1000);
+		else
+			fputs("\"s\":\"t\",", tracer.file);
+		fprintf(tracer.file, "\"pid\":%d,\"tid\":%d", tracer.pid, event->tid);
+		if (*detail)
+			fprintf(tracer.file, ",\"args\":{\"detail\":\"%s\"}", detail);
+		fputc('}', tracer.file);
+	}
 
-	if (params)
-		a->params = strdup(params);
+	free(detail);
+
+}
+
+/* Write out every event recorded so far */
+void
+flush_trace_buffers(void)
+{
+
+	trace_buffer_t*	buffer;
+	unsigned int	head;
+	unsigned int	tail;
+	unsigned int	dropped;
+
+	/* Buffers are only ever added in front of the list */
+	pthread_mutex_lock(&tracer.lock);
+	buffer = tracer.buffers;
+	pthread_mutex_unlock(&tracer.lock);
+
+	for (; buffer; buffer = buffer->next)
+	{
+		head = buffer->head;
+		tail = __atomic_load_n(&buffer->tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			write_trace_event(&buffer->ring[head % TRACE_BUFFER_EVENTS]);
+		/* Hand slots back to the thread */
+		__atomic_store_n(&buffer->head, head, __ATOMIC_RELEASE);
+	}
+	fflush(tracer.file);
+
+	if ((dropped = __atomic_exchange_n(&tracer.dropped, 0, __ATOMIC_RELAXED)) > 0)
+		print_log(LOG_WARNING, "%u trace events dropped", dropped);
+
+}
+
+/* Background thread writing out trace events, so that tracing never waits for the disk */
+void*
+trace_writer(void* arg)
+{
+
+	struct timespec deadline;
+
+	pthread_mutex_lock(&tracer.lock);
+	while (!tracer.stopping)
+	{
+		get_deadline(&deadline, TRACE_FLUSH_INTERVAL);
+		pthread_cond_timedwait(&tracer.wakeup, &tracer.lock, &deadline);
+		pthread_mutex_unlock(&tracer.lock);
+		flush_trace_buffers();
+		pthread_mutex_lock(&tracer.lock);
+	}
+	pthread_mutex_unlock(&tracer.lock);
+
+	flush_trace_buffers();
+
+	return NULL;
+
+}
+
+void
+start_tracer(void)
+{
+
+	if ((tracer.file = fopen(config_tracefile, "w")) == NULL)
+		die("Unable to open trace file %s: %s", config_tracefile, strerror(errno));
+	fputc('[', tracer.file);
+
+	tracer.pid = getpid();
+	if (pthread_key_create(&tracer.key, release_trace_buffer) != 0 || pthread_create(&tracer.writer, NULL, trace_writer, NULL) != 0)
+		die("Unable to start tracing");
+
+	__atomic_store_n(&tracer.running, 1, __ATOMIC_RELEASE);
+
+}
+
+void
+stop_tracer(void)
+{
+
+	if (!tracer.running)
+		return;
+
+	/* Events recorded from now on are ignored */
+	__atomic_store_n(&tracer.running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&tracer.lock);
+	tracer.stopping = 1;
+	pthread_cond_signal(&tracer.wakeup);
+	pthread_mutex_unlock(&tracer.lock);
+	pthread_join(tracer.writer, NULL);
+
+	fputs("\n]\n", tracer.file);
+	fclose(tracer.file);
+	tracer.file = NULL;
+
+}
+
+void
+prepare_json_rpc_url(void)
+{
+
+	if (config_json_rpc_username && config_json_rpc_password)
+	{
+		json_rpc_url = malloc(
+			  strlen(JSON_RPC_URL_AUTH)
+			+ strlen(config_json_rpc_username)
+			+ strlen(config_json_rpc_password)
+			+ strlen(config_json_rpc_host)
+			+ strlen(config_json_rpc_port)
+		);
+		assert(json_rpc_url);
+		sprintf(json_rpc_url, JSON_RPC_URL_AUTH, config_json_rpc_username, config_json_rpc_password, config_json_rpc_host, config_json_rpc_port);
+	}
 	else
-		a->params = NULL;
+	{
+		json_rpc_url = malloc(
+			  strlen(JSON_RPC_URL)
+			+ strlen(config_json_rpc_host)
+			+ strlen(config_json_rpc_port)
+		);
+		assert(json_rpc_url);
+		sprintf(json_rpc_url, JSON_RPC_URL, config_json_rpc_host, config_json_rpc_port);
+	}
+
+}
+
+/* Send prepared POST data to Kodi, waiting at most timeout milliseconds */
+int
+perform_json_rpc_request(const char* post, const long timeout, char** dst)
+{
+
+	CURL*			curl;
+	CURLcode		result;
+	char*			response = NULL;
+	curl_userdata_t		cud;
+	struct curl_slist*	headers = NULL;
+
+	/* Initialize userdata structure passed to callback */
+	cud.dst = &response;
+	cud.dst_s = 0;
+
+	/* Initialize libcurl */
+	if ((curl = curl_easy_init()) == NULL)
+		die("Error initializing libcurl");
+
+	/* Set request options */
+	curl_easy_setopt(curl, CURLOPT_URL, json_rpc_url);
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, save_response_in_memory);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &cud);
+
+	/* Add proper Content-Type header */
+	headers = curl_slist_append(headers, "Content-Type: application/json");
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+
+	/* Send JSON-RPC request */
+	result = curl_easy_perform(curl);
+
+	/* If caller provided a pointer, save response there (if it exists) */
+	if (dst && response)
+	{
+		*dst = realloc(*dst, strlen(response) + 1);
+		assert(*dst);
+		strcpy(*dst, response);
+	}
+
+	/* Cleanup */
+	free(response);
+	curl_slist_free_all(headers);
+	curl_easy_cleanup(curl);
+
+	return (int) result;
+
+}
+
+/* Sends requests to Kodi; replaced with a stub by the microbenchmark */
+int (*json_rpc_transport)(const char* post, const long timeout, char** dst) = perform_json_rpc_request;
+
+/* Derive request timeout from RTT estimate, backing off after failures */
+long
+health_timeout(health_t* health)
+{
+
+	double	timeout;
+	int	backoff;
+
+	pthread_mutex_lock(&health->lock);
+
+	if (health->samples == 0)
+	{
+		timeout = HEALTH_TIMEOUT_MAX;
+	}
+	else
+	{
+		timeout = health->srtt + 4 * health->rttvar;
+		backoff = health->failures < 3 ? health->failures : 3;
+		timeout *= 1 << backoff;
+	}
+
+	pthread_mutex_unlock(&health->lock);
+
+	if (timeout < HEALTH_TIMEOUT_MIN)
+		timeout = HEALTH_TIMEOUT_MIN;
+	else if (timeout > HEALTH_TIMEOUT_MAX)
+		timeout = HEALTH_TIMEOUT_MAX;
+
+	return (long) timeout;
+
+}
+
+void
+health_record_rtt(health_t* health, const double rtt)
+{
+	/* Jacobson/Karels estimator, as used for TCP retransmission timeouts */
+	if (health->samples == 0)
+	{
+		health->srtt = rtt;
+		health->rttvar = rtt / 2;
+	}
+	else
+	{
+		health->rttvar = 0.75 * health->rttvar + 0.25 * fabs(health->srtt - rtt);
+		health->srtt = 0.875 * health->srtt + 0.125 * rtt;
+	}
+	health->samples++;
+}
+
+/* Background thread probing Kodi while the circuit is open */
+void*
+health_probe(void* arg)
+{
+
+	health_t*	health = (health_t *) arg;
+	struct timespec	deadline;
+	double		start;
+	int		result;
+
+	pthread_mutex_lock(&health->lock);
+
+	while (!health->stopping && health->circuit != CIRCUIT_CLOSED)
+	{
+
+		/* Wait before probing, unless asked to stop */
+		get_deadline(&deadline, health->probe_interval);
+		pthread_cond_timedwait(&health->wakeup, &health->lock, &deadline);
+		if (health->stopping)
+			break;
+
+		/* Let a single request through */
+		health->circuit = CIRCUIT_HALF_OPEN;
+		pthread_mutex_unlock(&health->lock);
+		start = get_time_ms();
+		result = json_rpc_transport(JSON_RPC_PING, HEALTH_TIMEOUT_MAX, NULL);
+		pthread_mutex_lock(&health->lock);
+
+		if (result == 0)
+		{
+			health_record_rtt(health, get_time_ms() - start);
+			health->circuit = CIRCUIT_CLOSED;
+			health->failures = 0;
+			health->probe_interval = HEALTH_PROBE_INTERVAL_MIN;
+			print_log(LOG_NOTICE, "Kodi instance at %s:%s is responding again", config_json_rpc_host, config_json_rpc_port);
+		}
+		else
+		{
+			health->circuit = CIRCUIT_OPEN;
+			health->probe_interval *= 2;
+			if (health->probe_interval > HEALTH_PROBE_INTERVAL_MAX)
+				health->probe_interval = HEALTH_PROBE_INTERVAL_MAX;
+		}
+
+	}
+
+	pthread_mutex_unlock(&health->lock);
+
+	return NULL;
+
+}
+
+/* Check whether a request may be sent to Kodi right now */
+int
+health_allow(health_t* health)
+{
+	int allow;
+	pthread_mutex_lock(&health->lock);
+	allow = (health->circuit == CIRCUIT_CLOSED);
+	pthread_mutex_unlock(&health->lock);
+	return allow;
+}
+
+void
+health_report(health_t* health, const int result, const double rtt)
+{
+
+	pthread_mutex_lock(&health->lock);
+
+	if (result == 0)
+	{
+		health_record_rtt(health, rtt);
+		health->failures = 0;
+	}
+	else if (health->circuit == CIRCUIT_CLOSED)
+	{
+		health->failures++;
+		if (health->failures < HEALTH_FAILURE_THRESHOLD)
+		{
+			print_log(LOG_WARNING, "Kodi instance at %s:%s is not responding", config_json_rpc_host, config_json_rpc_port);
+		}
+		else
+		{
+			/* Open the circuit and start probing in the background */
+			print_log(LOG_WARNING, "Kodi instance at %s:%s is not responding, suspending requests until it recovers", config_json_rpc_host, config_json_rpc_port);
+			health->circuit = CIRCUIT_OPEN;
+			health->probe_interval = HEALTH_PROBE_INTERVAL_MIN;
+			/* A previous prober has already finished, but still has to be reaped */
+			if (health->prober_started)
+				pthread_join(health->prober, NULL);
+			health->prober_started = (pthread_create(&health->prober, NULL, health_probe, health) == 0);
+			if (!health->prober_started)
+				print_log(LOG_ERR, "Failed to start Kodi health prober");
+		}
+	}
+
+	pthread_mutex_unlock(&health->lock);
+
+}
+
+void
+stop_health_prober(void)
+{
+
+	int started;
+
+	pthread_mutex_lock(&kodi_health.lock);
+	kodi_health.stopping = 1;
+	started = kodi_health.prober_started;
+	kodi_health.prober_started = 0;
+	pthread_cond_broadcast(&kodi_health.wakeup);
+	pthread_mutex_unlock(&kodi_health.lock);
+
+	if (started)
+		pthread_join(kodi_health.prober, NULL);
+
+}
+
+/* Prepare POST data with or without parameters */
+char*
+format_json_rpc_post(const char* method, const char* params)
+{
+
+	char* post;
+
+	if (params == NULL)
+	{
+		post = malloc(strlen(JSON_RPC_POST) + strlen(method));
+		assert(post);
+		sprintf(post, JSON_RPC_POST, method);
+	}
+	else
+	{
+		post = malloc(strlen(JSON_RPC_POST_WITH_PARAMS) + strlen(method) + strlen(params));
+		assert(post);
+		sprintf(post, JSON_RPC_POST_WITH_PARAMS, method, params);
+	}
+
+	return post;
+
+}
+
+int
+send_json_rpc_request(const char* method, const char* params, char** dst)
+{
+
+	char*	post;
+	double	start;
+	double	traced = trace_begin();
+	int	result;
+
+	/* Fail fast while Kodi is known to be unresponsive */
+	if (!health_allow(&kodi_health))
+	{
+		trace_end(traced, "rpc", "send_json_rpc_request", "%s (circuit open)", method);
+		return CURLE_COULDNT_CONNECT;
+	}
+
+	/* Send JSON-RPC request and update Kodi health */
+	post = format_json_rpc_post(method, params);
+	start = get_time_ms();
+	result = json_rpc_transport(post, health_timeout(&kodi_health), dst);
+	health_report(&kodi_health, result, get_time_ms() - start);
+
+	free(post);
+	trace_end(traced, "rpc", "send_json_rpc_request", "%s", method);
+
+	return result;
+
+}
+
+/*
+ * Pages of media libraries and the list of supported methods take Kodi far
+ * longer to prepare than commands do, so they get a fixed timeout of their
+ * own and are kept out of the RTT estimate and the circuit breaker.
+ */
+int
+send_bulk_json_rpc_request(const char* method, const char* params, char** dst)
+{
+
+	char*	post = format_json_rpc_post(method, params);
+	double	traced = trace_begin();
+	int	result;
+
+	result = json_rpc_transport(post, JSON_RPC_BULK_TIMEOUT, dst);
+
+	free(post);
+	trace_end(traced, "rpc", "send_bulk_json_rpc_request", "%s", method);
+
+	return result;
+
+}
+
+void
+free_request(request_t* request)
+{
+	free(request->method);
+	free(request->params);
+	free(request);
+}
+
+/* Worker thread sending requests queued in a lane */
+void*
+lane_worker(void* arg)
+{
+
+	lane_t*		lane = (lane_t *) arg;
+	request_t*	request;
+	struct timespec	deadline;
+	double		wait;
+	double		traced;
+	int		repeat;
+
+	trace_thread(lane->name);
+
+	pthread_mutex_lock(&lane->lock);
+
+	for (;;)
+	{
+
+		if (lane->head == NULL)
+		{
+			if (lane->stopping)
+				break;
+			pthread_cond_wait(&lane->wakeup, &lane->lock);
+			continue;
+		}
+
+		/* Pending requests in droppable lanes are not worth delaying exit for */
+		if (lane->stopping && lane->droppable)
+			break;
+
+		request = lane->head;
+
+		/* Don't keep repeating at exit */
+		if (lane->stopping && request->sent > 0)
+			request->repeats = request->sent;
+
+		/* Drop requests whose repeats were cancelled */
+		if (request->sent >= request->repeats)
+		{
+			lane->head = request->next;
+			if (lane->head == NULL)
+				lane->tail = NULL;
+			free_request(request);
+			continue;
+		}
+
+		/* Wait for the next repeat and for rate limiting - the request may be
+		   replaced or its repeats cancelled meanwhile */
+		wait = lane->last_sent + lane->interval;
+		if (request->due > wait)
+			wait = request->due;
+		wait -= get_time_ms();
+		if (wait > 0 && !lane->stopping)
+		{
+			repeat = (request->sent > 0);
+			traced = trace_begin();
+			get_deadline(&deadline, (long) wait);
+			pthread_cond_timedwait(&lane->wakeup, &lane->lock, &deadline);
+			trace_end(traced, "rpc", repeat ? "wait for repeat" : "wait for rate limit", "%.0f ms", wait);
+			continue;
+		}
+
+		/* Dequeue and send request */
+		lane->head = request->next;
+		if (lane->head == NULL)
+			lane->tail = NULL;
+		lane->current = request;
+		request->sent++;
+		pthread_mutex_unlock(&lane->lock);
+		send_json_rpc_request(request->method, request->params, NULL);
+		pthread_mutex_lock(&lane->lock);
+		lane->current = NULL;
+		lane->last_sent = get_time_ms();
+
+		/* Put request back in front of the queue if it has to be repeated */
+		if (request->sent < request->repeats)
+		{
+			request->due = lane->last_sent + request->interval;
+			request->next = lane->head;
+			lane->head = request;
+			if (lane->tail == NULL)
+				lane->tail = request;
+		}
+		else
+		{
+			free_request(request);
+		}
+
+	}
+
+	/* Discard whatever was left */
+	while (lane->head)
+	{
+		request = lane->head;
+		lane->head = request->next;
+		free_request(request);
+	}
+	lane->tail = NULL;
+
+	pthread_mutex_unlock(&lane->lock);
+
+	return NULL;
+
+}
+
+/* Queue a request in a lane; the caller keeps ownership of arguments */
+void
+lane_push(lane_t* lane, const char* method, const char* params, const int repeats, const long interval)
+{
+
+	request_t* request = malloc(sizeof(request_t));
+	assert(request);
+	request->method = strdup(method);
+	request->params = params ? strdup(params) : NULL;
+	request->repeats = repeats;
+	request->sent = 0;
+	request->interval = interval;
+	request->due = 0;
+	request->next = NULL;
+
+	pthread_mutex_lock(&lane->lock);
+
+	/* Droppable lanes only ever hold the latest request */
+	if (lane->droppable && lane->head)
+	{
+		free_request(lane->head);
+		lane->head = lane->tail = NULL;
+	}
+
+	if (lane->tail)
+		lane->tail->next = request;
+	else
+		lane->head = request;
+	lane->tail = request;
+
+	pthread_cond_signal(&lane->wakeup);
+	pthread_mutex_unlock(&lane->lock);
+
+}
+
+/* Cancel remaining repeats of queued requests, returns 1 if any were cancelled */
+int
+lane_cancel_repeats(lane_t* lane)
+{
+
+	request_t*	request;
+	int		cancelled = 0;
+
+	pthread_mutex_lock(&lane->lock);
+
+	/* Requests which were not sent yet are still sent once */
+	if (lane->current && lane->current->sent < lane->current->repeats)
+	{
+		lane->current->repeats = lane->current->sent;
+		cancelled = 1;
+	}
+	for (request = lane->head; request; request = request->next)
+	{
+		if (request->sent > 0 || request->repeats > 1)
+		{
+			request->repeats = request->sent > 0 ? request->sent : 1;
+			cancelled = 1;
+		}
+	}
+
+	pthread_cond_signal(&lane->wakeup);
+	pthread_mutex_unlock(&lane->lock);
+
+	return cancelled;
+
+}
+
+void
+start_lane(lane_t* lane)
+{
+	if (pthread_create(&lane->worker, NULL, lane_worker, lane) != 0)
+		die("Failed to start request worker");
+	lane->started = 1;
+}
+
+void
+stop_lane(lane_t* lane)
+{
+
+	if (!lane->started)
+		return;
+
+	pthread_mutex_lock(&lane->lock);
+	lane->stopping = 1;
+	pthread_cond_signal(&lane->wakeup);
+	pthread_mutex_unlock(&lane->lock);
+
+	pthread_join(lane->worker, NULL);
+	lane->started = 0;
+
+}
+
+void
+stop_lanes(void)
+{
+	/* Notifications are dropped, queued actions are still sent */
+	stop_lane(&notification_lane);
+	stop_lane(&action_lane);
+}
+
+void
+send_gui_notification(const char* title, const char* message, const char* icon)
+{
+
+	const char*	format = "\"title\":\"%s\",\"message\":\"%s\",\"image\":\"%s\"";
+	char*		params;
+	char*		escaped;
+
+	if (kodi_version >= KODI_VERSION_FRODO && config_notifications)
+	{
+		escaped = json_escape(message);
+		params = malloc(strlen(format) + strlen(title) + strlen(escaped) + strlen(icon));
+		assert(params);
+		sprintf(params, format, title, escaped, icon);
+		lane_push(&notification_lane, "GUI.ShowNotification", params, 1, 0);
+		free(params);
+		free(escaped);
+	}
+
+}
+
+int
+get_json_rpc_response_int(const char* method, const char* params, const char* param)
+{
+
+	char*		response = NULL;
+	char*		result;
+	char*		param_search = NULL;
+	char*		param_string;
+	char		param_value[4];
+	unsigned int	i = 0;
+	int		retval = -1;
+
+	if (send_json_rpc_request(method, params, &response) != 0 || !response)
+		return -2;
+
+	result = strstr(response, "\"result\":");
+	if (result)
+	{
+		result += strlen("\"result\":") + 1;
+		param_search = malloc(strlen(param) + 4);
+		assert(param_search);
+		sprintf(param_search, "\"%s\":", param);
+		param_string = strstr(result, param_search);
+		if (param_string)
+		{
+			memset(param_value, 0, sizeof(param_value));
+			param_string += strlen(param) + 3;
+			while(i < sizeof(param_value) && *param_string >= '0' && *param_string <= '9')
+			{
+				param_value[i] = *param_string;
+				param_string++;
+				i++;
+			}
+			if (i == 0)
+				retval = -1;
+			else
+				retval = atoi(param_value);
+		}
+		free(param_search);
+	}
+	free(response);
+
+	return retval;
+
+}
+
+capabilities_t*
+new_capabilities(const int version)
+{
+
+	capabilities_t* caps = calloc(1, sizeof(capabilities_t));
+
+	assert(caps);
+	caps->host = malloc(strlen(config_json_rpc_host) + strlen(config_json_rpc_port) + 2);
+	assert(caps->host);
+	sprintf(caps->host, "%s:%s", config_json_rpc_host, config_json_rpc_port);
+	caps->version = version;
+
+	return caps;
+
+}
+
+int
+compare_methods(const void* a, const void* b)
+{
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void
+add_capability(capabilities_t* caps, const char* method, const int length)
+{
+
+	caps->methods = realloc(caps->methods, (caps->methods_count + 1) * sizeof(char*));
+	assert(caps->methods);
+	caps->methods[caps->methods_count] = strndup(method, length);
+	assert(caps->methods[caps->methods_count]);
+	caps->methods_count++;
+
+}
+
+/* Without a snapshot, every method is assumed to exist */
+int
+supports_method(const capabilities_t* caps, const char* method)
+{
+	return (!caps || bsearch(&method, caps->methods, caps->methods_count, sizeof(char*), compare_methods) != NULL);
+}
+
+/* Snapshots are compared method by method, so they have to be sorted */
+int
+same_capabilities(const capabilities_t* a, const capabilities_t* b)
+{
+
+	int i;
+
+	if (a->version != b->version || a->methods_count != b->methods_count)
+		return 0;
+
+	for (i=0; i<a->methods_count; i++)
+	{
+		if (strcmp(a->methods[i], b->methods[i]) != 0)
+			return 0;
+	}
+
+	return 1;
+
+}
+
+/* Ask Kodi which methods it supports - only the names of members of "methods" are kept */
+capabilities_t*
+fetch_capabilities(const int version)
+{
+
+	capabilities_t*	caps;
+	char*		response = NULL;
+	char*		p;
+	char*		key;
+	int		depth = 0;
+
+	if (send_bulk_json_rpc_request("JSONRPC.Introspect", "\"getdescriptions\":false,\"getmetadata\":false", &response) != 0 || !response)
+	{
+		free(response);
+		return NULL;
+	}
+
+	if ((p = strstr(response, "\"result\":")) == NULL || (p = strstr(p, "\"methods\"")) == NULL)
+	{
+		free(response);
+		return NULL;
+	}
+	p += strlen("\"methods\"");
+	while (isspace(*p) || *p == ':')
+		p++;
+
+	caps = new_capabilities(version);
+
+	for (; *p; p++)
+	{
+		if (*p == '"')
+		{
+			key = ++p;
+			while (*p && *p != '"')
+			{
+				if (*p == '\\' && *(p+1))
+					p++;
+				p++;
+			}
+			if (!*p)
+				break;
+			/* Method names are the keys of the outermost object */
+			if (depth == 1 && *(p + 1 + strspn(p + 1, " \t\r\n")) == ':')
+				add_capability(caps, key, p - key);
+		}
+		else if (*p == '{' || *p == '[')
+		{
+			depth++;
+		}
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+		{
+			break;
+		}
+	}
+
+	free(response);
+
+	if (depth != 0 || caps->methods_count == 0)
+	{
+		free_capabilities(caps);
+		return NULL;
+	}
+
+	qsort(caps->methods, caps->methods_count, sizeof(char*), compare_methods);
+
+	return caps;
+
+}
+
+/* A snapshot is only used for the host it was taken of */
+capabilities_t*
+load_capabilities(void)
+{
+
+	capabilities_t*	caps;
+	FILE*		file;
+	char		line[1024];
+	char		key[32];
+	char		value[sizeof(line)];
+	int		version = -1;
+
+	if ((file = fopen(config_capabilitiesfile, "r")) == NULL)
+		return NULL;
+
+	caps = new_capabilities(-1);
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (sscanf(line, "%31s %1023s", key, value) != 2)
+			continue;
+		if (strcmp(key, "host") == 0 && strcmp(value, caps->host) != 0)
+			break;
+		else if (strcmp(key, "version") == 0)
+			version = atoi(value);
+		else if (strcmp(key, "method") == 0)
+			add_capability(caps, value, strlen(value));
+	}
+
+	/* Unfinished or foreign snapshots are discarded */
+	if (!feof(file) || version < KODI_VERSION_MIN || caps->methods_count == 0)
+	{
+		fclose(file);
+		free_capabilities(caps);
+		return NULL;
+	}
+
+	fclose(file);
+	caps->version = version;
+	qsort(caps->methods, caps->methods_count, sizeof(char*), compare_methods);
+	print_log(LOG_INFO, "Loaded %d methods of Kodi version %d from %s", caps->methods_count, version, config_capabilitiesfile);
+
+	return caps;
+
+}
+
+void
+save_capabilities(const capabilities_t* caps)
+{
+
+	FILE*	file;
+	char*	tmp;
+	int	i;
+
+	/* Written like the state file, so that readers never see a partial snapshot */
+	tmp = malloc(strlen(config_capabilitiesfile) + strlen(".tmp") + 1);
+	assert(tmp);
+	sprintf(tmp, "%s.tmp", config_capabilitiesfile);
+
+	if ((file = fopen(tmp, "w")) == NULL)
+	{
+		print_log(LOG_WARNING, "Failed to save Kodi capabilities to %s", tmp);
+		free(tmp);
+		return;
+	}
+
+	fprintf(file, "host %s\n", caps->host);
+	fprintf(file, "version %d\n", caps->version);
+	for (i=0; i<caps->methods_count; i++)
+		fprintf(file, "method %s\n", caps->methods[i]);
+
+	if (fclose(file) != 0 || rename(tmp, config_capabilitiesfile) != 0)
+		print_log(LOG_WARNING, "Failed to save Kodi capabilities to %s", config_capabilitiesfile);
+
+	free(tmp);
+
+}
+
+void
+register_action(action_table_t* table, const char* word, const char* method, const char* params, const char* req[], const int req_size, const int repeats, const int needs_player_id, const int needs_argument)
+{
+
+	int		i;
+	action_t*	a;
+
+	/* Kodi would only answer with an error */
+	if (method && !supports_method(table->capabilities, method))
+	{
+		print_log(LOG_DEBUG, "Kodi does not support %s, not registering %s", method, word);
+		return;
+	}
+
+	/* Allocate memory for action structure */
+	a = malloc(sizeof(action_t));
+	assert(a);
+
+	/* Copy function arguments to structure fields */
+	a->word = strdup(word);
+
+	if (method)
+		a->method = strdup(method);
+	else
+		a->method = NULL;
+
+	if (params)
+		a->params = strdup(params);
+	else
+		a->params = NULL;
+
+	if (req)
+	{
+		a->req = calloc(req_size, sizeof(char *));
+		assert(a->req);
+		memcpy(a->req, req, req_size * sizeof(char *));
+	}
+	else
+	{
+		a->req = NULL;
+	}
+
+	a->req_size = req_size;
+	a->repeats = repeats;
+
+	/* Look up custom interval between repeats */
+	a->interval = REPEAT_INTERVAL;
+	for (i=0; i<repeat_intervals_size; i++)
+	{
+		if (strncmp(repeat_intervals[i], word, strlen(word)) == 0 && repeat_intervals[i][strlen(word)] == ':')
+			a->interval = atol(repeat_intervals[i] + strlen(word) + 1);
+	}
+	a->needs_player_id = needs_player_id;
+	a->needs_argument = needs_argument;
+
+	/* Expand action database */
+	table->actions = realloc(table->actions, (table->actions_count + 1) * sizeof(action_t *));
+	assert(table->actions);
+	/* Add action to database */
+	table->actions[table->actions_count] = a;
+	table->actions_count++;
+
+}
+
+void
+initialize_actions(action_table_t* table)
+{
+
+	/* General actions */
+	register_action(table, "BACK", "Input.Back", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "DOWNWARDS", "Input.Down", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "HOME", "Input.Home", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "LEFT", "Input.Left", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "MUTE", "Application.SetMute", "\"mute\": true", NULL, 0, 1, 0, 0);
+	register_action(table, "RIGHT", "Input.Right", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "SELECT", "Input.Select", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "UNMUTE", "Application.SetMute", "\"mute\": false", NULL, 0, 1, 0, 0);
+	register_action(table, "UPWARDS", "Input.Up", NULL, NULL, 0, 1, 0, 0);
+	register_action(table, "VOLUME", "Application.SetVolume", "\"volume\":%s", volume_args, volume_args_size, 1, 0, 1);
+
+	/* Repeating actions */
+	register_action(table, "TWO", NULL, NULL, repeatable, repeatable_size, 2, 0, 0);
+	register_action(table, "THREE", NULL, NULL, repeatable, repeatable_size, 3, 0, 0);
+	register_action(table, "FOUR", NULL, NULL, repeatable, repeatable_size, 4, 0, 0);
+	register_action(table, "FIVE", NULL, NULL, repeatable, repeatable_size, 5, 0, 0);
+	register_action(table, "ALL", NULL, NULL, repeatable, repeatable_size, REPEAT_UNTIL_STOPPED, 0, 0);
+
+	/* Version-dependent actions */
+	switch(kodi_version)
+	{
+
+		case KODI_VERSION_EDEN:
+			register_action(table, "NEXT", "Player.GoNext", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "PAUSE", "Player.PlayPause", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "PLAY", "Player.PlayPause", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "PREVIOUS", "Player.GoPrevious", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "REPEAT", "Player.Repeat", "\"state\":\"%s\"", repeat_args, repeat_args_size - 1, 1, 1, 1);
+			register_action(table, "SHUFFLE", "Player.Shuffle", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "STOP", "Player.Stop", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "UNSHUFFLE", "Player.UnShuffle", NULL, NULL, 0, 1, 1, 0);
+			break;
+
+		default:
+			/* Player actions */
+			register_action(table, "MENU", "Input.ShowOSD", NULL, NULL, 0, 1, 0, 0);
+			register_action(table, "NEXT", "Player.GoTo", "\"to\":\"next\"", NULL, 0, 1, 1, 0);
+			register_action(table, "PAUSE", "Player.SetSpeed", "\"speed\":0", NULL, 0, 1, 1, 0);
+			register_action(table, "PLAY", "Player.SetSpeed", "\"speed\":1", NULL, 0, 1, 1, 0);
+			register_action(table, "PREVIOUS", "Player.GoTo", "\"to\":\"previous\"", NULL, 0, 1, 1, 0);
+			register_action(table, "REPEAT", "Player.SetRepeat", "\"repeat\":\"%s\"", repeat_args, repeat_args_size, 1, 1, 0);
+			register_action(table, "SHUFFLE", "Player.SetShuffle", "\"shuffle\":true", NULL, 0, 1, 1, 0);
+			register_action(table, "STOP", "Player.Stop", NULL, NULL, 0, 1, 1, 0);
+			register_action(table, "UNSHUFFLE", "Player.SetShuffle", "\"shuffle\":false", NULL, 0, 1, 1, 0);
+			/* Window actions */
+			register_action(table, "FAVORITES", "GUI.ActivateWindow", "\"window\":\"favourites\"", NULL, 0, 1, 0, 0);
+			register_action(table, "MUSIC", "GUI.ActivateWindow", "\"window\":\"music\"", NULL, 0, 1, 0, 0);
+			register_action(table, "PICTURES", "GUI.ActivateWindow", "\"window\":\"pictures\"", NULL, 0, 1, 0, 0);
+			register_action(table, "PROGRAMS", "GUI.ActivateWindow", "\"window\":\"programs\"", NULL, 0, 1, 0, 0);
+			register_action(table, "SETTINGS", "GUI.ActivateWindow", "\"window\":\"settings\"", NULL, 0, 1, 0, 0);
+			register_action(table, "T_V", "GUI.ActivateWindow", "\"window\":\"pvr\"", NULL, 0, 1, 0, 0);
+			register_action(table, "VIDEOS", "GUI.ActivateWindow", "\"window\":\"videos\"", NULL, 0, 1, 0, 0);
+			register_action(table, "WEATHER", "GUI.ActivateWindow", "\"window\":\"weather\"", NULL, 0, 1, 0, 0);
+			/* Other actions */
+			register_action(table, "CONTEXT", "Input.ContextMenu", NULL, NULL, 0, 1, 0, 0);
+			break;
+
+	}
+
+}
+
+void
+free_command_list(command_list_t* list)
+{
+
+	int i;
+
+	for (i=0; i<list->count; i++)
+	{
+		free(list->commands[i].word);
+		free(list->commands[i].method);
+		free(list->commands[i].params);
+	}
+	free(list->commands);
+	free(list);
+
+}
+
+/* Actions with a parameterized method take the next word as their argument */
+int
+expects_argument(const action_t* action)
+{
+	return (action->params && action->req_size > 0 && action->repeats <= 1);
+}
+
+/* Index of an argument word of an action, -1 if it is not one; the last
+   argument of an action which can do without one is its default */
+int
+find_argument(const action_t* action, const char* word)
+{
+
+	int	len = strlen(word);
+	int	i;
+
+	for (i=0; i<action->req_size - (1 - action->needs_argument); i++)
+		if (strncmp(action->req[i], word, len) == 0 && action->req[i][len] == ':')
+			return i;
+
+	return -1;
+
+}
+
+void
+add_grammar_word(grammar_t* grammar, const char* word, const int length)
+{
+
+	grammar->words = realloc(grammar->words, (grammar->words_count + 1) * sizeof(char*));
+	assert(grammar->words);
+	grammar->words[grammar->words_count] = strndup(word, length);
+	assert(grammar->words[grammar->words_count]);
+	grammar->words_count++;
+
+}
+
+/* Column of a word in the transition table, the last one if it is unknown */
+int
+find_grammar_word(const grammar_t* grammar, const char* word)
+{
+
+	char** found = bsearch(&word, grammar->words, grammar->words_count, sizeof(char*), compare_methods);
+
+	return (found ? found - grammar->words : grammar->words_count);
+
+}
+
+/* Work out once per action table what every word does in every state, so
+   that compiling a hypothesis never has to search or backtrack */
+void
+compile_grammar(action_table_t* table)
+{
+
+	grammar_t*	grammar = &table->grammar;
+	const action_t*	action;
+	const action_t*	last;
+	transition_t*	t;
+	int		columns;
+	int		first;
+	int		state;
+	int		i;
+	int		j;
+
+	/* Vocabulary: every action word and every word which can be an argument */
+	for (i=0; i<table->actions_count; i++)
+	{
+		action = table->actions[i];
+		add_grammar_word(grammar, action->word, strlen(action->word));
+		if (expects_argument(action))
+			for (j=0; j<action->req_size - (1 - action->needs_argument); j++)
+				if (strchr(action->req[j], ':'))
+					add_grammar_word(grammar, action->req[j], strchr(action->req[j], ':') - action->req[j]);
+	}
+	qsort(grammar->words, grammar->words_count, sizeof(char*), compare_methods);
+	for (i=0, j=0; i<grammar->words_count; i++)
+	{
+		if (j > 0 && strcmp(grammar->words[j-1], grammar->words[i]) == 0)
+			free(grammar->words[i]);
+		else
+			grammar->words[j++] = grammar->words[i];
+	}
+	grammar->words_count = j;
+
+	columns = grammar->words_count + 1;
+	grammar->states_count = 1 + 2 * table->actions_count;
+	grammar->transitions = calloc(grammar->states_count * columns, sizeof(transition_t));
+	assert(grammar->transitions);
+
+	for (j=0; j<columns; j++)
+	{
+
+		/* The first action defined with a word wins */
+		first = -1;
+		for (i=0; j<grammar->words_count && i<table->actions_count && first < 0; i++)
+			if (strcmp(table->actions[i]->word, grammar->words[j]) == 0)
+				first = i;
+
+		for (state=0; state<grammar->states_count; state++)
+		{
+
+			t = &grammar->transitions[state * columns + j];
+			t->next = state;
+			last = (state > 0 ? table->actions[(state - 1) % table->actions_count] : NULL);
+
+			/* Waiting for an argument: anything else drops the pending action */
+			if (state > table->actions_count && expects_argument(last))
+			{
+				t->index = (j < grammar->words_count ? find_argument(last, grammar->words[j]) : -1);
+				t->op = (t->index < 0 ? GRAMMAR_INVALID_ARGUMENT : GRAMMAR_ARGUMENT);
+				t->next = state - table->actions_count;
+				continue;
+			}
+
+			t->index = first;
+			if (first < 0)
+				t->op = GRAMMAR_UNKNOWN;
+			else if (table->actions[first]->repeats <= 1)
+			{
+				t->op = GRAMMAR_ACTION;
+				t->next = 1 + first + (expects_argument(table->actions[first]) ? table->actions_count : 0);
+			}
+			/* Repeat modifiers apply to the action before them */
+			else if (!last)
+				t->op = GRAMMAR_NOTHING_TO_REPEAT;
+			else if (in_array(table->actions[first]->req, table->actions[first]->req_size, last->word))
+				t->op = GRAMMAR_REPEAT;
+			else
+				t->op = GRAMMAR_NOT_REPEATABLE;
+
+		}
+
+	}
+
+	print_log(LOG_DEBUG, "Compiled grammar of %d words and %d states", grammar->words_count, grammar->states_count);
+
+}
+
+void
+append_command(command_list_t* list, int* size, const action_t* action)
+{
+
+	command_t* command;
+
+	if (list->count == *size)
+	{
+		*size = (*size ? *size * 2 : MAX_ACTIONS);
+		list->commands = realloc(list->commands, *size * sizeof(command_t));
+		assert(list->commands);
+	}
+
+	command = &list->commands[list->count++];
+	command->word = strdup(action->word);
+	command->method = strdup(action->method);
+	command->params = (action->params && !expects_argument(action) ? strdup(action->params) : NULL);
+	command->repeats = action->repeats;
+	command->interval = action->interval;
+	command->needs_player_id = action->needs_player_id;
+
+}
+
+void
+drop_last_command(command_list_t* list)
+{
+
+	command_t* command = &list->commands[--list->count];
+
+	free(command->word);
+	free(command->method);
+	free(command->params);
+
+}
+
+/* Fill in params of the last command from one of its argument strings */
+void
+set_command_argument(command_list_t* list, const action_t* action, const char* argument)
+{
+
+	const char*	param = strchr(argument, ':') ? strchr(argument, ':') + 1 : argument;
+	char*		params_fmt;
+
+	params_fmt = malloc(strlen(action->params) + strlen(param) + 1);
+	assert(params_fmt);
+	sprintf(params_fmt, action->params, param);
+	append_param(&list->commands[list->count-1].params, params_fmt);
+	free(params_fmt);
+
+}
+
+/* Turn a hypothesis into a list of commands in a single pass over its words,
+   driven by the grammar of the action table; clean is cleared if anything in
+   it was invalid */
+command_list_t*
+compile_actions(const char* hyp, int* clean)
+{
+
+	const grammar_t*	grammar = &action_table->grammar;
+	const transition_t*	t;
+	const action_t*		action;
+	command_list_t*		list;
+	int*			sources = NULL;	/* action each command was compiled from */
+	int			size = 0;
+	int			state = 0;
+	char*			words;
+	char*			word;
+	char*			saveptr;
+
+	*clean = 1;
+
+	list = malloc(sizeof(command_list_t));
+	assert(list);
+	list->commands = NULL;
+	list->count = 0;
+
+	words = strdup(hyp);
+	assert(words);
+
+	for (word = strtok_r(words, " ", &saveptr); word; word = strtok_r(NULL, " ", &saveptr))
+	{
+
+		t = &grammar->transitions[state * (grammar->words_count + 1) + find_grammar_word(grammar, word)];
+
+		/* Drop the action waiting for an argument, then take the word as an action */
+		if (t->op == GRAMMAR_INVALID_ARGUMENT)
+		{
+			print_log(LOG_WARNING, "%s is not a valid argument for %s - interpreting as action", word, list->commands[list->count-1].word);
+			*clean = 0;
+			drop_last_command(list);
+			state = (list->count > 0 ? 1 + sources[list->count-1] : 0);
+			t = &grammar->transitions[state * (grammar->words_count + 1) + find_grammar_word(grammar, word)];
+		}
+
+		switch (t->op)
+		{
+			case GRAMMAR_ACTION:
+				append_command(list, &size, action_table->actions[t->index]);
+				sources = realloc(sources, size * sizeof(int));
+				assert(sources);
+				sources[list->count-1] = t->index;
+				break;
+			case GRAMMAR_ARGUMENT:
+				action = action_table->actions[sources[list->count-1]];
+				set_command_argument(list, action, action->req[t->index]);
+				break;
+			case GRAMMAR_REPEAT:
+				list->commands[list->count-1].repeats = action_table->actions[t->index]->repeats;
+				break;
+			case GRAMMAR_NOT_REPEATABLE:
+				print_log(LOG_WARNING, "Action %s is not repeatable", list->commands[list->count-1].word);
+				*clean = 0;
+				break;
+			case GRAMMAR_NOTHING_TO_REPEAT:
+				print_log(LOG_WARNING, "No action to repeat");
+				*clean = 0;
+				break;
+			default:
+				print_log(LOG_WARNING, "Unknown action \"%s\"", word);
+				*clean = 0;
+				break;
+		}
+
+		state = t->next;
+
+	}
+
+	/* Check if the last command accepts an argument which was not given */
+	if (state > action_table->actions_count)
+	{
+		action = action_table->actions[state - 1 - action_table->actions_count];
+		/* If the command requires an argument, discard last action */
+		if (action->needs_argument)
+		{
+			print_log(LOG_WARNING, "Action %s requires an argument, none given - ignoring action", action->word);
+			*clean = 0;
+			drop_last_command(list);
+		}
+		/* If the command also works without an argument, process it with the default argument */
+		else
+			set_command_argument(list, action, action->req[action->req_size-1]);
+	}
+
+	free(sources);
+	free(words);
+
+	return list;
+
+}
+
+/* Remember what became of a command, and how long it took since started, for the control client which dispatched the hypothesis */
+void
+record_dispatch(const command_t* command, const char* result, const double started)
+{
+
+	char*	record;
+	char*	word;
+	char*	escaped;
+	double	elapsed;
+
+	if (!dispatch.recording)
+		return;
+	elapsed = get_time_ms() - started;
+
+	/* Action files may use any word */
+	word = json_escape(command->word);
+	escaped = json_escape(result);
+	record = malloc(strlen(word) + strlen(escaped) + 96);
+	assert(record);
+	sprintf(record, "{\"command\":\"%s\",\"result\":\"%s\",\"repeats\":%d,\"time_ms\":%.3f}", word, escaped, command->repeats, elapsed);
+	append_param(&dispatch.commands, record);
+	free(record);
+	free(escaped);
+	free(word);
+
+}
+
+/* Queue compiled commands for sending, filling in the active player ID */
+void
+execute_commands(const command_list_t* list)
+{
+
+	int		i;
+	int		player_id = -3;
+	char*		params;
+	command_t*	command;
+	double		started = 0;
+
+	for (i=0; i<list->count; i++)
+	{
+
+		command = &list->commands[i];
+
+		/* Only control clients are told how long dispatching every command took */
+		if (dispatch.recording)
+			started = get_time_ms();
+
+		/* Perform only a few commands at a time to avoid confusion */
+		if (i >= MAX_ACTIONS)
+		{
+			print_log(LOG_WARNING, "Action %s ignored as only %d actions are performed at a time", command->word, MAX_ACTIONS);
+			record_dispatch(command, "too many", started);
+			continue;
+		}
+
+		if (!command->needs_player_id)
+		{
+			lane_push(&action_lane, command->method, command->params, command->repeats, command->interval);
+			record_dispatch(command, "queued", started);
+			continue;
+		}
+
+		/* Cache player ID for the rest of the list */
+		if (player_id == -3)
+			player_id = get_json_rpc_response_int("Player.GetActivePlayers", NULL, "playerid");
+
+		/* Ignore action if it requires a player ID and we don't have a player ID */
+		if (player_id < 0)
+		{
+			print_log(LOG_WARNING, "Player action %s ignored as there is no active player", command->word);
+			record_dispatch(command, "no player", started);
+			continue;
+		}
+
+		/* Player ID can be max 1 char */
+		params = malloc(strlen("\"playerid\":,") + 1 + (command->params ? strlen(command->params) : 0) + 1);
+		assert(params);
+		sprintf(params, "\"playerid\":%d", player_id);
+		if (command->params)
+			sprintf(params + strlen(params), ",%s", command->params);
+		lane_push(&action_lane, command->method, params, command->repeats, command->interval);
+		record_dispatch(command, "queued", started);
+		free(params);
+
+	}
+
+}
+
+/* Copy hypothesis with runs of whitespace collapsed into single spaces */
+char*
+normalize_hypothesis(const char* hyp)
+{
+
+	char*	normalized = malloc(strlen(hyp) + 1);
+	char*	dst = normalized;
+
+	assert(normalized);
+
+	for (; *hyp; hyp++)
+	{
+		if (isspace((unsigned char) *hyp))
+		{
+			if (dst > normalized && *(dst - 1) != ' ')
+				*dst++ = ' ';
+		}
+		else
+		{
+			*dst++ = *hyp;
+		}
+	}
+	if (dst > normalized && *(dst - 1) == ' ')
+		dst--;
+	*dst = '\0';
+
+	return normalized;
+
+}
+
+unsigned int
+hash_string(const char* string)
+{
+	/* djb2 */
+	unsigned int hash = 5381;
+	while (*string)
+		hash = hash * 33 + (unsigned char) *string++;
+	return hash;
+}
+
+void
+cache_unlink(cache_entry_t* entry)
+{
+	if (entry->prev)
+		entry->prev->next = entry->next;
+	else
+		command_cache.head = entry->next;
+	if (entry->next)
+		entry->next->prev = entry->prev;
+	else
+		command_cache.tail = entry->prev;
+	entry->prev = entry->next = NULL;
+}
+
+void
+cache_link_front(cache_entry_t* entry)
+{
+	entry->prev = NULL;
+	entry->next = command_cache.head;
+	if (command_cache.head)
+		command_cache.head->prev = entry;
+	else
+		command_cache.tail = entry;
+	command_cache.head = entry;
+}
+
+void
+cache_free_entry(cache_entry_t* entry)
+{
+	free(entry->key);
+	free_command_list(entry->list);
+	free(entry);
+}
+
+void
+cache_flush(void)
+{
+	while (command_cache.head)
+	{
+		cache_entry_t* entry = command_cache.head;
+		cache_unlink(entry);
+		cache_free_entry(entry);
+	}
+	command_cache.count = 0;
+}
+
+/* Find compiled commands for a normalized hypothesis, marking them as recently used */
+command_list_t*
+cache_lookup(const char* key, const unsigned int hash)
+{
+
+	cache_entry_t* entry;
+
+	/* Entries compiled from an older action table are useless */
+	if (command_cache.generation != action_table->generation)
+	{
+		cache_flush();
+		command_cache.generation = action_table->generation;
+	}
+
+	for (entry = command_cache.head; entry; entry = entry->next)
+	{
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+		{
+			cache_unlink(entry);
+			cache_link_front(entry);
+			return entry->list;
+		}
+	}
+
+	return NULL;
+
+}
+
+/* Insert compiled commands into cache, which takes ownership of them */
+void
+cache_insert(const char* key, const unsigned int hash, command_list_t* list)
+{
+
+	cache_entry_t* entry;
+
+	/* Evict least recently used entry if cache is full */
+	if (command_cache.count == COMMAND_CACHE_SIZE)
+	{
+		entry = command_cache.tail;
+		cache_unlink(entry);
+		cache_free_entry(entry);
+		command_cache.count--;
+	}
+
+	entry = malloc(sizeof(cache_entry_t));
+	assert(entry);
+	entry->key = strdup(key);
+	entry->hash = hash;
+	entry->list = list;
+	cache_link_front(entry);
+	command_cache.count++;
+
+}
+
+void
+report_cache_statistics(void)
+{
+	unsigned long total = command_cache.hits + command_cache.misses;
+	if (total > 0)
+		print_log(LOG_INFO, "Command cache: %lu hits, %lu misses (%.1f%% hit rate)", command_cache.hits, command_cache.misses, 100.0 * command_cache.hits / total);
+}
+
+void
+perform_actions(const char* hyp)
+{
+
+	char*		key = normalize_hypothesis(hyp);
+	unsigned int	hash = hash_string(key);
+	command_list_t*	list;
+	int		clean;
+	double		traced;
+
+	/* Cached hypotheses skip parsing entirely */
+	if ((list = cache_lookup(key, hash)) != NULL)
+	{
+		command_cache.hits++;
+		dispatch.cached = 1;
+		execute_commands(list);
+	}
+	else
+	{
+		command_cache.misses++;
+		traced = trace_begin();
+		list = compile_actions(key, &clean);
+		trace_end(traced, "actions", "compile_actions", "%s", key);
+		dispatch.invalid = !clean;
+		execute_commands(list);
+		/* Hypotheses which caused warnings are not cached so that warnings keep showing up */
+		if (clean)
+			cache_insert(key, hash, list);
+		else
+			free_command_list(list);
+	}
+
+	free(key);
+
+}
+
+void
+register_cmap(action_table_t* table, const char* string, const int character)
+{
+
+	cmap_t* mapping = malloc(sizeof(cmap_t));
+	assert(mapping);
+	mapping->string = malloc(strlen(string) + 1);
+	strcpy(mapping->string, string);
+	mapping->character = character;
+
+	table->cmap = realloc(table->cmap, sizeof(cmap_t *) * (table->cmap_count + 1));
+	assert(table->cmap);
+	table->cmap[table->cmap_count] = mapping;
+	table->cmap_count++;
+
+}
+
+void
+initialize_cmap(action_table_t* table)
+{
+
+	/* Letters */
+	register_cmap(table, "ALPHA",		'a');
+	register_cmap(table, "BRAVO",		'b');
+	register_cmap(table, "CHARLIE",	'c');
+	register_cmap(table, "DELTA",		'd');
+	register_cmap(table, "ECHO",		'e');
+	register_cmap(table, "FOXTROT",	'f');
+	register_cmap(table, "GOLF",		'g');
+	register_cmap(table, "HOTEL",		'h');
+	register_cmap(table, "INDIA",		'i');
+	register_cmap(table, "JULIET",		'j');
+	register_cmap(table, "KILO",		'k');
+	register_cmap(table, "LIMA",		'l');
+	register_cmap(table, "MIKE",		'm');
+	register_cmap(table, "NOVEMBER",	'n');
+	register_cmap(table, "OSCAR",		'o');
+	register_cmap(table, "PAPA",		'p');
+	register_cmap(table, "QUEBEC",		'q');
+	register_cmap(table, "ROMEO",		'r');
+	register_cmap(table, "SIERRA",		's');
+	register_cmap(table, "TANGO",		't');
+	register_cmap(table, "UNIFORM",	'u');
+	register_cmap(table, "VICTOR",		'v');
+	register_cmap(table, "WHISKEY",	'w');
+	register_cmap(table, "X_RAY",		'x');
+	register_cmap(table, "YANKEE",		'y');
+	register_cmap(table, "ZULU",		'z');
+
+	/* Digits */
+	register_cmap(table, "ZERO",		'0');
+	register_cmap(table, "ONE",		'1');
+	register_cmap(table, "TWO",		'2');
+	register_cmap(table, "THREE",		'3');
+	register_cmap(table, "FOUR",		'4');
+	register_cmap(table, "FIVE",		'5');
+	register_cmap(table, "SIX",		'6');
+	register_cmap(table, "SEVEN",		'7');
+	register_cmap(table, "EIGHT",		'8');
+	register_cmap(table, "NINE",		'9');
+
+	/* Punctuation */
+	register_cmap(table, "COLON",		':');
+	register_cmap(table, "COMMA",		',');
+	register_cmap(table, "DOT",		'.');
+	register_cmap(table, "HYPHEN",		'-');
+	register_cmap(table, "SPACE",		' ');
+
+}
+
+int
+find_cmap(const char* string)
+{
+
+	int found = 0;
+	int i = 0;
+	int retval = -1;
+
+	while(i < action_table->cmap_count && !found)
+	{
+		if (strcmp(action_table->cmap[i]->string, string) == 0)
+		{
+			retval = action_table->cmap[i]->character;
+			found = 1;
+		}
+		i++;
+	}
+
+	return retval;
+
+}
+
+int
+is_action_flag(const char* token)
+{
+	return (strcmp(token, "player") == 0 || strcmp(token, "required") == 0 || strncmp(token, "args=", 5) == 0);
+}
+
+/* Keep a copy of a string for as long as the action table lives */
+char*
+table_string(action_table_t* table, const char* string)
+{
+
+	table->strings = realloc(table->strings, (table->strings_count + 1) * sizeof(char *));
+	assert(table->strings);
+	table->strings[table->strings_count] = strdup(string);
+	assert(table->strings[table->strings_count]);
+
+	return table->strings[table->strings_count++];
+
+}
+
+/* Parse an action file into a new table; errors are logged and NULL is returned */
+action_table_t*
+parse_action_file(const char* path)
+{
+
+	FILE*		file;
+	action_table_t*	table;
+	char		line[1024];
+	char*		tokens[ACTION_FILE_MAX_TOKENS];
+	char*		saveptr;
+	char*		end;
+	char*		args_names[ACTION_FILE_MAX_TOKENS];
+	const char**	args_lists[ACTION_FILE_MAX_TOKENS];
+	int		args_sizes[ACTION_FILE_MAX_TOKENS];
+	int		args_count = 0;
+	const char*	params;
+	const char**	req;
+	int		req_size;
+	int		count;
+	int		line_number = 0;
+	int		version_min = 0;
+	int		version_max = INT_MAX;
+	int		player;
+	int		required;
+	int		repeats;
+	long		value;
+	int		error = 0;
+	int		i;
+	int		j;
+
+	if ((file = fopen(path, "r")) == NULL)
+	{
+		print_log(LOG_ERR, "Unable to open action file %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	table = new_action_table();
+
+	while (!error && fgets(line, sizeof(line), file) != NULL)
+	{
+
+		line_number++;
+
+		/* Strip comments */
+		if ((end = strchr(line, '#')) != NULL)
+			*end = '\0';
+
+		/* Split line into whitespace-separated tokens */
+		count = 0;
+		for (tokens[0] = strtok_r(line, " \t\r\n", &saveptr); tokens[count] != NULL; tokens[count] = strtok_r(NULL, " \t\r\n", &saveptr))
+		{
+			if (++count == ACTION_FILE_MAX_TOKENS)
+			{
+				print_log(LOG_ERR, "%s:%d: Too many tokens", path, line_number);
+				error = 1;
+				break;
+			}
+		}
+		if (error || count == 0)
+			continue;
+
+		/* Version sections apply to all lines that follow them */
+		if (strcmp(tokens[0], "version") == 0)
+		{
+			if (count == 2 && strcmp(tokens[1], "any") == 0)
+			{
+				version_min = 0;
+				version_max = INT_MAX;
+			}
+			else if (count == 2 || count == 3)
+			{
+				version_min = strtol(tokens[1], &end, 10);
+				version_max = (count == 3 ? strtol(tokens[2], &end, 10) : INT_MAX);
+				if (*end != '\0' || version_min > version_max)
+				{
+					print_log(LOG_ERR, "%s:%d: Invalid version range", path, line_number);
+					error = 1;
+				}
+			}
+			else
+			{
+				print_log(LOG_ERR, "%s:%d: Usage: version <min> [<max>] | version any", path, line_number);
+				error = 1;
+			}
+			continue;
+		}
+
+		/* Argument lists are defined regardless of version, so that sections can share them */
+		if (strcmp(tokens[0], "args") == 0)
+		{
+			if (count < 3)
+			{
+				print_log(LOG_ERR, "%s:%d: Usage: args <name> <WORD:value>... [<default>]", path, line_number);
+				error = 1;
+				continue;
+			}
+			for (i=0; i<args_count; i++)
+			{
+				if (strcmp(args_names[i], tokens[1]) == 0)
+				{
+					print_log(LOG_ERR, "%s:%d: Argument list %s already defined", path, line_number, tokens[1]);
+					error = 1;
+				}
+			}
+			if (!error && args_count == ACTION_FILE_MAX_TOKENS)
+			{
+				print_log(LOG_ERR, "%s:%d: Too many argument lists", path, line_number);
+				error = 1;
+			}
+			if (error)
+				continue;
+			args_names[args_count] = table_string(table, tokens[1]);
+			args_lists[args_count] = calloc(count - 2, sizeof(char *));
+			assert(args_lists[args_count]);
+			for (i=2; i<count; i++)
+				args_lists[args_count][i-2] = table_string(table, tokens[i]);
+			args_sizes[args_count] = count - 2;
+			args_count++;
+			continue;
+		}
+
+		/* Skip lines not meant for the Kodi version we are talking to */
+		if (kodi_version < version_min || kodi_version > version_max)
+			continue;
+
+		if (strcmp(tokens[0], "action") == 0 || strcmp(tokens[0], "repeat") == 0)
+		{
+
+			if (count < 3)
+			{
+				if (strcmp(tokens[0], "repeat") == 0)
+					print_log(LOG_ERR, "%s:%d: Usage: repeat <WORD> <count>|stop args=<name>", path, line_number);
+				else
+					print_log(LOG_ERR, "%s:%d: Usage: action <WORD> <method> [<params>|-] [player] [args=<name>] [required]", path, line_number);
+				error = 1;
+				continue;
+			}
+
+			player = 0;
+			required = 0;
+			repeats = 1;
+			params = NULL;
+			req = NULL;
+			req_size = 0;
+
+			if (strcmp(tokens[0], "repeat") == 0)
+			{
+				if (strcmp(tokens[2], "stop") == 0)
+					repeats = REPEAT_UNTIL_STOPPED;
+				else if ((repeats = strtol(tokens[2], &end, 10)) < 2 || *end != '\0')
+				{
+					print_log(LOG_ERR, "%s:%d: Repeat count must be a number greater than 1 or \"stop\"", path, line_number);
+					error = 1;
+					continue;
+				}
+				j = 3;
+			}
+			else
+			{
+				/* Parameters are optional, so anything that is not a flag is taken for them */
+				j = 3;
+				if (count > 3 && !is_action_flag(tokens[3]))
+				{
+					if (strcmp(tokens[3], "-") != 0)
+						params = tokens[3];
+					j = 4;
+				}
+			}
+
+			/* Flags */
+			for (; j<count && !error; j++)
+			{
+				if (strcmp(tokens[j], "player") == 0 && repeats == 1)
+				{
+					player = 1;
+				}
+				else if (strcmp(tokens[j], "required") == 0 && repeats == 1)
+				{
+					required = 1;
+				}
+				else if (strncmp(tokens[j], "args=", 5) == 0)
+				{
+					for (i=0; i<args_count && strcmp(args_names[i], tokens[j] + 5) != 0; i++);
+					if (i == args_count)
+					{
+						print_log(LOG_ERR, "%s:%d: Unknown argument list %s", path, line_number, tokens[j] + 5);
+						error = 1;
+					}
+					else
+					{
+						req = args_lists[i];
+						req_size = args_sizes[i];
+					}
+				}
+				else
+				{
+					print_log(LOG_ERR, "%s:%d: Unknown flag %s", path, line_number, tokens[j]);
+					error = 1;
+				}
+			}
+			if (error)
+				continue;
+
+			if (repeats > 1)
+			{
+				/* Repeats apply to the preceding action, which must be one of the listed words */
+				if (req == NULL)
+				{
+					print_log(LOG_ERR, "%s:%d: Repeat needs a list of repeatable actions", path, line_number);
+					error = 1;
+					continue;
+				}
+				register_action(table, tokens[1], NULL, NULL, req, req_size, repeats, 0, 0);
+			}
+			else
+			{
+				if (req)
+				{
+					/* Optional arguments end with a default value, required ones must not */
+					for (i=0; i<req_size - (required ? 0 : 1); i++)
+					{
+						if (strchr(req[i], ':') == NULL)
+						{
+							print_log(LOG_ERR, "%s:%d: Argument %s is not in WORD:value form", path, line_number, req[i]);
+							error = 1;
+						}
+					}
+					if (!required && (req_size < 2 || strchr(req[req_size-1], ':') != NULL))
+					{
+						print_log(LOG_ERR, "%s:%d: Optional argument list must end with a default value", path, line_number);
+						error = 1;
+					}
+					if (error)
+						continue;
+				}
+				else if (required)
+				{
+					print_log(LOG_ERR, "%s:%d: Required argument needs an argument list", path, line_number);
+					error = 1;
+					continue;
+				}
+				register_action(table, tokens[1], tokens[2], params, req, req_size, 1, player, required);
+			}
+
+			/* Built-in intervals do not apply to actions from files */
+			table->actions[table->actions_count-1]->interval = REPEAT_INTERVAL;
+
+		}
+		else if (strcmp(tokens[0], "interval") == 0)
+		{
+			value = (count == 3 ? strtol(tokens[2], &end, 10) : -1);
+			if (value <= 0 || *end != '\0')
+			{
+				print_log(LOG_ERR, "%s:%d: Usage: interval <WORD> <milliseconds>", path, line_number);
+				error = 1;
+				continue;
+			}
+			for (i=0, j=0; i<table->actions_count; i++)
+			{
+				if (strcmp(table->actions[i]->word, tokens[1]) == 0)
+				{
+					table->actions[i]->interval = value;
+					j = 1;
+				}
+			}
+			if (!j)
+			{
+				print_log(LOG_ERR, "%s:%d: Interval for undefined action %s", path, line_number, tokens[1]);
+				error = 1;
+			}
+		}
+		else if (strcmp(tokens[0], "character") == 0)
+		{
+			/* Characters that cannot be written as a token are given by their code */
+			value = -1;
+			if (count == 3)
+				value = (strlen(tokens[2]) == 1 ? (unsigned char) tokens[2][0] : strtol(tokens[2], &end, 10));
+			if (value <= 0 || value > 255 || (strlen(tokens[2]) > 1 && *end != '\0'))
+			{
+				print_log(LOG_ERR, "%s:%d: Usage: character <WORD> <character>|<code>", path, line_number);
+				error = 1;
+				continue;
+			}
+			register_cmap(table, tokens[1], (int) value);
+		}
+		else
+		{
+			print_log(LOG_ERR, "%s:%d: Unknown directive %s", path, line_number, tokens[0]);
+			error = 1;
+		}
+
+	}
+
+	fclose(file);
+
+	for (i=0; i<args_count; i++)
+		free(args_lists[i]);
+
+	if (!error && table->actions_count == 0)
+	{
+		print_log(LOG_ERR, "%s: No actions defined for Kodi version %d", path, kodi_version);
+		error = 1;
+	}
+
+	if (error)
+	{
+		free_action_table(table);
+		return NULL;
+	}
+
+	/* Spelling works with built-in characters unless the file defines its own */
+	if (table->cmap_count == 0)
+		initialize_cmap(table);
+
+	return table;
+
+}
+
+/* Build the action table, either from the action file or from built-in definitions */
+action_table_t*
+load_action_table(void)
+{
+
+	action_table_t* table;
+
+	if (config_actionfile)
+	{
+		if ((table = parse_action_file(config_actionfile)) == NULL)
+			return NULL;
+		print_log(LOG_INFO, "Loaded %d actions from %s", table->actions_count, config_actionfile);
+	}
+	else
+	{
+		table = new_action_table();
+		/* Setup action database */
+		initialize_actions(table);
+		/* Setup command to character mapping database */
+		initialize_cmap(table);
+	}
+
+	compile_grammar(table);
+
+	return table;
+
+}
+
+/* Parsing runs in the background, so that a reload never delays listening */
+void*
+reload_action_table(void* arg)
+{
+
+	action_table_t* table;
+
+	trace_thread("action reloader");
+
+	if ((table = load_action_table()) == NULL)
+	{
+		print_log(LOG_WARNING, "Keeping previous actions, fix %s and send SIGHUP again", config_actionfile ? config_actionfile : "built-in actions");
+	}
+	else
+	{
+		/* A table nobody picked up yet is superseded */
+		free_action_table(__atomic_exchange_n(&pending_action_table, table, __ATOMIC_ACQ_REL));
+	}
+
+	__atomic_store_n(&reload_done, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+
+}
+
+/* Check a snapshot used at startup against Kodi, handing fresh capabilities to the main thread if anything changed */
+void*
+revalidate_capabilities(void* arg)
+{
+
+	capabilities_t*	fresh;
+	int		version;
+
+	trace_thread("revalidator");
+
+	version = get_json_rpc_response_int("Application.GetProperties", "\"properties\":[\"version\"]", "major");
+	if (version < 0 || (fresh = fetch_capabilities(version)) == NULL)
+	{
+		print_log(LOG_WARNING, "Unable to revalidate Kodi capabilities, using snapshot from %s", config_capabilitiesfile);
+		return NULL;
+	}
+
+	if (same_capabilities(fresh, capabilities))
+	{
+		print_log(LOG_DEBUG, "Kodi capabilities snapshot is up to date");
+		free_capabilities(fresh);
+		return NULL;
+	}
+
+	print_log(LOG_NOTICE, "Kodi at %s changed (version %d, %d methods), updating actions", fresh->host, version, fresh->methods_count);
+	if (version < KODI_VERSION_MIN)
+		print_log(LOG_WARNING, "Kodi version %d is unsupported", version);
+	save_capabilities(fresh);
+
+	/* Only the main thread switches Kodi version and capabilities, see update_action_table() */
+	__atomic_store_n(&revalidated_capabilities, fresh, __ATOMIC_RELEASE);
+
+	return NULL;
+
+}
+
+void
+start_reload(void)
+{
+
+	/* Nothing is listening in test mode, and lines should see the result of a reload before them */
+	if (config_test_mode)
+	{
+		reload_action_table(NULL);
+		return;
+	}
+
+	reload_done = 0;
+	if (pthread_create(&reload_thread, NULL, reload_action_table, NULL) != 0)
+		print_log(LOG_WARNING, "Unable to start reloading actions");
+	else
+		reloading = 1;
+
+}
+
+/* Start a reload if one was requested and switch to a freshly loaded table */
+void
+update_action_table(void)
+{
+
+	action_table_t*	table;
+	capabilities_t*	fresh;
+
+	/* Reloads run one at a time, so that an older table never replaces a newer one */
+	if (reloading && __atomic_load_n(&reload_done, __ATOMIC_ACQUIRE))
+		finish_reload();
+
+	/* Kodi changed since the snapshot was taken - the current table keeps using the stale capabilities until a new one is loaded */
+	if (!reloading && (fresh = __atomic_exchange_n(&revalidated_capabilities, NULL, __ATOMIC_ACQ_REL)) != NULL)
+	{
+		stale_capabilities = capabilities;
+		capabilities = fresh;
+		kodi_version = fresh->version;
+		start_reload();
+	}
+
+	/* A reload requested while another one runs starts after it, reading the file again */
+	if (reload_flag && !reloading)
+	{
+		reload_flag = 0;
+		if (!config_actionfile)
+			print_log(LOG_NOTICE, "Built-in actions in use, nothing to reload");
+		else
+			start_reload();
+	}
+
+	/* Only the main thread reads the table, so the old one can be freed right away */
+	if ((table = __atomic_exchange_n(&pending_action_table, NULL, __ATOMIC_ACQ_REL)) != NULL)
+	{
+		free_action_table(action_table);
+		action_table = table;
+	}
+
+}
+
+/* Uppercase letters and digits of a title separated by single spaces, which is all that can be spelled */
+char*
+normalize_title(const char* title)
+{
+
+	/* Latin letters U+00C0 to U+00FF without accents */
+	static const char	latin1[] = "AAAAAAACEEEEIIIIDNOOOOO OUUUUY SAAAAAAACEEEEIIIIDNOOOOO OUUUUY Y";
+	static const char*	articles[] = { "THE ", "AN ", "A " };
+	const unsigned char*	src;
+	char*			key = malloc(strlen(title) + 1);
+	char*			dst = key;
+	unsigned int		i;
+	int			c;
+
+	assert(key);
+
+	for (src = (const unsigned char*) title; *src; src++)
+	{
+		c = *src;
+		if (c == 0xc3 && src[1] >= 0x80 && src[1] <= 0xbf)
+			c = latin1[*++src - 0x80];
+		if (c < 0x80 && isalnum(c))
+			*dst++ = toupper(c);
+		/* Apostrophes are not spelled, e.g. "DON'T" becomes "DONT" */
+		else if (c != '\'' && dst > key && *(dst - 1) != ' ')
+			*dst++ = ' ';
+	}
+	if (dst > key && *(dst - 1) == ' ')
+		dst--;
+	*dst = '\0';
+
+	/* Leading articles are left out, just like when Kodi sorts titles */
+	for (i=0; i<ARRAY_SIZE(articles); i++)
+	{
+		if (strncmp(key, articles[i], strlen(articles[i])) == 0)
+		{
+			memmove(key, key + strlen(articles[i]), strlen(key) - strlen(articles[i]) + 1);
+			break;
+		}
+	}
+
+	return key;
+
+}
+
+/* End of the JSON value starting at p, NULL if it does not end before limit */
+char*
+json_value_end(char* p, const char* limit)
+{
+
+	int	depth = 0;
+	int	string = 0;
+
+	for (; p < limit; p++)
+	{
+		if (string)
+		{
+			if (*p == '\\')
+				p++;
+			else if (*p == '"')
+			{
+				string = 0;
+				if (depth == 0)
+					return p + 1;
+			}
+		}
+		else if (*p == '"')
+			string = 1;
+		else if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+			return p + 1;
+		/* End of a number, boolean or null */
+		else if (depth == 0 && (*p == ',' || isspace(*p)))
+			return p;
+	}
+
+	return NULL;
+
+}
+
+/* Return a newly allocated, unescaped copy of the JSON string member key of json, NULL if missing */
+char*
+json_member_string(const char* json, const char* key)
+{
+
+	char*		pattern;
+	const char*	p;
+	char*		string;
+	char*		dst;
+	unsigned int	c;
+
+	pattern = malloc(strlen(key) + 4);
+	assert(pattern);
+	sprintf(pattern, "\"%s\":", key);
+	p = strstr(json, pattern);
+	free(pattern);
+	if (p == NULL)
+		return NULL;
+	p += strlen(key) + 3;
+	while (isspace(*p))
+		p++;
+	if (*p++ != '"')
+		return NULL;
+
+	/* Escape sequences never get longer when unescaped */
+	string = dst = malloc(strlen(p) + 1);
+	assert(string);
+	for (; *p && *p != '"'; p++)
+	{
+		if (*p != '\\' || !*(p + 1))
+		{
+			*dst++ = *p;
+			continue;
+		}
+		switch (*++p)
+		{
+			case 'n':
+				*dst++ = '\n';
+				break;
+			case 't':
+				*dst++ = '\t';
+				break;
+			case 'r':
+			case 'b':
+			case 'f':
+				*dst++ = ' ';
+				break;
+			case 'u':
+				/* A truncated escape means the string is broken */
+				for (c=1; c<=4 && isxdigit((unsigned char) p[c]); c++);
+				if (c <= 4 || sscanf(p + 1, "%4x", &c) != 1)
+				{
+					free(string);
+					return NULL;
+				}
+				p += 4;
+				/* Encode as UTF-8, surrogate pairs are not worth combining for spelling */
+				if (c < 0x80)
+					*dst++ = c;
+				else if (c < 0x800)
+				{
+					*dst++ = 0xc0 | (c >> 6);
+					*dst++ = 0x80 | (c & 0x3f);
+				}
+				else
+				{
+					*dst++ = 0xe0 | (c >> 12);
+					*dst++ = 0x80 | ((c >> 6) & 0x3f);
+					*dst++ = 0x80 | (c & 0x3f);
+				}
+				break;
+			default:
+				*dst++ = *p;
+				break;
+		}
+	}
+	*dst = '\0';
+
+	return string;
+
+}
+
+/* Integer member key of json, -1 if missing */
+long
+json_member_int(const char* json, const char* key)
+{
+
+	char*		pattern;
+	const char*	p;
+
+	pattern = malloc(strlen(key) + 4);
+	assert(pattern);
+	sprintf(pattern, "\"%s\":", key);
+	p = strstr(json, pattern);
+	free(pattern);
+	if (p == NULL)
+		return -1;
+	p += strlen(key) + 3;
+	while (isspace(*p))
+		p++;
+
+	return (isdigit(*p) ? strtol(p, NULL, 10) : -1);
+
+}
+
+int
+compare_media_items(const void* a, const void* b)
+{
+
+	const media_item_t* x = *(media_item_t* const*) a;
+	const media_item_t* y = *(media_item_t* const*) b;
+
+	return strcmp(x->key, y->key);
+
+}
+
+/* Caller holds the index lock */
+void
+remove_media_item(const media_type_t* type, const int id)
+{
+
+	int i;
+
+	for (i=0; i<media_index.count; i++)
+	{
+		if (media_index.items[i]->type == type && media_index.items[i]->id == id)
+		{
+			free_media_item(media_index.items[i]);
+			media_index.count--;
+			memmove(&media_index.items[i], &media_index.items[i+1], (media_index.count - i) * sizeof(media_item_t*));
+			return;
+		}
+	}
+
+}
+
+/* Item described by a JSON object, NULL if it has no title */
+media_item_t*
+new_media_item(const media_type_t* type, const char* object)
+{
+
+	media_item_t*	item;
+	char*		label;
+	long		id;
+
+	if ((id = json_member_int(object, type->id_key)) < 0 || (label = json_member_string(object, "label")) == NULL)
+		return NULL;
+
+	item = malloc(sizeof(media_item_t));
+	assert(item);
+	item->type = type;
+	item->id = id;
+	item->label = label;
+	item->key = normalize_title(label);
+
+	if (*item->key == '\0')
+	{
+		free_media_item(item);
+		return NULL;
+	}
+
+	return item;
+
+}
+
+void
+append_media_item(media_item_t*** items, int* count, int* size, media_item_t* item)
+{
+	if (*count == *size)
+	{
+		*size = *size ? *size * 2 : MEDIA_PAGE_SIZE;
+		*items = realloc(*items, *size * sizeof(media_item_t*));
+		assert(*items);
+	}
+	(*items)[(*count)++] = item;
+}
+
+/* Fetch every item of a type, page by page so that no response gets huge */
+int
+fetch_media_items(const media_type_t* type, media_item_t*** items, int* count, int* size)
+{
+
+	char		params[64];
+	char		pattern[32];
+	char*		response;
+	char*		p;
+	char*		end;
+	char		saved;
+	media_item_t*	item;
+	long		total;
+	int		start;
+
+	for (start = 0; ; start += MEDIA_PAGE_SIZE)
+	{
+
+		response = NULL;
+		snprintf(params, sizeof(params), "\"limits\":{\"start\":%d,\"end\":%d}", start, start + MEDIA_PAGE_SIZE);
+		if (send_bulk_json_rpc_request(type->list_method, params, &response) != 0 || !response || (p = strstr(response, "\"result\":")) == NULL)
+		{
+			free(response);
+			return -1;
+		}
+
+		/* Empty libraries have no array of items at all */
+		total = json_member_int(p, "total");
+		snprintf(pattern, sizeof(pattern), "\"%s\":", type->list_key);
+		if ((p = strstr(p, pattern)) != NULL && (p = strchr(p, '[')) != NULL)
+		{
+			for (p++; *p && *p != ']'; p = end)
+			{
+				if (*p != '{')
+				{
+					end = p + 1;
+					continue;
+				}
+				if ((end = json_value_end(p, p + strlen(p))) == NULL)
+					break;
+				saved = *end;
+				*end = '\0';
+				if ((item = new_media_item(type, p)) != NULL)
+					append_media_item(items, count, size, item);
+				*end = saved;
+			}
+		}
+		free(response);
+
+		if (total < 0 || start + MEDIA_PAGE_SIZE >= total)
+			break;
+
+	}
+
+	return 0;
+
+}
+
+/* Replace every item of a library, or of all libraries if library is NULL, with a fresh listing */
+int
+index_media_library(const char* library)
+{
+
+	media_item_t**	items = NULL;
+	int		count = 0;
+	int		size = 0;
+	int		kept;
+	double		traced = trace_begin();
+	unsigned int	i;
+	int		j;
+
+	for (i=0; i<ARRAY_SIZE(media_types); i++)
+	{
+		if (library && strcmp(media_types[i].library, library) != 0)
+			continue;
+		if (fetch_media_items(&media_types[i], &items, &count, &size) != 0)
+		{
+			print_log(LOG_WARNING, "Unable to index %s, keeping previous index", library ? library : "Kodi libraries");
+			free_media_items(items, count);
+			return -1;
+		}
+	}
+
+	pthread_mutex_lock(&media_index.lock);
+	for (j=0, kept=0; j<media_index.count; j++)
+	{
+		if (library && strcmp(media_index.items[j]->type->library, library) != 0)
+			media_index.items[kept++] = media_index.items[j];
+		else
+			free_media_item(media_index.items[j]);
+	}
+	media_index.count = kept;
+	for (j=0; j<count; j++)
+		append_media_item(&media_index.items, &media_index.count, &media_index.size, items[j]);
+	qsort(media_index.items, media_index.count, sizeof(media_item_t*), compare_media_items);
+	media_index.indexed = 1;
+	pthread_mutex_unlock(&media_index.lock);
+
+	print_log(LOG_INFO, "Indexed %d titles from %s", count, library ? library : "Kodi libraries");
+	trace_end(traced, "media", "index_media_library", "%d titles", count);
+	free(items);
+
+	return 0;
+
+}
+
+/* Fetch a single item which was added or changed */
+void
+update_media_item(const media_type_t* type, const int id)
+{
+
+	char		params[64];
+	char*		response = NULL;
+	char*		p;
+	char*		end;
+	media_item_t*	item = NULL;
+	int		i;
+
+	snprintf(params, sizeof(params), "\"%s\":%d", type->id_key, id);
+	if (send_json_rpc_request(type->details_method, params, &response) == 0 && response
+		&& (p = strstr(response, type->details_key)) != NULL && (p = strchr(p, '{')) != NULL
+		&& (end = json_value_end(p, p + strlen(p))) != NULL)
+	{
+		*end = '\0';
+		item = new_media_item(type, p);
+	}
+	free(response);
+
+	if (item == NULL)
+	{
+		print_log(LOG_WARNING, "Unable to fetch %s %d from Kodi", type->type, id);
+		return;
+	}
+
+	pthread_mutex_lock(&media_index.lock);
+	remove_media_item(type, id);
+	append_media_item(&media_index.items, &media_index.count, &media_index.size, item);
+	/* Insertion sort step - everything else is in order already */
+	for (i=media_index.count-1; i>0 && compare_media_items(&media_index.items[i-1], &item) > 0; i--)
+		media_index.items[i] = media_index.items[i-1];
+	media_index.items[i] = item;
+	pthread_mutex_unlock(&media_index.lock);
+
+	print_log(LOG_DEBUG, "Indexed %s \"%s\"", type->type, item->label);
+
+}
+
+/* Keep the index current as libraries change */
+void
+handle_media_notification(const char* notification)
+{
+
+	char*			method;
+	char*			type_name;
+	char*			event;
+	const char*		params;
+	const media_type_t*	type = NULL;
+	long			id;
+	unsigned int		i;
+
+	if ((method = json_member_string(notification, "method")) == NULL)
+		return;
+	if ((event = strchr(method, '.')) == NULL || (params = strstr(notification, "\"params\":")) == NULL)
+	{
+		free(method);
+		return;
+	}
+	*event++ = '\0';
+	if (strcmp(method, "VideoLibrary") != 0 && strcmp(method, "AudioLibrary") != 0)
+	{
+		free(method);
+		return;
+	}
+
+	/* Scans and cleanups change many items at once, so the whole library is indexed again */
+	if (strcmp(event, "OnScanFinished") == 0 || strcmp(event, "OnCleanFinished") == 0)
+	{
+		index_media_library(method);
+	}
+	else if (strcmp(event, "OnUpdate") == 0 || strcmp(event, "OnRemove") == 0)
+	{
+		type_name = json_member_string(params, "type");
+		for (i=0; type_name && i<ARRAY_SIZE(media_types); i++)
+			if (strcmp(media_types[i].type, type_name) == 0 && strcmp(media_types[i].library, method) == 0)
+				type = &media_types[i];
+		free(type_name);
+		if (type && (id = json_member_int(params, "id")) >= 0)
+		{
+			if (strcmp(event, "OnUpdate") == 0)
+			{
+				update_media_item(type, id);
+			}
+			else
+			{
+				pthread_mutex_lock(&media_index.lock);
+				remove_media_item(type, id);
+				pthread_mutex_unlock(&media_index.lock);
+			}
+		}
+	}
+
+	free(method);
+
+}
+
+int
+connect_media_notifications(void)
+{
+
+	struct addrinfo		hints;
+	struct addrinfo*	addresses;
+	struct addrinfo*	address;
+	int			fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(config_json_rpc_host, config_media_port, &hints, &addresses) != 0)
+		return -1;
+
+	for (address = addresses; address; address = address->ai_next)
+	{
+		if ((fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+
+	return fd;
+
+}
+
+/* Background thread indexing libraries and following notifications Kodi sends about them */
+void*
+media_listener(void* arg)
+{
+
+	char*		buffer = malloc(MEDIA_NOTIFICATION_SIZE + 1);
+	char*		p;
+	char*		end;
+	int		length;
+	int		fd;
+	int		warned = 0;
+	int		missed = 0;	/* changes may have been missed while not connected */
+	ssize_t		k;
+	struct pollfd	pfd;
+	struct timespec	deadline;
+
+	assert(buffer);
+	trace_thread("media index");
+
+	while (!__atomic_load_n(&media_index.stopping, __ATOMIC_ACQUIRE))
+	{
+
+		/* Connect first, so that nothing changes unnoticed while indexing */
+		fd = connect_media_notifications();
+		if (!media_index.indexed || (fd != -1 && missed))
+			missed = (index_media_library(NULL) != 0);
+
+		if (fd == -1)
+		{
+			missed = 1;
+			if (!warned)
+				print_log(LOG_WARNING, "Unable to receive library notifications from Kodi at %s:%s, changes to libraries will be missed until it is possible", config_json_rpc_host, config_media_port);
+			warned = 1;
+			pthread_mutex_lock(&media_index.lock);
+			get_deadline(&deadline, MEDIA_RECONNECT_INTERVAL);
+			if (!media_index.stopping)
+				pthread_cond_timedwait(&media_index.wakeup, &media_index.lock, &deadline);
+			pthread_mutex_unlock(&media_index.lock);
+			continue;
+		}
+
+		if (warned)
+			print_log(LOG_NOTICE, "Receiving notifications from Kodi at %s:%s", config_json_rpc_host, config_media_port);
+		warned = 0;
+		length = 0;
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+
+		while (!__atomic_load_n(&media_index.stopping, __ATOMIC_ACQUIRE))
+		{
+
+			if (poll(&pfd, 1, MEDIA_POLL_INTERVAL) <= 0)
+				continue;
+			if ((k = read(fd, buffer + length, MEDIA_NOTIFICATION_SIZE - length)) <= 0)
+			{
+				print_log(LOG_WARNING, "Lost connection to Kodi notifications at %s:%s", config_json_rpc_host, config_media_port);
+				warned = 1;
+				missed = 1;
+				break;
+			}
+			length += k;
+			buffer[length] = '\0';
+
+			/* Notifications are JSON objects sent back to back */
+			for (p = buffer; p < buffer + length; p = end)
+			{
+				if (*p != '{')
+				{
+					end = p + 1;
+					continue;
+				}
+				if ((end = json_value_end(p, buffer + length)) == NULL)
+					break;
+				*(end - 1) = '\0';
+				handle_media_notification(p);
+			}
+			if (p == buffer && length == MEDIA_NOTIFICATION_SIZE)
+			{
+				print_log(LOG_WARNING, "Ignoring Kodi notification longer than %d bytes", MEDIA_NOTIFICATION_SIZE);
+				p = buffer + length;
+			}
+			length -= p - buffer;
+			memmove(buffer, p, length);
+
+		}
+
+		close(fd);
+
+	}
+
+	free(buffer);
+
+	return NULL;
+
+}
+
+/* Titles are looked up locally, so that playing one never waits for Kodi */
+void
+start_media_index(void)
+{
+
+	/* Like other background work, indexing only blocks in test mode */
+	if (config_test_mode)
+		index_media_library(NULL);
+
+	if (pthread_create(&media_index.listener, NULL, media_listener, NULL) != 0)
+		print_log(LOG_WARNING, "Unable to start following Kodi library changes");
+	else
+		media_index.started = 1;
+
+}
+
+void
+stop_media_index(void)
+{
+
+	if (!media_index.started)
+		return;
+
+	pthread_mutex_lock(&media_index.lock);
+	__atomic_store_n(&media_index.stopping, 1, __ATOMIC_RELEASE);
+	pthread_cond_signal(&media_index.wakeup);
+	pthread_mutex_unlock(&media_index.lock);
+	pthread_join(media_index.listener, NULL);
+	media_index.started = 0;
+
+}
+
+/* Edit distance between query and the prefix of title closest to it */
+int
+prefix_distance(const char* query, const int length, const char* title, const int limit)
+{
+
+	int	rows[2][MEDIA_QUERY_MAX + 1];
+	int*	previous = rows[0];
+	int*	current = rows[1];
+	int*	swap;
+	int	best = length;
+	int	i;
+	int	j;
+
+	for (j=0; j<=length; j++)
+		previous[j] = j;
+
+	/* A prefix longer than the query by more than limit characters is too far off */
+	for (i=1; title[i-1] && i<=length+limit; i++)
+	{
+		current[0] = i;
+		for (j=1; j<=length; j++)
+		{
+			current[j] = previous[j-1] + (query[j-1] != title[i-1]);
+			if (previous[j] + 1 < current[j])
+				current[j] = previous[j] + 1;
+			if (current[j-1] + 1 < current[j])
+				current[j] = current[j-1] + 1;
+		}
+		if (current[length] < best)
+			best = current[length];
+		swap = previous;
+		previous = current;
+		current = swap;
+	}
+
+	return best;
+
+}
+
+/* Find the item a spoken or partly spelled title refers to, returning its label */
+char*
+resolve_title(const char* title, const media_type_t** type, int* id)
+{
+
+	char*		key = normalize_title(title);
+	char		pattern[MEDIA_QUERY_MAX + 2];
+	media_item_t*	best = NULL;
+	char*		label = NULL;
+	int		length;
+	int		distance;
+	int		best_distance = 0;
+	int		low;
+	int		high;
+	int		middle;
+	int		i;
+
+	if (strlen(key) > MEDIA_QUERY_MAX)
+		key[MEDIA_QUERY_MAX] = '\0';
+	length = strlen(key);
+	if (length == 0)
+	{
+		free(key);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&media_index.lock);
+
+	/* Titles starting with the query are next to each other, the shortest one is what was meant */
+	for (low = 0, high = media_index.count; low < high; )
+	{
+		middle = (low + high) / 2;
+		if (strcmp(media_index.items[middle]->key, key) < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	for (i=low; i<media_index.count && strncmp(media_index.items[i]->key, key, length) == 0; i++)
+		if (!best || strlen(media_index.items[i]->key) < strlen(best->key))
+			best = media_index.items[i];
+
+	/* Then titles with a later word starting with it */
+	if (best == NULL)
+	{
+		sprintf(pattern, " %s", key);
+		for (i=0; i<media_index.count; i++)
+			if (strstr(media_index.items[i]->key, pattern) && (!best || strlen(media_index.items[i]->key) < strlen(best->key)))
+				best = media_index.items[i];
+	}
+
+	/* Finally allow a letter in every four to be misheard */
+	for (i=0; best == NULL && length >= 4 && i<media_index.count; i++)
+	{
+		distance = prefix_distance(key, length, media_index.items[i]->key, length / 4);
+		if (distance <= length / 4 && (!best || distance < best_distance || (distance == best_distance && strlen(media_index.items[i]->key) < strlen(best->key))))
+		{
+			best = media_index.items[i];
+			best_distance = distance;
+		}
+	}
+
+	if (best)
+	{
+		*type = best->type;
+		*id = best->id;
+		label = strdup(best->label);
+		assert(label);
+	}
+
+	pthread_mutex_unlock(&media_index.lock);
+	free(key);
+
+	return label;
+
+}
+
+/* Start playing the library item a title refers to with a single request */
+char*
+play_title(const char* title)
+{
+
+	const media_type_t*	type;
+	int			id;
+	char*			label;
+	char			params[64];
+
+	if ((label = resolve_title(title, &type, &id)) == NULL)
+	{
+		print_log(LOG_WARNING, "No title matching \"%s\" in media libraries", title);
+		return NULL;
+	}
+
+	snprintf(params, sizeof(params), "\"item\":{\"%s\":%d}", type->id_key, id);
+	lane_push(&action_lane, "Player.Open", params, 1, 0);
+	print_log(LOG_INFO, "Playing %s \"%s\"", type->type, label);
+
+	return label;
+
+}
+
+void
+spelling_append(const int character)
+{
+	if (spelling.length + 1 >= spelling.size)
+	{
+		spelling.size = spelling.size ? spelling.size * 2 : SPELLING_BUFFER_SIZE;
+		spelling.text = realloc(spelling.text, spelling.size);
+		assert(spelling.text);
+	}
+	spelling.text[spelling.length++] = character;
+	spelling.text[spelling.length] = '\0';
+}
+
+/* Send spelling buffer to Kodi if it changed and the debounce window has passed (or if forced) */
+void
+spelling_flush(const int force)
+{
+
+	const char*	format = "\"text\":\"%s\",\"done\":false";
+	char*		params;
+	char*		escaped;
+
+	if (spelling.due == 0 || (!force && get_time_ms() < spelling.due))
+		return;
+
+	spelling.due = 0;
+
+	if (spelling.sent && strcmp(spelling.text, spelling.sent) == 0)
+		return;
+
+	escaped = json_escape(spelling.text);
+	params = malloc(strlen(format) + strlen(escaped));
+	assert(params);
+	sprintf(params, format, escaped);
+	lane_push(&action_lane, "Input.SendText", params, 1, 0);
+	free(params);
+	free(escaped);
+
+	spelling.sent = realloc(spelling.sent, spelling.length + 1);
+	assert(spelling.sent);
+	strcpy(spelling.sent, spelling.text);
+
+}
+
+/* Forget the spelling buffer without sending it, leaving the input field in Kodi alone */
+void
+spelling_drop(void)
+{
+	spelling.length = 0;
+	if (spelling.text)
+		*spelling.text = '\0';
+	spelling.due = 0;
+}
+
+/* Empty spelling buffer and the input field in Kodi */
+void
+spelling_clear(void)
+{
+	spelling.length = 0;
+	if (spelling.size == 0)
+		spelling_append('\0');
+	spelling.length = 0;
+	*spelling.text = '\0';
+	/* Contents of the input field in Kodi are unknown, so always send */
+	free(spelling.sent);
+	spelling.sent = NULL;
+	spelling.due = get_time_ms();
+	spelling_flush(1);
+}
+
+void
+perform_spelling(const char* hyp)
+{
+
+	int	i = 0;
+	int	ls = -1;
+	int	character;
+	char*	command;
+
+	do
+	{
+		if (*(hyp + i) == ' ' || *(hyp + i) == '\0')
+		{
+
+			/* Extract a single command */
+			command = malloc(i - ls);
+			assert(command);
+			memset(command, 0, i - ls);
+			memcpy(command, hyp + ls + 1, i - ls - 1);
+
+			/* DELETE command is treated separately as it doesn't add characters to the buffer */
+			if (strcmp("DELETE", command) == 0)
+			{
+				if (spelling.length > 0)
+					spelling.text[--spelling.length] = '\0';
+			}
+			else if (strcmp("LOWER", command) == 0)
+			{
+				spelling_case = 0;
+			}
+			else if (strcmp("UPPER", command) == 0)
+			{
+				spelling_case = 1;
+			}
+			else
+			{
+				/* Try to find a character matching the command */
+				character = find_cmap(command);
+				if (character != -1)
+					/* If the command is valid, append the character mapped to it to the buffer */
+					spelling_append(spelling_case ? toupper(character) : character);
+				else if (strlen(command) > 0)
+					/* If the command is invalid, print out a warning */
+					print_log(LOG_WARNING, "Unknown spelling mode command \"%s\"", command);
+			}
+
+			ls = i;
+			free(command);
+
+		}
+	}
+	while (*(hyp + i++) != '\0');
+
+	/* Coalesce with further edits arriving within the debounce window */
+	spelling.due = get_time_ms() + SPELLING_DEBOUNCE;
+
+}
+
+int
+process_hypothesis(const char* hyp)
+{
+
+	char*	hyp_new = strdup(hyp);
+	char*	next_word;
+	char*	params;
+	char*	label;
+	int	retval = 0;
+	int	cancelled = 0;
+	double	traced = trace_begin();
+
+	/* Anything heard cancels repeats still pending from previous commands */
+	if (*hyp)
+		cancelled = lane_cancel_repeats(&action_lane);
+
+	if (config_locking)
+	{
+		/* If we are locked and... */
+		if (locked)
+		{
+			/* ...the first command heard is the unlock command, unlock and continue */
+			if (strstr(hyp, COMMAND_UNLOCK) == hyp)
+			{
+				locked = 0;
+				print_log(LOG_INFO, "kodivc is now unlocked");
+				/* Check if there are further commands after the unlock command */
+				next_word = strchr(hyp, ' ');
+				if (next_word)
+				{
+					/* If yes, remove the unlock command from the hypothesis */
+					free(hyp_new);
+					hyp_new = strdup(next_word + 1);
+				}
+				else
+				{
+					/* If not, send GUI notification confirming unlocking */
+					params = malloc(strlen("Current mode: %s") + strlen(modes[mode]));
+					assert(params);
+					sprintf(params, "Current mode: %s", modes[mode]);
+					send_gui_notification("Voice recognition enabled", params, "warning");
+					print_log(LOG_INFO, "Current mode: %s", modes[mode]);
+					free(params);
+					free(hyp_new);
+					hyp_new = strdup("");
+				}
+			}
+			/* ...the first command heard is not the unlock command, warn and ignore all commands */
+			else
+			{
+				print_log(LOG_WARNING, "kodivc is locked and not processing commands, say " COMMAND_UNLOCK " to unlock");
+			}
+		}
+		/* If we are unlocked and the only command heard is the lock command, lock */
+		else if (strcmp(COMMAND_LOCK, hyp_new) == 0)
+		{
+			locked = 1;
+			send_gui_notification("Voice recognition disabled", "Not listening for commands", "warning");
+			print_log(LOG_INFO, "kodivc is now locked");
+		}
+	}
+
+	/* If we are unlocked or we don't care about locking... */
+	if ((config_locking && !locked) || !config_locking)
+	{
+		/* Check for mode-changing keywords */
+		switch(mode)
+		{
+
+			case MODE_NORMAL:
+				/* Change to spelling mode */
+				if (strcmp("SPELL", hyp_new) == 0)
+				{
+					if (kodi_version >= KODI_VERSION_FRODO)
+					{
+						spelling_clear();
+						spelling_case = 0;
+						mode = MODE_SPELLING;
+						retval = 1;
+						print_log(LOG_INFO, "Changed to spelling mode");
+						send_gui_notification("Voice recognition mode changed", "Current mode: spelling", "warning");
+					}
+					else
+					{
+						print_log(LOG_ERR, "Spelling mode not available before Frodo");
+					}
+				}
+				/* STOP on its own only stops repeating, if anything was being repeated */
+				else if (cancelled && strcmp("STOP", hyp_new) == 0)
+				{
+					print_log(LOG_INFO, "Stopped repeating");
+				}
+				else if (strlen(hyp_new) > 0)
+				{
+					/* Send GUI notification with the commands heard */
+					send_gui_notification("Voice command heard", hyp_new, "info");
+					/* Perform requested actions */
+					perform_actions(hyp_new);
+				}
+				break;
+
+			case MODE_SPELLING:
+				/* Return to normal mode, accepting input */
+				if (strcmp("ACCEPT", hyp_new) == 0)
+				{
+					spelling_flush(1);
+					lane_push(&action_lane, "Input.ExecuteAction", "\"action\":\"enter\"", 1, 0);
+					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
+					mode = MODE_NORMAL;
+					retval = 1;
+					print_log(LOG_INFO, "Changed to normal mode");
+				}
+				/* Return to normal mode, rejecting input */
+				else if (strcmp("CANCEL", hyp_new) == 0)
+				{
+					spelling_drop();
+					lane_push(&action_lane, "Input.ExecuteAction", "\"action\":\"previousmenu\"", 1, 0);
+					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
+					mode = MODE_NORMAL;
+					retval = 1;
+					print_log(LOG_INFO, "Changed to normal mode");
+				}
+				/* Clear input */
+				else if (strcmp("CLEAR", hyp_new) == 0)
+				{
+					spelling_clear();
+				}
+				/* Return to normal mode */
+				else if (strcmp("NORMAL", hyp_new) == 0)
+				{
+					/* Send pending input and GUI notification and change mode */
+					spelling_flush(1);
+					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
+					mode = MODE_NORMAL;
+					retval = 1;
+					print_log(LOG_INFO, "Changed to normal mode");
+				}
+				/* Play the library item whose title was spelled */
+				else if (strcmp("PLAY", hyp_new) == 0)
+				{
+					if (!config_media_port)
+					{
+						print_log(LOG_WARNING, "Media library index is disabled, start kodivc with -M to play titles by name");
+					}
+					else if ((label = play_title(spelling.text)) != NULL)
+					{
+						/* What was spelled is not meant for the input field */
+						spelling_drop();
+						send_gui_notification("Playing", label, "info");
+						mode = MODE_NORMAL;
+						retval = 1;
+						print_log(LOG_INFO, "Changed to normal mode");
+						free(label);
+					}
+					else
+					{
+						send_gui_notification("Title not found", spelling.text, "warning");
+					}
+				}
+				else
+				{
+					perform_spelling(hyp_new);
+				}
+				break;
+
+		}
+	}
+
+	free(hyp_new);
+	trace_end(traced, "actions", "process_hypothesis", "%s", hyp);
+
+	return retval;
+
+}
+
+void
+stop_control(void)
+{
+
+	int i;
+
+	if (control_socket == -1)
+		return;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+	{
+		if (control_clients[i].fd != -1)
+			close(control_clients[i].fd);
+	}
+	close(control_socket);
+	control_socket = -1;
+	unlink(config_control_socket);
+
+}
+
+void
+start_control(void)
+{
+
+	struct sockaddr_un	address;
+	int			fd;
+	int			i;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+		control_clients[i].fd = -1;
+
+	if (strlen(config_control_socket) >= sizeof(address.sun_path))
+		die("Control socket path %s is too long", config_control_socket);
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, config_control_socket);
+
+	/* Only remove a socket left behind by a previous instance which is no longer running */
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		die("Unable to create control socket");
+	if (connect(fd, (struct sockaddr *) &address, sizeof(address)) == 0)
+		die("Control socket %s is in use by another process", config_control_socket);
+	close(fd);
+	unlink(config_control_socket);
+
+	if ((control_socket = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		die("Unable to create control socket");
+	if (bind(control_socket, (struct sockaddr *) &address, sizeof(address)) == -1)
+		die("Unable to bind control socket to %s: %s", config_control_socket, strerror(errno));
+	/* Daemon mode clears the umask, but controlling kodivc is up to its own user only */
+	if (chmod(config_control_socket, 0600) == -1 || listen(control_socket, CONTROL_CLIENTS) == -1 || fcntl(control_socket, F_SETFL, O_NONBLOCK) == -1)
+		die("Unable to listen on control socket %s", config_control_socket);
+
+	assert(atexit(stop_control) == 0);
+	print_log(LOG_INFO, "Accepting commands on %s", config_control_socket);
+
+}
+
+void
+control_close(control_client_t* client)
+{
+	close(client->fd);
+	client->fd = -1;
+}
+
+/* Responses are single lines, short enough to never fill the socket buffer */
+void
+control_send(control_client_t* client, const char* response)
+{
+
+	size_t	length = strlen(response);
+	ssize_t	sent;
+
+	while (length > 0)
+	{
+		if ((sent = send(client->fd, response, length, MSG_NOSIGNAL)) <= 0)
+		{
+			if (sent == -1 && errno == EINTR)
+				continue;
+			control_close(client);
+			return;
+		}
+		response += sent;
+		length -= sent;
+	}
+
+	if (send(client->fd, "\n", 1, MSG_NOSIGNAL) != 1)
+		control_close(client);
+
+}
+
+char*
+control_status(void)
+{
+
+	char*	status = malloc(512);
+	int	i;
+
+	assert(status);
+	sprintf(status, "\"locked\":%s,\"mode\":\"%s\",\"wakeups\":{\"count\":%lu,\"mean_ms\":%.3f,\"max_ms\":%.3f},\"decoding_latency\":{",
+		(config_locking && locked) ? "true" : "false", modes[mode],
+		wakeups.count, wakeups.count > 0 ? wakeups.total / wakeups.count : 0, wakeups.max);
+	for (i=0; i<LATENCY_NONE; i++)
+		sprintf(status + strlen(status), "%s\"%s\":{\"count\":%lu,\"mean_ms\":%.1f,\"max_ms\":%.1f}", i > 0 ? "," : "",
+			latency_keys[i],
+			decode_latency[i].count, decode_latency[i].count > 0 ? decode_latency[i].total / decode_latency[i].count : 0, decode_latency[i].max);
+	strcat(status, "}");
+
+	return status;
+
+}
+
+/* Process a hypothesis just like one that was heard and describe what was done with it */
+char*
+control_hypothesis(const char* hyp)
+{
+
+	char*	escaped;
+	char*	status;
+	char*	result;
+	double	start;
+	double	elapsed;
+
+	/* Record what happens to every command */
+	dispatch.recording = 1;
+	dispatch.commands = NULL;
+	dispatch.cached = 0;
+	dispatch.invalid = 0;
+
+	start = get_time_ms();
+	process_hypothesis(hyp);
+	elapsed = get_time_ms() - start;
+
+	dispatch.recording = 0;
+
+	escaped = json_escape(hyp);
+	status = control_status();
+	result = malloc(strlen(escaped) + (dispatch.commands ? strlen(dispatch.commands) : 0) + strlen(status) + 128);
+	assert(result);
+	sprintf(result, "{\"hypothesis\":\"%s\",\"commands\":[%s],\"cached\":%s,\"invalid\":%s,%s,\"time_ms\":%.3f}",
+		escaped, dispatch.commands ? dispatch.commands : "", dispatch.cached ? "true" : "false", dispatch.invalid ? "true" : "false", status, elapsed);
+
+	free(escaped);
+	free(status);
+	free(dispatch.commands);
+	dispatch.commands = NULL;
+
+	return result;
+
+}
+
+/* Handle a single request line */
+void
+control_request(control_client_t* client, char* line)
+{
+
+	char*	argument;
+	char*	hyp;
+	char*	saveptr;
+	char*	results = NULL;
+	char*	result;
+	char*	label;
+	char*	status;
+	char*	response;
+	int	changed = 0;
+	int	i;
+
+	if ((argument = strchr(line, ' ')) != NULL)
+		*argument++ = '\0';
+	else
+		argument = "";
+
+	/* Actions reloaded in the meantime apply to commands from the socket too */
+	update_action_table();
+
+	if (strcmp(line, "hyp") == 0)
+	{
+		/* A batch of hypotheses is separated by semicolons and processed in order */
+		for (hyp = strtok_r(argument, ";", &saveptr); hyp != NULL; hyp = strtok_r(NULL, ";", &saveptr))
+		{
+			/* Hypotheses are formatted the way the decoder outputs them */
+			while (*hyp == ' ')
+				hyp++;
+			for (i=strlen(hyp); i>0 && hyp[i-1] == ' '; i--)
+				hyp[i-1] = '\0';
+			print_log(LOG_INFO, "Received: \"%s\"", hyp);
+			result = control_hypothesis(hyp);
+			append_param(&results, result);
+			free(result);
+		}
+		response = malloc((results ? strlen(results) : 0) + strlen("{\"results\":[]}") + 1);
+		assert(response);
+		sprintf(response, "{\"results\":[%s]}", results ? results : "");
+		control_send(client, response);
+		free(response);
+		free(results);
+		return;
+	}
+
+	if (strcmp(line, "lock") == 0 || strcmp(line, "unlock") == 0)
+	{
+		if (!config_locking)
+		{
+			control_send(client, "{\"error\":\"locking is disabled\"}");
+			return;
+		}
+		locked = (line[0] == 'l');
+		print_log(LOG_INFO, "kodivc is now %s", locked ? "locked" : "unlocked");
+		if (locked)
+			send_gui_notification("Voice recognition disabled", "Not listening for commands", "warning");
+		else
+			send_gui_notification("Voice recognition enabled", mode == MODE_NORMAL ? "Current mode: normal" : "Current mode: spelling", "warning");
+	}
+	else if (strcmp(line, "mode") == 0)
+	{
+		if (strcmp(argument, modes[MODE_SPELLING]) == 0 && mode != MODE_SPELLING)
+		{
+			if (kodi_version < KODI_VERSION_FRODO)
+			{
+				control_send(client, "{\"error\":\"spelling mode not available before Frodo\"}");
+				return;
+			}
+			spelling_clear();
+			spelling_case = 0;
+			mode = MODE_SPELLING;
+			changed = 1;
+		}
+		else if (strcmp(argument, modes[MODE_NORMAL]) == 0 && mode != MODE_NORMAL)
+		{
+			spelling_flush(1);
+			mode = MODE_NORMAL;
+			changed = 1;
+		}
+		else if (strcmp(argument, modes[mode]) != 0)
+		{
+			control_send(client, "{\"error\":\"unknown mode\"}");
+			return;
+		}
+		if (changed)
+		{
+			print_log(LOG_INFO, "Changed to %s mode", modes[mode]);
+			send_gui_notification("Voice recognition mode changed", mode == MODE_NORMAL ? "Current mode: normal" : "Current mode: spelling", "warning");
+		}
+	}
+	else if (strcmp(line, "play") == 0)
+	{
+		if (!config_media_port)
+		{
+			control_send(client, "{\"error\":\"media library index is disabled\"}");
+			return;
+		}
+		if ((label = play_title(argument)) == NULL)
+		{
+			control_send(client, "{\"error\":\"no matching title\"}");
+			return;
+		}
+		result = json_escape(label);
+		response = malloc(strlen(result) + strlen("{\"playing\":\"\"}") + 1);
+		assert(response);
+		sprintf(response, "{\"playing\":\"%s\"}", result);
+		control_send(client, response);
+		free(response);
+		free(result);
+		free(label);
+		return;
+	}
+	else if (strcmp(line, "status") != 0)
+	{
+		control_send(client, "{\"error\":\"unknown request\"}");
+		return;
+	}
+
+	/* Every other request responds with the resulting state */
+	status = control_status();
+	response = malloc(strlen(status) + 3);
+	assert(response);
+	sprintf(response, "{%s}", status);
+	control_send(client, response);
+	free(response);
+	free(status);
+
+}
+
+void
+control_read(control_client_t* client)
+{
+
+	ssize_t	k;
+	char*	line;
+	char*	end;
+
+	if ((k = recv(client->fd, client->buffer + client->length, CONTROL_LINE_SIZE - client->length, 0)) <= 0)
+	{
+		if (k == 0 || (errno != EINTR && errno != EAGAIN))
+			control_close(client);
+		return;
+	}
+	client->length += k;
+
+	/* Handle all complete lines received so far */
+	line = client->buffer;
+	while (client->fd != -1 && (end = memchr(line, '\n', client->length - (line - client->buffer))) != NULL)
+	{
+		*end = '\0';
+		if (end > line && end[-1] == '\r')
+			end[-1] = '\0';
+		control_request(client, line);
+		line = end + 1;
+	}
+	if (client->fd == -1)
+		return;
+
+	client->length -= line - client->buffer;
+	memmove(client->buffer, line, client->length);
+
+	if (client->length == CONTROL_LINE_SIZE)
+	{
+		control_send(client, "{\"error\":\"request too long\"}");
+		control_close(client);
+	}
+
+}
+
+/*
+ * Wait up to timeout milliseconds for requests from control clients and
+ * handle them. Signals only cut the wait short - not all of them ask to
+ * exit, so callers check exit_flag themselves.
+ */
+void
+serve_control(const int timeout)
+{
+
+	struct pollfd	fds[CONTROL_CLIENTS + 2];
+	int		nfds = 0;
+	int		fd;
+	int		i;
+
+	/* Decoded hypotheses end the wait */
+	fds[nfds].fd = pool.notify[0];
+	fds[nfds++].events = POLLIN;
+
+	if (control_socket != -1)
+	{
+		fds[nfds].fd = control_socket;
+		fds[nfds++].events = POLLIN;
+		for (i=0; i<CONTROL_CLIENTS; i++)
+		{
+			fds[nfds].fd = control_clients[i].fd;
+			fds[nfds++].events = POLLIN;
+		}
+	}
+
+	if (poll(fds, nfds, timeout) == -1 || control_socket == -1)
+		return;
+
+	for (i=0; i<CONTROL_CLIENTS; i++)
+	{
+		if (fds[i+2].revents && control_clients[i].fd != -1)
+			control_read(&control_clients[i]);
+	}
+
+	if (fds[1].revents & POLLIN)
+	{
+		while ((fd = accept(control_socket, NULL, NULL)) != -1)
+		{
+			for (i=0; i<CONTROL_CLIENTS && control_clients[i].fd != -1; i++);
+			if (i == CONTROL_CLIENTS)
+			{
+				print_log(LOG_WARNING, "Too many control clients, refusing connection");
+				close(fd);
+				continue;
+			}
+			control_clients[i].fd = fd;
+			control_clients[i].length = 0;
+		}
+	}
+
+}
+
+/* Posterior probability of the last hypothesis */
+double
+get_confidence(ps_decoder_t* ps)
+{
+	return logmath_exp(ps_get_logmath(ps), ps_get_prob(ps, NULL));
+}
+
+/* Log alternative hypotheses, for tuning confidence thresholds */
+void
+log_nbest(ps_decoder_t* ps)
+{
+
+	ps_nbest_t*	nbest;
+	const char*	hyp;
+	int32		score;
+	int		n;
+
+	nbest = ps_nbest(ps, 0, -1, NULL, NULL);
+	for (n=0; nbest && n<NBEST_SIZE; n++)
+	{
+		hyp = ps_nbest_hyp(nbest, &score);
+		print_log(LOG_DEBUG, "N-best %d: \"%s\" (score %d)", n + 1, hyp ? hyp : "", score);
+		nbest = ps_nbest_next(nbest);
+	}
+	/* ps_nbest_next() frees the iterator once it is exhausted */
+	if (nbest)
+		ps_nbest_free(nbest);
+
+}
+
+/* Decide whether a hypothesis is confident enough to act on */
+int
+check_confidence(const char* hyp, const double confidence)
+{
+
+	if (confidence < config_min_confidence[mode])
+	{
+		hypotheses_rejected[mode]++;
+		print_log(LOG_INFO, "Ignoring \"%s\" heard with confidence %.2f (below %.2f)", hyp, confidence, config_min_confidence[mode]);
+		return 0;
+	}
+
+	hypotheses_accepted[mode]++;
+	return 1;
+
+}
+
+void
+report_confidence_statistics(void)
+{
+	int i;
+	for (i=0; i<MODE_NONE; i++)
+	{
+		if (hypotheses_accepted[i] + hypotheses_rejected[i] > 0)
+			print_log(LOG_INFO, "Confidence gating in %s mode: %lu accepted, %lu rejected", modes[i], hypotheses_accepted[i], hypotheses_rejected[i]);
+	}
+}
+
+/* Record how late a sleep of the listening loop woke up */
+void
+record_wakeup(const double requested, const double elapsed)
+{
+
+	double	late = elapsed - requested;
+	int	i;
+
+	/* Woken up early by an event, which says nothing about scheduling */
+	if (late < 0)
+		return;
+
+	for (i=0; i<LATENCY_BUCKETS-1 && late >= latency_bounds[i]; i++);
+	wakeups.buckets[i]++;
+	wakeups.count++;
+	wakeups.total += late;
+	if (late > wakeups.max)
+		wakeups.max = late;
+
+}
+
+/* Upper bound of the bucket containing the given share of wakeups */
+double
+wakeup_percentile(const double share)
+{
+
+	unsigned long	seen = 0;
+	int		i;
+
+	for (i=0; i<LATENCY_BUCKETS-1; i++)
+	{
+		seen += wakeups.buckets[i];
+		if (seen >= share * wakeups.count)
+			break;
+	}
+
+	return (i < LATENCY_BUCKETS-1 && latency_bounds[i] < wakeups.max ? latency_bounds[i] : wakeups.max);
+
+}
+
+void
+report_wakeup_statistics(void)
+{
+	if (wakeups.count > 0)
+		print_log(LOG_INFO, "Wakeup latency: %lu wakeups, %.3f ms mean, 99%% within %.1f ms, %.3f ms max", wakeups.count, wakeups.total / wakeups.count, wakeup_percentile(0.99), wakeups.max);
+}
+
+void
+record_decoding_latency(const decoder_job_t* job)
+{
+
+	decode_latency_t*	latency = &decode_latency[job->latency_class];
+	double			elapsed = job->decoded - job->finished;
+
+	latency->count++;
+	latency->total += elapsed;
+	if (elapsed > latency->max)
+		latency->max = elapsed;
+
+}
+
+/* Time from the end of speech to the hypothesis, with cold decoders kept apart so that warm-up can be judged */
+void
+report_decoding_latency(void)
+{
+
+	int i;
+
+	for (i=0; i<LATENCY_NONE; i++)
+	{
+		if (decode_latency[i].count > 0)
+			print_log(LOG_INFO, "Decoding latency, %s: %lu utterances, %.1f ms mean, %.1f ms max", latency_classes[i], decode_latency[i].count, decode_latency[i].total / decode_latency[i].count, decode_latency[i].max);
+	}
+
+}
+
+/* Keep everything allocated so far, decoder models included, from being paged out */
+void
+lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT) == -1)
+		print_log(LOG_WARNING, "Unable to lock memory, listening may stall on page faults: %s", strerror(errno));
+}
+
+/*
+ * Audio is captured by the listening thread, which gets a real-time
+ * priority so that it is read on time even while the box is busy. Decoders
+ * keep the default policy but run on the same cores, while requests to
+ * Kodi are sent from the lanes, which can be kept off them. Lacking
+ * privileges is not fatal, kodivc just keeps running at the default
+ * priority.
+ */
+void
+apply_scheduling_profile(void)
+{
+
+	struct sched_param	param;
+	lane_t*			lanes[] = { &action_lane, &notification_lane };
+	int			result;
+	int			i;
+
+	if (config_listening_cpus)
+	{
+		if ((result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), config_listening_cpus)) != 0)
+			print_log(LOG_WARNING, "Unable to pin listening thread to chosen CPUs: %s", strerror(result));
+		for (i=0; i<pool.size; i++)
+		{
+			if ((result = pthread_setaffinity_np(pool.workers[i].thread, sizeof(cpu_set_t), config_listening_cpus)) != 0)
+				print_log(LOG_WARNING, "Unable to pin decoder to chosen CPUs: %s", strerror(result));
+		}
+	}
+
+	if (config_dispatch_cpus)
+	{
+		for (i=0; i<ARRAY_SIZE(lanes); i++)
+		{
+			if ((result = pthread_setaffinity_np(lanes[i]->worker, sizeof(cpu_set_t), config_dispatch_cpus)) != 0)
+				print_log(LOG_WARNING, "Unable to pin request worker to chosen CPUs: %s", strerror(result));
+		}
+	}
+
+	param.sched_priority = config_rt_priority;
+	if ((result = pthread_setschedparam(pthread_self(), SCHED_RR, &param)) != 0)
+		print_log(LOG_WARNING, "Unable to switch listening thread to real-time priority %d: %s", config_rt_priority, strerror(result));
+	else
+		print_log(LOG_INFO, "Listening at real-time priority %d", config_rt_priority);
+
+	/* Decoder models and audio buffers are all allocated by now */
+	lock_memory();
+
+}
+
+/* Decoder and dispatch timings are only reported by builds made with "make timings" */
+void
+report_timings(const double* times, const double dispatch)
+{
+#ifdef TIMINGS
+
+	/* Speech, CPU and wall time of decoding an utterance */
+	if (times)
+		print_log(LOG_INFO, "Timings: decoded %.2f s of speech in %.3f s CPU (%.3f xRT), %.3f s wall", times[0], times[1], times[0] > 0 ? times[1] / times[0] : 0, times[2]);
+	print_log(LOG_INFO, "Timings: dispatched in %.3f ms", dispatch);
+
+#endif
+}
+
+void
+report_total_timings(void)
+{
+#ifdef TIMINGS
+
+	double speech = 0;
+	double cpu = 0;
+	double wall = 0;
+	double times[3];
+	int i;
+
+	for (i=0; i<pool.size; i++)
+	{
+		ps_get_all_time(pool.workers[i].ps, &times[0], &times[1], &times[2]);
+		speech += times[0];
+		cpu += times[1];
+		wall += times[2];
+	}
+	print_log(LOG_INFO, "Timings: decoded %.2f s of speech in %.3f s CPU (%.3f xRT), %.3f s wall in total", speech, cpu, speech > 0 ? cpu / speech : 0, wall);
+
+#endif
+}
+
+void
+load_state(void)
+{
+
+	FILE*	file;
+	char	line[1024];
+	char	key[32];
+	char*	value;
+	char*	end;
+	int	has_noise_level = 0;
+	int	has_thresh_sil = 0;
+	int	has_thresh_speech = 0;
+
+	if ((file = fopen(config_statefile, "r")) == NULL)
+		return;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		if (sscanf(line, "%31s", key) != 1)
+			continue;
+		value = line + strlen(key);
+		if (strcmp(key, "noise_level") == 0)
+			has_noise_level = (sscanf(value, "%d", &state.noise_level) == 1);
+		else if (strcmp(key, "thresh_sil") == 0)
+			has_thresh_sil = (sscanf(value, "%d", &state.thresh_sil) == 1);
+		else if (strcmp(key, "thresh_speech") == 0)
+			has_thresh_speech = (sscanf(value, "%d", &state.thresh_speech) == 1);
+		else if (strcmp(key, "sample_rate") == 0)
+			sscanf(value, "%d", &state.sample_rate);
+		else if (strcmp(key, "cmn") == 0)
+		{
+			/* Cepstral mean vector is a list of space-separated values */
+			state.cmn_size = 0;
+			for (;;)
+			{
+				state.cmn = realloc(state.cmn, (state.cmn_size + 1) * sizeof(mfcc_t));
+				assert(state.cmn);
+				state.cmn[state.cmn_size] = (mfcc_t) strtod(value, &end);
+				if (end == value)
+					break;
+				state.cmn_size++;
+				value = end;
+			}
+		}
+	}
+
+	fclose(file);
+
+	/* Files without a sample rate were written before 8 kHz processing was possible */
+	if (state.sample_rate == 0)
+		state.sample_rate = SAMPLE_RATE;
+
+	/* Energy levels and cepstra computed at another sample rate do not apply */
+	if (state.sample_rate != config_sample_rate)
+	{
+		print_log(LOG_INFO, "Ignoring listening state saved at %d Hz", state.sample_rate);
+		state.cmn_size = 0;
+		return;
+	}
+
+	/* Only trust calibration values if the file holds every one of them - a repeated key does not make up for a missing one */
+	state.calibrated = (has_noise_level && has_thresh_sil && has_thresh_speech);
+	print_log(LOG_INFO, "Loaded listening state from %s", config_statefile);
+
+}
+
+void
+save_state(cont_ad_t* cont, ps_decoder_t* ps)
+{
+
+	FILE*	file;
+	char*	tmp;
+	feat_t*	feat;
+	int	i;
+
+	/* Snapshot cepstral mean from the decoder */
+	feat = ps_get_feat(ps);
+	if (feat && feat->cmn_struct)
+	{
+		state.cmn_size = feat->cmn_struct->veclen;
+		state.cmn = realloc(state.cmn, state.cmn_size * sizeof(mfcc_t));
+		assert(state.cmn);
+		cmn_prior_get(feat->cmn_struct, state.cmn);
+	}
+
+	/* Write to a temporary file first so that a crash never leaves a truncated state file */
+	tmp = malloc(strlen(config_statefile) + strlen(".tmp") + 1);
+	assert(tmp);
+	sprintf(tmp, "%s.tmp", config_statefile);
+
+	if ((file = fopen(tmp, "w")) == NULL)
+	{
+		print_log(LOG_WARNING, "Failed to save listening state to %s", tmp);
+		free(tmp);
+		return;
+	}
+
+	fprintf(file, "noise_level %d\n", cont->noise_level);
+	fprintf(file, "thresh_sil %d\n", cont->thresh_sil);
+	fprintf(file, "thresh_speech %d\n", cont->thresh_speech);
+	fprintf(file, "sample_rate %d\n", config_sample_rate);
+	if (state.cmn_size > 0)
+	{
+		fprintf(file, "cmn");
+		for (i=0; i<state.cmn_size; i++)
+			fprintf(file, " %g", (double) state.cmn[i]);
+		fprintf(file, "\n");
+	}
+
+	if (fclose(file) != 0 || rename(tmp, config_statefile) != 0)
+		print_log(LOG_WARNING, "Failed to save listening state to %s", config_statefile);
+
+	free(tmp);
+	state.saved_at = get_time_ms();
+
+}
+
+/* Apply persisted cepstral mean to a freshly initialized decoder */
+void
+restore_cmn(ps_decoder_t* ps)
+{
+
+	feat_t* feat = ps_get_feat(ps);
+
+	if (state.cmn_size == 0 || !feat || !feat->cmn_struct)
+		return;
+
+	if (state.cmn_size != feat->cmn_struct->veclen)
+	{
+		print_log(LOG_WARNING, "Ignoring saved cepstral mean with %d coefficients, decoder uses %d", state.cmn_size, feat->cmn_struct->veclen);
+		return;
+	}
+
+	cmn_prior_set(feat->cmn_struct, state.cmn);
+
+}
+
+void
+journal_close(void)
+{
+	if (journal.header)
+		munmap(journal.header, journal.size);
+	journal.header = NULL;
+}
+
+/* Map the journal file, reusing its contents if it was written with the same layout */
+void
+journal_open(void)
+{
+
+	journal_header_t	header;
+	uint32_t		samples = JOURNAL_SECONDS * config_sample_rate;
+	size_t			entry_size;
+	int			fd;
+	int			reuse;
+
+	entry_size = (sizeof(journal_entry_t) + samples * sizeof(int16_t) + 7) & ~7;
+	journal.size = sizeof(journal_header_t) + config_journal_entries * entry_size;
+
+	if ((fd = open(config_journalfile, O_RDWR | O_CREAT, 0600)) == -1)
+		die("Unable to open utterance journal %s: %s", config_journalfile, strerror(errno));
+
+	reuse = (read(fd, &header, sizeof(header)) == sizeof(header)
+		&& memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0
+		&& header.entries == (uint32_t) config_journal_entries
+		&& header.max_samples == samples
+		&& header.sample_rate == (uint32_t) config_sample_rate
+		&& header.entry_size == entry_size);
+
+	/* A file of another layout is started from scratch */
+	if ((!reuse && ftruncate(fd, 0) == -1) || ftruncate(fd, journal.size) == -1)
+		die("Unable to resize utterance journal %s: %s", config_journalfile, strerror(errno));
+
+	journal.header = mmap(NULL, journal.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (journal.header == MAP_FAILED)
+		die("Unable to map utterance journal %s: %s", config_journalfile, strerror(errno));
+
+	if (!reuse)
+	{
+		memcpy(journal.header->magic, JOURNAL_MAGIC, sizeof(journal.header->magic));
+		journal.header->entries = config_journal_entries;
+		journal.header->max_samples = samples;
+		journal.header->sample_rate = config_sample_rate;
+		journal.header->entry_size = entry_size;
+		journal.header->sequence = 0;
+	}
+	journal.next = journal.header->sequence;
+
+	assert(atexit(journal_close) == 0);
+	print_log(LOG_INFO, "Journaling the last %d utterances to %s", config_journal_entries, config_journalfile);
+
+}
+
+/* Start journaling an utterance in the oldest entry - several may be in flight while they are decoded */
+journal_entry_t*
+journal_begin(const mode_t entry_mode)
+{
+
+	journal_entry_t* entry;
+
+	if (!journal.header)
+		return NULL;
+
+	entry = JOURNAL_ENTRY(journal.header, journal.next++ % journal.header->entries);
+
+	/* Readers skip the entry until it is complete */
+	entry->sequence = 0;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->time = time(NULL);
+	entry->samples = 0;
+	entry->truncated = 0;
+	entry->mode = entry_mode;
+	entry->cmn_size = 0;
+
+	return entry;
+
+}
+
+/* Only a copy is made on the capture path */
+void
+journal_append(journal_entry_t* entry, const int16* samples, const int32 count)
+{
+
+	uint32_t room;
+
+	if (!entry)
+		return;
+
+	room = journal.header->max_samples - entry->samples;
+	if ((uint32_t) count > room)
+		entry->truncated = 1;
+	memcpy(entry->data + entry->samples, samples, (count > room ? room : count) * sizeof(int16_t));
+	entry->samples += (count > room ? room : count);
+
+}
+
+/* Entries are committed in the order utterances were heard in, along with the cepstral mean they were decoded with */
+void
+journal_commit(journal_entry_t* entry, const char* hyp, const int32 score, const double confidence, const double decode_time, const mfcc_t* cmn, const int cmn_size)
+{
+
+	int i;
+
+	if (!entry)
+		return;
+
+	snprintf(entry->hypothesis, sizeof(entry->hypothesis), "%s", hyp);
+	entry->score = score;
+	entry->confidence = confidence;
+	entry->decode_time = decode_time;
+	entry->cmn_size = (cmn_size <= JOURNAL_CMN_SIZE ? cmn_size : 0);
+	for (i=0; i<entry->cmn_size; i++)
+		entry->cmn[i] = (float) cmn[i];
+
+	/* Publish the entry */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	entry->sequence = ++journal.header->sequence;
+
+}
+
+/* Remember calibration values as the baseline for drift detection */
+void
+remember_calibration(cont_ad_t* cont)
+{
+	state.noise_level = cont->noise_level;
+	state.thresh_sil = cont->thresh_sil;
+	state.thresh_speech = cont->thresh_speech;
+	state.calibrated = 1;
+}
+
+/* Shift VAD thresholds along with the noise floor if it drifted since calibration */
+void
+track_noise_floor(cont_ad_t* cont)
+{
+
+	int32 drift = cont->noise_level - state.noise_level;
+
+	if (drift > -STATE_NOISE_DRIFT && drift < STATE_NOISE_DRIFT)
+		return;
+
+	/* Keep the margins found during calibration */
+	cont_ad_set_thresh(cont, state.thresh_sil + drift, state.thresh_speech + drift);
+	print_log(LOG_INFO, "Noise floor changed from %d to %d, voice activity detection recalibrated", state.noise_level, cont->noise_level);
+	remember_calibration(cont);
+
+}
+
+/* Windowed-sinc half-band low-pass filter with its cutoff at 4 kHz */
+void
+initialize_decimator(decimator_t* filter)
+{
+
+	const int	length = 2 * DECIMATOR_TAPS - 1;
+	double		h[DECIMATOR_TAPS];
+	double		sum = 0;
+	double		window;
+	int		offset;
+	int		i;
+
+	/* Apart from the center tap of 0.5, only taps at odd offsets from it are non-zero */
+	for (i=0; i<DECIMATOR_TAPS; i++)
+	{
+		offset = 2 * i - (length - 1) / 2;
+		window = 0.42 - 0.5 * cos(2 * M_PI * (2 * i + 1) / (length + 1)) + 0.08 * cos(4 * M_PI * (2 * i + 1) / (length + 1));
+		h[i] = sin(M_PI * offset / 2) / (M_PI * offset) * window;
+		sum += h[i];
+	}
+
+	/* Normalize for unity gain at DC, half of which comes from the center tap */
+	for (i=0; i<DECIMATOR_TAPS; i++)
+	{
+		h[i] *= 0.5 / sum;
+		filter->taps[i] = (v4sf) { h[i], h[i], h[i], h[i] };
+	}
+
+	/* Start with silence in the filter */
+	filter->size = 0;
+	filter->pending = 0;
+	filter->even = calloc(DECIMATOR_TAPS - 1, sizeof(float));
+	filter->odd = calloc(DECIMATOR_ODD_DELAY, sizeof(float));
+	filter->input = NULL;
+	assert(filter->even && filter->odd);
+
+}
+
+void
+free_decimator(decimator_t* filter)
+{
+	free(filter->even);
+	free(filter->odd);
+	free(filter->input);
+}
+
+void
+resize_decimator(decimator_t* filter, const int size)
+{
+
+	if (size <= filter->size)
+		return;
+
+	filter->even = realloc(filter->even, (DECIMATOR_TAPS - 1 + size) * sizeof(float));
+	filter->odd = realloc(filter->odd, (DECIMATOR_ODD_DELAY + size) * sizeof(float));
+	filter->input = realloc(filter->input, 2 * size * sizeof(int16));
+	assert(filter->even && filter->odd && filter->input);
+	filter->size = size;
+
+}
+
+/* Filter count pairs of samples, four output samples at a time */
+void
+decimate(decimator_t* filter, int16* output, const int count)
+{
+
+	float*	even = filter->even + DECIMATOR_TAPS - 1;
+	float*	odd = filter->odd + DECIMATOR_ODD_DELAY;
+	v4sf	acc;
+	v4sf	x;
+	float	y[4];
+	int	n;
+	int	k;
+	int	i;
+
+	for (n=0; n<count; n+=4)
+	{
+		acc = (v4sf) { 0, 0, 0, 0 };
+		/* Loads are unaligned, so go through memcpy() which compiles to a single instruction */
+		for (k=0; k<DECIMATOR_TAPS; k++)
+		{
+			memcpy(&x, even + n - k, sizeof(x));
+			acc += filter->taps[k] * x;
+		}
+		memcpy(&x, odd + n - DECIMATOR_ODD_DELAY, sizeof(x));
+		acc += (v4sf) { 0.5, 0.5, 0.5, 0.5 } * x;
+		memcpy(y, &acc, sizeof(y));
+
+		/* The last group may be partial - samples past count are never used */
+		for (i=0; i<4 && n+i<count; i++)
+			output[n+i] = (int16) lrintf(fmaxf(-32768, fminf(32767, y[i])));
+	}
+
+	/* Keep the tail of the input as history for the next call */
+	memmove(filter->even, filter->even + count, (DECIMATOR_TAPS - 1) * sizeof(float));
+	memmove(filter->odd, filter->odd + count, DECIMATOR_ODD_DELAY * sizeof(float));
+
+}
+
+/* Turn count pairs of 16 kHz samples into count 8 kHz samples - the filter has to be sized for count + 4 */
+void
+decimate_pairs(decimator_t* filter, const int16* input, int16* output, const int count)
+{
+
+	float*	even = filter->even + DECIMATOR_TAPS - 1;
+	float*	odd = filter->odd + DECIMATOR_ODD_DELAY;
+	int	i;
+
+	/* Split samples into phases, padding to a whole vector */
+	for (i=0; i<count; i++)
+	{
+		even[i] = input[2*i];
+		odd[i] = input[2*i+1];
+	}
+	for (; i<(count + 3) / 4 * 4; i++)
+		even[i] = odd[i] = 0;
+
+	decimate(filter, output, count);
+
+}
+
+/* Reads samples from the audio device at 16 kHz and returns them at 8 kHz */
+int32
+ad_read_decimated(ad_rec_t* ad, int16* buf, int32 max)
+{
+
+	int32	k;
+	int	count;
+
+	resize_decimator(&decimator, max + 4);
+
+	/* Complete the pair started by the previous read */
+	if (decimator.pending)
+		decimator.input[0] = decimator.carry;
+
+	if ((k = ad_read(ad, decimator.input + decimator.pending, 2 * max - decimator.pending)) < 0)
+		return k;
+	k += decimator.pending;
+
+	count = k / 2;
+	decimator.pending = k % 2;
+	if (decimator.pending)
+		decimator.carry = decimator.input[k-1];
+
+	decimate_pairs(&decimator, decimator.input, buf, count);
+
+	return count;
+
+}
+
+/* Path to a model file of a mode, to be freed by the caller */
+char*
+get_mode_model(const int model_mode, const char* extension)
+{
+
+	char* path = malloc(strlen(MODEL_MODE_DIR "/.") + strlen(modes[model_mode]) + strlen(extension) + 1);
+
+	assert(path);
+	sprintf(path, MODEL_MODE_DIR "/%s.%s", modes[model_mode], extension);
+
+	return path;
+
+}
+
+void
+load_mode_models(ps_decoder_t* ps, cmd_ln_t* config)
+{
+
+	ngram_model_t*	lmset = ps_get_lmset(ps);
+	ngram_model_t*	lm;
+	char*		path;
+	int		i;
+
+	/* pocketsphinx put the model given with -lm into the set as "default", so it is shared rather than read again */
+	if ((lm = ngram_model_set_lookup(lmset, "default")) == NULL)
+		die("Error finding default language model");
+	if (ngram_model_set_add(lmset, ngram_model_retain(lm), modes[MODE_NORMAL], 1.0, TRUE) == NULL)
+		die("Error adding %s language model", modes[MODE_NORMAL]);
+
+	for (i=0; i<MODE_NONE; i++)
+	{
+		if (i == MODE_NORMAL)
+			continue;
+		path = get_mode_model(i, "lm");
+		lm = ngram_model_read(config, path, NGRAM_AUTO, ps_get_logmath(ps));
+		if (lm == NULL)
+			die("Error loading language model %s", path);
+		free(path);
+		/* Ownership of the model passes to the set */
+		if (ngram_model_set_add(lmset, lm, modes[i], 1.0, TRUE) == NULL)
+			die("Error adding %s language model", modes[i]);
+	}
+
+	/* The dictionary of the initial mode is already loaded */
+	if (ngram_model_set_select(lmset, modes[mode]) == NULL || ps_update_lmset(ps, lmset) == NULL)
+		die("Error selecting %s language model", modes[mode]);
+
+}
+
+/* The dictionary and language model always have to describe the same vocabulary */
+void
+switch_mode_models(ps_decoder_t* ps, const int model_mode)
+{
+
+	ngram_model_t*	lmset = ps_get_lmset(ps);
+	char*		dict = get_mode_model(model_mode, "dic");
+	double		traced = trace_begin();
+
+	if (ps_load_dict(ps, dict, NULL, NULL) < 0)
+		print_log(LOG_WARNING, "Error loading dictionary %s", dict);
+	trace_end(traced, "decoder", "ps_load_dict", "%s", modes[model_mode]);
+	free(dict);
+
+	if (ngram_model_set_select(lmset, modes[model_mode]) == NULL || ps_update_lmset(ps, lmset) == NULL)
+		print_log(LOG_WARNING, "Error switching to %s language model", modes[model_mode]);
+
+}
+
+/* Add an option for pocketsphinx, replacing the value given before - a strict parse rejects options given twice */
+void
+set_decoder_argument(char** argv, int* argc, const char* name, const char* value)
+{
+
+	int i;
+
+	for (i=0; i<*argc && strcmp(argv[i], name) != 0; i+=2);
+	argv[i] = (char*) name;
+	argv[i+1] = (char*) value;
+	if (i == *argc)
+		*argc += 2;
+
+}
+
+/* Built-in options, then options of the chosen profile, then the overrides, each option only once */
+char**
+get_decoder_arguments(const char** builtin, int* argc)
+{
+
+	const char*	none[] = { NULL };
+	const char**	profile = (config_profile ? config_profile->options : none);
+	char**		argv;
+	int		i;
+	int		j;
+
+	for (i=0; builtin[i]; i++);
+	for (j=0; profile[j]; j++);
+	argv = malloc((i + j + 2 * config_decoder_options_count + 1) * sizeof(char*));
+	assert(argv);
+	*argc = 0;
+
+	for (i=0; builtin[i]; i+=2)
+		set_decoder_argument(argv, argc, builtin[i], builtin[i+1]);
+	for (i=0; profile[i]; i+=2)
+		set_decoder_argument(argv, argc, profile[i], profile[i+1]);
+	for (i=0; i<config_decoder_options_count; i++)
+		set_decoder_argument(argv, argc, config_decoder_options[2*i], config_decoder_options[2*i+1]);
+	argv[*argc] = NULL;
+
+	return argv;
+
+}
+
+/* Initialize pocketsphinx for the current mode - 8 kHz frames need only half as many FFT points */
+ps_decoder_t*
+init_decoder(void)
+{
+
+	cmd_ln_t*	config;
+	ps_decoder_t*	ps;
+	char		samprate[16];
+	char*		dict = get_mode_model(mode, "dic");
+	const char*	builtin[] = {
+		"-hmm", MODEL_HMM,
+		"-lm", MODEL_LM,
+		"-dict", dict,
+		"-samprate", samprate,
+		"-nfft", config_sample_rate == SAMPLE_RATE ? "512" : "256",
+		"-mmap", "yes",
+		NULL
+	};
+	char**		argv;
+	int		argc;
+
+	/* Everything is parsed at once, rejecting options pocketsphinx does not know */
+	sprintf(samprate, "%d", config_sample_rate);
+	argv = get_decoder_arguments(builtin, &argc);
+	config = cmd_ln_parse_r(NULL, ps_args(), argc, argv, TRUE);
+	free(argv);
+	free(dict);
+	if (config == NULL)
+		die("Invalid decoder options, check -T and -O");
+
+	ps = ps_init(config);
+	if (ps == NULL)
+		die("Error initializing pocketsphinx");
+
+	/* Keep language models of all modes loaded, so that changing modes is cheap */
+	load_mode_models(ps, config);
+
+	return ps;
+
+}
+
+void
+map_model(const char* path)
+{
+
+	struct stat	st;
+	void*		data;
+	int		fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return;
+
+	model_mappings = realloc(model_mappings, (model_mappings_count + 1) * sizeof(model_mapping_t));
+	assert(model_mappings);
+	model_mappings[model_mappings_count].data = data;
+	model_mappings[model_mappings_count].size = st.st_size;
+	model_mappings[model_mappings_count].locked = (mlock(data, st.st_size) == 0);
+	model_mappings_count++;
+
+}
+
+/*
+ * With -mmap yes, decoders map the model definition and the senone dump of
+ * the acoustic model instead of reading them, so they share page cache with
+ * these mappings and the pages they read are resident too - and stay so if
+ * they can be locked. Everything else, language models and dictionaries of
+ * all modes included, is parsed into the heap of every decoder once and is
+ * locked with it by lock_memory().
+ */
+void
+map_models(void)
+{
+
+	const char*	files[] = { "mdef", "sendump" };
+	char		path[PATH_MAX];
+	size_t		size = 0;
+	int		locked = 0;
+	int		i;
+
+	for (i=0; i<ARRAY_SIZE(files); i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", MODEL_HMM, files[i]);
+		map_model(path);
+	}
+
+	for (i=0; i<model_mappings_count; i++)
+	{
+		size += model_mappings[i].size;
+		locked += model_mappings[i].locked;
+	}
+	print_log(LOG_INFO, "Loaded %d model files (%.1f MB) into memory, %d of them locked", model_mappings_count, size / 1048576.0, locked);
+
+}
+
+/* Bring back pages of unlocked models which were evicted in the meantime */
+void
+touch_models(void)
+{
+
+	long		page = sysconf(_SC_PAGESIZE);
+	volatile char	byte;
+	size_t		offset;
+	int		i;
+
+	for (i=0; i<model_mappings_count; i++)
+	{
+		if (model_mappings[i].locked)
+			continue;
+		for (offset=0; offset<model_mappings[i].size; offset+=page)
+			byte = ((const char*) model_mappings[i].data)[offset];
+	}
+	(void) byte;
+
+}
+
+void
+unmap_models(void)
+{
+
+	int i;
+
+	for (i=0; i<model_mappings_count; i++)
+		munmap(model_mappings[i].data, model_mappings[i].size);
+	free(model_mappings);
+	model_mappings = NULL;
+	model_mappings_count = 0;
+
+}
+
+/* Feed a recorded utterance in blocks, the way it arrives while listening, so that the live cepstral mean is used too */
+int
+process_utterance(ps_decoder_t* ps, const int16* samples, const int count)
+{
+
+	int i;
+
+	for (i=0; i<count; i+=AUDIO_BLOCK_SIZE)
+		if (ps_process_raw(ps, samples + i, count - i < AUDIO_BLOCK_SIZE ? count - i : AUDIO_BLOCK_SIZE, FALSE, FALSE) < 0)
+			return -1;
+
+	return 0;
+
+}
+
+/* Decode a moment of synthetic audio, so that the next utterance finds models and search structures warm */
+void
+warm_decoder(decoder_worker_t* worker)
+{
+
+	feat_t*		feat = ps_get_feat(worker->ps);
+	mfcc_t		cmn[JOURNAL_CMN_SIZE];
+	int		cmn_size = 0;
+	int		count = config_sample_rate / 1000 * WARMUP_DURATION;
+	int16*		samples = malloc(count * sizeof(int16));
+	unsigned int	seed = 1;
+	int32		score;
+	double		started = get_time_ms();
+	double		traced = trace_begin();
+	int		i;
+
+	assert(samples);
+	touch_models();
+
+	/* Quiet noise, decoded with the cepstral mean of real speech left as it was */
+	for (i=0; i<count; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		samples[i] = (int16) ((seed >> 16) % 64) - 32;
+	}
+	if (feat && feat->cmn_struct && feat->cmn_struct->veclen <= JOURNAL_CMN_SIZE)
+	{
+		cmn_prior_get(feat->cmn_struct, cmn);
+		cmn_size = feat->cmn_struct->veclen;
+	}
+
+	if (ps_start_utt(worker->ps, NULL) >= 0)
+	{
+		ps_process_raw(worker->ps, samples, count, FALSE, FALSE);
+		ps_end_utt(worker->ps);
+		ps_get_hyp(worker->ps, &score, NULL);
+	}
+
+	if (cmn_size > 0)
+		cmn_prior_set(feat->cmn_struct, cmn);
+	free(samples);
+
+	trace_end(traced, "decoder", "warm-up", NULL);
+	print_log(LOG_DEBUG, "Decoder %d warmed up in %.1f ms", (int) (worker - pool.workers), get_time_ms() - started);
+
+}
+
+/* Decode utterances assigned to a decoder as their samples arrive */
+void*
+decoder_worker(void* arg)
+{
+
+	decoder_worker_t*	worker = arg;
+	decoder_job_t*		job;
+	feat_t*			feat = ps_get_feat(worker->ps);
+	int16*			buffer = NULL;
+	int			buffer_size = 0;
+	int			processed;
+	int			count;
+	int			in_utterance;
+	int			failed;
+	int			restart;
+	mode_t			job_mode;
+	const char*		hyp;
+	double			traced;
+	char			name[16];
+	struct timespec		deadline;
+
+	snprintf(name, sizeof(name), "decoder %d", (int) (worker - pool.workers));
+	trace_thread(name);
+
+	if (config_warmup_interval >= 0)
+		warm_decoder(worker);
+
+	pthread_mutex_lock(&pool.lock);
+
+	for (;;)
+	{
+
+		/* Keep warm while idle, unless an utterance arrives in the meantime */
+		while (!pool.stopping && !worker->head)
+		{
+			if (config_warmup_interval <= 0)
+			{
+				pthread_cond_wait(&worker->wakeup, &pool.lock);
+				continue;
+			}
+			get_deadline(&deadline, config_warmup_interval * 1000L);
+			if (pthread_cond_timedwait(&worker->wakeup, &pool.lock, &deadline) == ETIMEDOUT && !pool.stopping && !worker->head)
+			{
+				pthread_mutex_unlock(&pool.lock);
+				warm_decoder(worker);
+				pthread_mutex_lock(&pool.lock);
+			}
+		}
+		if (pool.stopping)
+			break;
+		job = worker->head;
+		job_mode = job->mode;
+		job->restart = 0;
+		pthread_mutex_unlock(&pool.lock);
+
+		/* Vocabulary follows the mode the utterance was heard in */
+		if (job_mode != worker->mode)
+		{
+			worker->mode = job_mode;
+			switch_mode_models(worker->ps, worker->mode);
+		}
+
+		/* Decoding again starts from the cepstral mean of the first attempt */
+		if (job->cmn_size > 0)
+		{
+			cmn_prior_set(feat->cmn_struct, job->cmn);
+		}
+		else if (feat && feat->cmn_struct && feat->cmn_struct->veclen <= JOURNAL_CMN_SIZE)
+		{
+			cmn_prior_get(feat->cmn_struct, job->cmn);
+			job->cmn_size = feat->cmn_struct->veclen;
+		}
+
+		in_utterance = (ps_start_utt(worker->ps, NULL) >= 0);
+		failed = !in_utterance;
+		processed = 0;
+
+		/* Samples are copied out, as capture may grow the buffer while they are being processed */
+		pthread_mutex_lock(&pool.lock);
+		for (;;)
+		{
+			while (!pool.stopping && !job->restart && processed == job->count && !job->complete)
+				pthread_cond_wait(&worker->wakeup, &pool.lock);
+			if (pool.stopping || job->restart || processed == job->count)
+				break;
+			count = job->count - processed;
+			if (count > buffer_size)
+			{
+				buffer_size = count;
+				buffer = realloc(buffer, buffer_size * sizeof(int16));
+				assert(buffer);
+			}
+			memcpy(buffer, job->samples + processed, count * sizeof(int16));
+			processed += count;
+			pthread_mutex_unlock(&pool.lock);
+			traced = trace_begin();
+			if (!failed && ps_process_raw(worker->ps, buffer, count, FALSE, FALSE) < 0)
+				failed = 1;
+			trace_end(traced, "decoder", "ps_process_raw", "%d samples", count);
+			pthread_mutex_lock(&pool.lock);
+		}
+		if (pool.stopping)
+			break;
+		restart = job->restart;
+		pthread_mutex_unlock(&pool.lock);
+
+		traced = trace_begin();
+		if (in_utterance)
+			ps_end_utt(worker->ps);
+		trace_end(traced, "decoder", "ps_end_utt", NULL);
+
+		/* The job stays at the head of the queue, to be decoded again in its new mode */
+		if (restart)
+		{
+			trace_instant("decoder", "restart", "%s mode", modes[job->mode]);
+			pthread_mutex_lock(&pool.lock);
+			continue;
+		}
+		hyp = (failed ? NULL : ps_get_hyp(worker->ps, &job->score, NULL));
+		if (failed)
+			print_log(LOG_WARNING, "Failed to decode utterance");
+		job->hyp = strdup(hyp ? hyp : "");
+		assert(job->hyp);
+		/* Posterior probability is only worth computing if it is going to be used */
+		job->confidence = (!failed && config_min_confidence[job_mode] > 0 ? get_confidence(worker->ps) : 1);
+		if (!failed && config_loglevel >= LOG_DEBUG)
+			log_nbest(worker->ps);
+		if (!failed)
+			ps_get_utt_time(worker->ps, &job->times[0], &job->times[1], &job->times[2]);
+
+		/* Utterances decoded cold are told apart from the rest */
+		job->decoded = get_time_ms();
+		if (worker->decoded++ == 0)
+			job->latency_class = LATENCY_FIRST;
+		else if (job->started - worker->last_decoded > DECODER_IDLE_TIME)
+			job->latency_class = LATENCY_IDLE;
+		else
+			job->latency_class = LATENCY_STEADY;
+		worker->last_decoded = job->decoded;
+
+		pthread_mutex_lock(&pool.lock);
+		/* Mode may also change after the last samples were processed */
+		if (job->restart)
+		{
+			free(job->hyp);
+			job->hyp = NULL;
+			continue;
+		}
+		worker->head = job->worker_next;
+		if (!worker->head)
+			worker->tail = NULL;
+		job->done = 1;
+		/* The pipe never fills up, as the listening loop drains it */
+		if (write(pool.notify[1], "", 1) == -1 && errno != EAGAIN)
+			print_log(LOG_WARNING, "Unable to signal decoded utterance");
+
+	}
+
+	pthread_mutex_unlock(&pool.lock);
+	free(buffer);
+
+	return NULL;
+
+}
+
+/* Every decoder loads its own models - acoustic model files are memory-mapped, so their pages are shared */
+void
+start_decoders(void)
+{
+
+	int i;
+
+	pool.workers = calloc(config_decoders, sizeof(decoder_worker_t));
+	assert(pool.workers);
+	pool.size = config_decoders;
+
+	if (pipe(pool.notify) == -1 || fcntl(pool.notify[0], F_SETFL, O_NONBLOCK) == -1 || fcntl(pool.notify[1], F_SETFL, O_NONBLOCK) == -1)
+		die("Unable to create decoder notification pipe: %s", strerror(errno));
+
+	if (config_warmup_interval >= 0)
+		map_models();
+
+	for (i=0; i<pool.size; i++)
+	{
+		pool.workers[i].ps = init_decoder();
+		pool.workers[i].mode = mode;
+		restore_cmn(pool.workers[i].ps);
+		pthread_cond_init(&pool.workers[i].wakeup, NULL);
+		if (pthread_create(&pool.workers[i].thread, NULL, decoder_worker, &pool.workers[i]) != 0)
+			die("Failed to start decoder");
+		pool.workers[i].started = 1;
+	}
+
+	/* Warming up is no use if the models are paged out again while decoders are idle */
+	if (config_warmup_interval >= 0)
+		lock_memory();
+
+	if (pool.size > 1)
+		print_log(LOG_INFO, "Decoding with %d decoders", pool.size);
+
+}
+
+void
+free_job(decoder_job_t* job)
+{
+	free(job->samples);
+	free(job->hyp);
+	free(job);
+}
+
+/* Utterances being decoded are abandoned */
+void
+stop_decoders(void)
+{
+
+	decoder_job_t*	job;
+	int		i;
+
+	pthread_mutex_lock(&pool.lock);
+	pool.stopping = 1;
+	for (i=0; i<pool.size; i++)
+		pthread_cond_signal(&pool.workers[i].wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+	for (i=0; i<pool.size; i++)
+	{
+		if (pool.workers[i].started)
+			pthread_join(pool.workers[i].thread, NULL);
+		pool.workers[i].started = 0;
+	}
+
+	while ((job = pool.head) != NULL)
+	{
+		pool.head = job->next;
+		free_job(job);
+	}
+	pool.tail = NULL;
+
+}
+
+void
+free_decoders(void)
+{
+
+	int i;
+
+	for (i=0; i<pool.size; i++)
+	{
+		ps_free(pool.workers[i].ps);
+		pthread_cond_destroy(&pool.workers[i].wakeup);
+	}
+	free(pool.workers);
+	pool.workers = NULL;
+	pool.size = 0;
+	unmap_models();
+	close(pool.notify[0]);
+	close(pool.notify[1]);
+
+}
+
+/* Hand a new utterance to the next decoder */
+decoder_job_t*
+begin_job(const mode_t job_mode)
+{
+
+	decoder_job_t* job = calloc(1, sizeof(decoder_job_t));
+
+	assert(job);
+	job->mode = job_mode;
+	job->started = get_time_ms();
+	job->entry = journal_begin(job_mode);
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.tail)
+		pool.tail->next = job;
+	else
+		pool.head = job;
+	pool.tail = job;
+	job->worker = &pool.workers[pool.next];
+	pool.next = (pool.next + 1) % pool.size;
+	if (job->worker->tail)
+		job->worker->tail->worker_next = job;
+	else
+		job->worker->head = job;
+	job->worker->tail = job;
+	pthread_cond_signal(&job->worker->wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+	return job;
+
+}
+
+void
+append_job(decoder_job_t* job, const int16* samples, const int32 count)
+{
+
+	journal_append(job->entry, samples, count);
+
+	pthread_mutex_lock(&pool.lock);
+	if (job->count + count > job->size)
+	{
+		job->size = (job->count + count) * 2;
+		job->samples = realloc(job->samples, job->size * sizeof(int16));
+		assert(job->samples);
+	}
+	memcpy(job->samples + job->count, samples, count * sizeof(int16));
+	job->count += count;
+	pthread_cond_signal(&job->worker->wakeup);
+	pthread_mutex_unlock(&pool.lock);
+
+}
+
+void
+finish_job(decoder_job_t* job)
+{
+	pthread_mutex_lock(&pool.lock);
+	job->complete = 1;
+	job->finished = get_time_ms();
+	pthread_cond_signal(&job->worker->wakeup);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+/* Oldest utterance, if it has been decoded - later ones wait for it, so that commands are executed in order */
+decoder_job_t*
+next_decoded_job(void)
+{
+
+	decoder_job_t* job = NULL;
+
+	pthread_mutex_lock(&pool.lock);
+	if (pool.head && pool.head->done)
+	{
+		job = pool.head;
+		pool.head = job->next;
+		if (!pool.head)
+			pool.tail = NULL;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	return job;
+
+}
+
+int
+decoders_idle(void)
+{
+
+	int idle;
+
+	pthread_mutex_lock(&pool.lock);
+	idle = (pool.head == NULL);
+	pthread_mutex_unlock(&pool.lock);
+
+	return idle;
+
+}
+
+/*
+ * Utterances are decoded while earlier ones wait to be acted on, in the mode
+ * of the time they were heard. If acting on one changes the mode, utterances
+ * after it (of the same capture client) are decoded again in the new mode.
+ */
+void
+redecode_jobs(const session_t* session, const mode_t new_mode)
+{
+
+	decoder_job_t*	job;
+	int		count = 0;
+
+	pthread_mutex_lock(&pool.lock);
+	for (job = pool.head; job; job = job->next)
+	{
+		if (job->session != session || job->mode == new_mode)
+			continue;
+		job->mode = new_mode;
+		if (job->entry)
+			job->entry->mode = new_mode;
+		/* Decoded already - queue it again, otherwise make its decoder start over */
+		if (job->done)
+		{
+			job->done = 0;
+			free(job->hyp);
+			job->hyp = NULL;
+			job->worker_next = NULL;
+			if (job->worker->tail)
+				job->worker->tail->worker_next = job;
+			else
+				job->worker->head = job;
+			job->worker->tail = job;
+		}
+		else
+		{
+			job->restart = 1;
+		}
+		pthread_cond_signal(&job->worker->wakeup);
+		count++;
+	}
+	pthread_mutex_unlock(&pool.lock);
+
+	if (count > 0)
+		print_log(LOG_DEBUG, "Decoding %d utterance%s again in %s mode", count, count == 1 ? "" : "s", modes[new_mode]);
+
+}
+
+/* Send a whole message, giving up if the peer does not take it in time */
+int
+send_message(const int fd, const char type, const void* payload, const int size)
+{
 
-	if (req)
+	char		message[SERVER_MESSAGE_SIZE];
+	uint32_t	length = htonl(size);
+	int		sent = 0;
+	ssize_t		k;
+
+	assert(size <= SERVER_MESSAGE_SIZE - MESSAGE_HEADER_SIZE);
+	message[0] = type;
+	memcpy(message + 1, &length, sizeof(length));
+	memcpy(message + MESSAGE_HEADER_SIZE, payload, size);
+
+	while (sent < MESSAGE_HEADER_SIZE + size)
 	{
-		a->req = calloc(req_size, sizeof(char *));
-		assert(a->req);
-		memcpy(a->req, req, req_size * sizeof(char *));
+		if ((k = send(fd, message + sent, MESSAGE_HEADER_SIZE + size - sent, MSG_NOSIGNAL)) == -1 && errno == EINTR)
+			continue;
+		if (k <= 0)
+			return -1;
+		sent += k;
 	}
-	else
+
+	return 0;
+
+}
+
+/* Hand complete messages in buffer to handler, keeping a partial one for later; -1 if the handler or framing failed */
+int
+handle_messages(char* buffer, int* length, int (*handler)(void*, const char, const char*, const int), void* context)
+{
+
+	char*		p = buffer;
+	uint32_t	size;
+
+	while (*length - (p - buffer) >= MESSAGE_HEADER_SIZE)
 	{
-		a->req = NULL;
+		memcpy(&size, p + 1, sizeof(size));
+		size = ntohl(size);
+		if (size > SERVER_MESSAGE_SIZE - MESSAGE_HEADER_SIZE)
+			return -1;
+		if (*length - (p - buffer) < MESSAGE_HEADER_SIZE + (int) size)
+			break;
+		if (handler(context, *p, p + MESSAGE_HEADER_SIZE, size) == -1)
+			return -1;
+		p += MESSAGE_HEADER_SIZE + size;
 	}
 
-	a->req_size = req_size;
-	a->repeats = repeats;
-	a->needs_player_id = needs_player_id;
-	a->needs_argument = needs_argument;
+	*length -= p - buffer;
+	memmove(buffer, p, *length);
 
-	/* Expand action database */
-	actions = realloc(actions, (actions_count + 1) * sizeof(action_t *));
-	assert(actions);
-	/* Add action to database */
-	actions[actions_count] = a;
-	actions_count++;
+	return 0;
+
+}
+
+/* Audio source of the voice activity detection of a session - samples received so far */
+int32
+read_session_audio(ad_rec_t* ad, int16* buf, int32 max)
+{
+
+	session_t*	session = (session_t*) ad;
+	int32		count = session->count - session->start;
+
+	/* Calibration waits for samples it is missing, so fail it instead */
+	if (count == 0 && !session->calibrated)
+		return -1;
+
+	if (count > max)
+		count = max;
+	memcpy(buf, session->samples + session->start, count * sizeof(int16));
+	session->start += count;
+
+	return count;
 
 }
 
 void
-initialize_actions(void)
+close_session(session_t* session)
 {
 
-	/* General actions */
-	register_action("BACK", "Input.Back", NULL, NULL, 0, 1, 0, 0);
-	register_action("DOWNWARDS", "Input.Down", NULL, NULL, 0, 1, 0, 0);
-	register_action("HOME", "Input.Home", NULL, NULL, 0, 1, 0, 0);
-	register_action("LEFT", "Input.Left", NULL, NULL, 0, 1, 0, 0);
-	register_action("MUTE", "Application.SetMute", "\"mute\": true", NULL, 0, 1, 0, 0);
-	register_action("RIGHT", "Input.Right", NULL, NULL, 0, 1, 0, 0);
-	register_action("SELECT", "Input.Select", NULL, NULL, 0, 1, 0, 0);
-	register_action("UNMUTE", "Application.SetMute", "\"mute\": false", NULL, 0, 1, 0, 0);
-	register_action("UPWARDS", "Input.Up", NULL, NULL, 0, 1, 0, 0);
-	register_action("VOLUME", "Application.SetVolume", "\"volume\":%s", volume_args, volume_args_size, 1, 0, 1);
+	decoder_job_t*	job;
+	int		i;
 
-	/* Repeating actions */
-	register_action("TWO", NULL, NULL, repeatable, repeatable_size, 2, 0, 0);
-	register_action("THREE", NULL, NULL, repeatable, repeatable_size, 3, 0, 0);
-	register_action("FOUR", NULL, NULL, repeatable, repeatable_size, 4, 0, 0);
-	register_action("FIVE", NULL, NULL, repeatable, repeatable_size, 5, 0, 0);
+	/* Utterances still being decoded are of no use to anybody any more */
+	if (session->job)
+		finish_job(session->job);
+	pthread_mutex_lock(&pool.lock);
+	for (job = pool.head; job; job = job->next)
+		if (job->session == session)
+			job->session = NULL;
+	pthread_mutex_unlock(&pool.lock);
 
-	/* Version-dependent actions */
-	switch(kodi_version)
+	print_log(LOG_INFO, "Capture client %s disconnected after %d utterances", session->name, session->utterances);
+
+	for (i=0; i<SERVER_SESSIONS; i++)
+		if (sessions[i] == session)
+			sessions[i] = NULL;
+
+	cont_ad_close(session->cont);
+	close(session->fd);
+	free(session->samples);
+	free(session);
+
+}
+
+/* Find utterances in audio received from a client, the same way as when capturing it */
+int
+listen_session(session_t* session)
+{
+
+	int16	buffer[AUDIO_BLOCK_SIZE];
+	int32	k;
+	int	consumed;
+
+	/* Calibration needs a stretch of audio at once, which may take a few messages to arrive */
+	if (!session->calibrated)
+	{
+		if (session->count - session->start < config_sample_rate * SERVER_CALIBRATION_TIME)
+			return 0;
+		if (cont_ad_calib(session->cont) < 0)
+		{
+			session->start = session->count;
+			return 0;
+		}
+		session->calibrated = 1;
+		print_log(LOG_INFO, "Voice activity detection calibrated for capture client %s", session->name);
+	}
+
+	for (;;)
 	{
 
-		case KODI_VERSION_EDEN:
-			register_action("NEXT", "Player.GoNext", NULL, NULL, 0, 1, 1, 0);
-			register_action("PAUSE", "Player.PlayPause", NULL, NULL, 0, 1, 1, 0);
-			register_action("PLAY", "Player.PlayPause", NULL, NULL, 0, 1, 1, 0);
-			register_action("PREVIOUS", "Player.GoPrevious", NULL, NULL, 0, 1, 1, 0);
-			register_action("REPEAT", "Player.Repeat", "\"state\":\"%s\"", repeat_args, repeat_args_size - 1, 1, 1, 1);
-			register_action("SHUFFLE", "Player.Shuffle", NULL, NULL, 0, 1, 1, 0);
-			register_action("STOP", "Player.Stop", NULL, NULL, 0, 1, 1, 0);
-			register_action("UNSHUFFLE", "Player.UnShuffle", NULL, NULL, 0, 1, 1, 0);
+		consumed = session->start;
+		if ((k = cont_ad_read(session->cont, buffer, ARRAY_SIZE(buffer))) < 0)
+			return -1;
+
+		if (k > 0)
+		{
+			if (!session->job)
+			{
+				trace_instant("audio", "speech started", "%s", session->name);
+				session->job = begin_job(session->mode);
+				session->job->session = session;
+			}
+			append_job(session->job, buffer, k);
+			session->timestamp = session->cont->read_ts;
+		}
+		else if (session->job && (session->cont->read_ts - session->timestamp) > config_sample_rate/8)
+		{
+			trace_instant("audio", "speech ended", "%s: %d samples", session->name, session->job->count);
+			finish_job(session->job);
+			session->job = NULL;
+			session->utterances++;
+			cont_ad_reset(session->cont);
+		}
+
+		if (k == 0 && session->start == consumed)
 			break;
 
+	}
+
+	/* Keep unread samples at the start of the buffer */
+	session->count -= session->start;
+	memmove(session->samples, session->samples + session->start, session->count * sizeof(int16));
+	session->start = 0;
+
+	return 0;
+
+}
+
+int
+handle_session_message(void* context, const char type, const char* payload, const int size)
+{
+
+	session_t*	session = context;
+	int16		sample;
+	int		i;
+
+	switch (type)
+	{
+
+		case MESSAGE_MODE:
+			if (size != 1 || payload[0] < 0 || payload[0] >= MODE_NONE)
+				return -1;
+			session->mode = payload[0];
+			print_log(LOG_DEBUG, "Capture client %s switched to %s mode", session->name, modes[session->mode]);
+			redecode_jobs(session, session->mode);
+			return 0;
+
+		case MESSAGE_AUDIO:
+			if (session->count + size / 2 > session->size)
+			{
+				session->size = (session->count + size / 2) * 2;
+				session->samples = realloc(session->samples, session->size * sizeof(int16));
+				assert(session->samples);
+			}
+			for (i=0; i<size/2; i++)
+			{
+				memcpy(&sample, payload + 2 * i, sizeof(sample));
+				session->samples[session->count++] = le16toh(sample);
+			}
+			return listen_session(session);
+
 		default:
-			/* Player actions */
-			register_action("MENU", "Input.ShowOSD", NULL, NULL, 0, 1, 0, 0);
-			register_action("NEXT", "Player.GoTo", "\"to\":\"next\"", NULL, 0, 1, 1, 0);
-			register_action("PAUSE", "Player.SetSpeed", "\"speed\":0", NULL, 0, 1, 1, 0);
-			register_action("PLAY", "Player.SetSpeed", "\"speed\":1", NULL, 0, 1, 1, 0);
-			register_action("PREVIOUS", "Player.GoTo", "\"to\":\"previous\"", NULL, 0, 1, 1, 0);
-			register_action("REPEAT", "Player.SetRepeat", "\"repeat\":\"%s\"", repeat_args, repeat_args_size, 1, 1, 0);
-			register_action("SHUFFLE", "Player.SetShuffle", "\"shuffle\":true", NULL, 0, 1, 1, 0);
-			register_action("STOP", "Player.Stop", NULL, NULL, 0, 1, 1, 0);
-			register_action("UNSHUFFLE", "Player.SetShuffle", "\"shuffle\":false", NULL, 0, 1, 1, 0);
-			/* Window actions */
-			register_action("FAVORITES", "GUI.ActivateWindow", "\"window\":\"favourites\"", NULL, 0, 1, 0, 0);
-			register_action("MUSIC", "GUI.ActivateWindow", "\"window\":\"music\"", NULL, 0, 1, 0, 0);
-			register_action("PICTURES", "GUI.ActivateWindow", "\"window\":\"pictures\"", NULL, 0, 1, 0, 0);
-			register_action("PROGRAMS", "GUI.ActivateWindow", "\"window\":\"programs\"", NULL, 0, 1, 0, 0);
-			register_action("SETTINGS", "GUI.ActivateWindow", "\"window\":\"settings\"", NULL, 0, 1, 0, 0);
-			register_action("T_V", "GUI.ActivateWindow", "\"window\":\"pvr\"", NULL, 0, 1, 0, 0);
-			register_action("VIDEOS", "GUI.ActivateWindow", "\"window\":\"videos\"", NULL, 0, 1, 0, 0);
-			register_action("WEATHER", "GUI.ActivateWindow", "\"window\":\"weather\"", NULL, 0, 1, 0, 0);
-			/* Other actions */
-			register_action("CONTEXT", "Input.ContextMenu", NULL, NULL, 0, 1, 0, 0);
-			break;
+			return -1;
 
 	}
 
 }
 
 void
-perform_actions(const char* hyp)
+read_session(session_t* session)
 {
 
-	int		i = 0;
-	int		j = 0;
-	int		k = 0;
-	int		ls = 0;
-	int		len;
-	int		matched = 0;
-	int		player_id = -3;
-	action_t*	action;
-	action_t*	action_queued;
-	action_t*	queue[MAX_ACTIONS];
-	char*		action_string;
-	char*		response = NULL;
-	char*		argument_search;
-	char*		params_fmt;
-	const char*	param;
-	int		expect_arg = 0;
+	ssize_t k;
 
-	/* Prepare action queue from words in hypothesis */
-	do
+	if ((k = recv(session->fd, session->buffer + session->length, sizeof(session->buffer) - session->length, 0)) <= 0)
 	{
-		if (*(hyp + i) == ' ' || *(hyp + i) == '\0')
+		if (k == -1 && errno == EINTR)
+			return;
+		close_session(session);
+		return;
+	}
+
+	session->length += k;
+	if (handle_messages(session->buffer, &session->length, handle_session_message, session) == -1)
+	{
+		print_log(LOG_WARNING, "Capture client %s sent an invalid message, disconnecting it", session->name);
+		close_session(session);
+	}
+
+}
+
+void
+accept_sessions(void)
+{
+
+	struct sockaddr_storage	peer;
+	socklen_t		length = sizeof(peer);
+	struct timeval		timeout = { SERVER_SEND_TIMEOUT / 1000, (SERVER_SEND_TIMEOUT % 1000) * 1000 };
+	char			host[NI_MAXHOST];
+	char			port[NI_MAXSERV];
+	session_t*		session;
+	uint32_t		rate = htonl(config_sample_rate);
+	int			on = 1;
+	int			fd;
+	int			i;
+
+	while ((fd = accept(server_socket, (struct sockaddr *) &peer, &length)) != -1)
+	{
+
+		for (i=0; i<SERVER_SESSIONS && sessions[i]; i++);
+		if (i == SERVER_SESSIONS)
 		{
+			print_log(LOG_WARNING, "Too many capture clients, refusing connection");
+			close(fd);
+			continue;
+		}
 
-			/* Extract single word */
-			len = i - ls + 1;
-			action_string = malloc(len);
-			assert(action_string);
-			memset(action_string, 0, len);
-			memcpy(action_string, hyp + ls, len - 1);
+		session = calloc(1, sizeof(session_t));
+		assert(session);
+		session->fd = fd;
+		session->mode = MODE_NORMAL;
+		if (getnameinfo((struct sockaddr *) &peer, length, host, sizeof(host), port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) == 0)
+			snprintf(session->name, sizeof(session->name), "%s:%s", host, port);
+		else
+			snprintf(session->name, sizeof(session->name), "#%d", fd);
+		length = sizeof(peer);
 
-			/* Reset loop iterator and end flag */
-			k = 0;
-			matched = 0;
+		/* Hypotheses are small and latency matters, but a stuck client must not stall the others */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
-			/* Check if we're not expecting an argument to last action */
-			if (!expect_arg)
-			{
-				while (k < actions_count && !matched)
-				{
-					/* Process next action */
-					action = actions[k];
-					/* Check if action word matches spoken word */
-					if (strcmp(action->word, action_string) == 0)
-					{
-						/* Cache player ID if current action needs it */
-						if (action->needs_player_id && player_id == -3)
-							player_id = get_json_rpc_response_int("Player.GetActivePlayers", NULL, "playerid");
-						/* Ignore action if it requires a player ID and we don't have a player ID */
-						if ( (action->needs_player_id && player_id >= 0) || !action->needs_player_id )
-						{
-							/* Is this a repeating action? */
-							if (action->repeats > 1)
-							{
-								/* Repeating action has to be preceded by a repeatable action */
-								if (j > 0 && in_array(action->req, action->req_size, queue[j-1]->word))
-									/* Set number of repeats for preceding action */
-									queue[j-1]->repeats = action->repeats;
-								else if (j == 0)
-									print_log(LOG_WARNING, "No action to repeat");
-								else
-									print_log(LOG_WARNING, "Action %s is not repeatable", queue[j-1]->word);
-							}
-							else
-							{
-
-								/* Insert a copy of action into queue */
-								action_queued = malloc(sizeof(action_t));
-								assert(action_queued);
-								memcpy(action_queued, action, sizeof(action_t));
-								action_queued->params = NULL;
-								queue[j++] = action_queued;
-
-								/* Fill player ID if action needs it */
-								if (action->needs_player_id)
-								{
-									/* Player ID can be max 1 char */
-									action_queued->params = malloc(strlen("\"playerid\":") + 2);
-									assert(action_queued->params);
-									sprintf(action_queued->params, "\"playerid\":%d", player_id);
-								}
-
-								/* Fill action params if needed */
-								if (action->params)
-								{
-									if (action->req_size > 0)
-										expect_arg = 1;
-									else
-										append_param(&action_queued->params, action->params);
-								}
-
-							}
-						}
-						else
-						{
-							print_log(LOG_WARNING, "Player action %s ignored as there is no active player", action_string);
-						}
-						/* Stop searching for a matching action */
-						matched = 1;
-					}
-					k++;
-				}
-				if (k == actions_count && !matched)
-					print_log(LOG_WARNING, "Unknown action \"%s\"", action_string);
-			}
-			else
-			{
+		/* Voice activity detection takes the rate of samples from the audio device */
+		session->ad.sps = config_sample_rate;
+		session->ad.bps = sizeof(int16);
+		if ((session->cont = cont_ad_init(&session->ad, read_session_audio)) == NULL || send_message(fd, MESSAGE_RATE, &rate, sizeof(rate)) == -1)
+		{
+			print_log(LOG_WARNING, "Unable to set up session for capture client %s", session->name);
+			if (session->cont)
+				cont_ad_close(session->cont);
+			close(fd);
+			free(session);
+			continue;
+		}
 
-				argument_search = malloc(strlen(action_string) + 2);
-				assert(argument_search);
-				sprintf(argument_search, "%s:", action_string);
+		sessions[i] = session;
+		print_log(LOG_INFO, "Capture client %s connected", session->name);
 
-				/* Don't look for an action but rather for an argument to last action;
-				   if the argument is optional, ignore the last entry in argument table
-				   (required => search until [size]; not required => search until [size - 1]) */
-				while (k < action->req_size - (1 - action->needs_argument) && !matched)
-				{
-					/* If current word is a valid argument to last action... */
-					if (strstr(action->req[k], argument_search))
-					{
-						/* Get param value for current word */
-						param = strchr(action->req[k], ':') + 1;
-						/* Generate formatted param string */
-						params_fmt = malloc(strlen(action->params) + strlen(param) + 1);
-						assert(params_fmt);
-						sprintf(params_fmt, action->params, param);
-						/* Add formatted param string to last action's params */
-						append_param(&queue[j-1]->params, params_fmt);
-						/* Cleanup */
-						free(params_fmt);
-						/* Stop searching for an argument */
-						matched = 1;
-					}
-					k++;
-				}
+	}
 
-				free(argument_search);
+}
 
-				/* If no valid argument was found, delete last action */
-				if (!matched)
-				{
-					print_log(LOG_WARNING, "%s is not a valid argument for %s - interpreting as action", action_string, queue[j-1]->word);
-					free(queue[j-1]->params);
-					free(queue[j-1]);
-					j--;
-					/* Current word is probably an action - process it again */
-					i -= strlen(action_string) + 1;
-				}
+/* Return the hypothesis of an utterance to the client which heard it */
+void
+send_hypothesis(const decoder_job_t* job)
+{
 
-				/* Don't expect an argument any more */
-				expect_arg = 0;
+	char*	message = malloc(strlen(job->hyp) + 128);
+	int	size;
 
-			}
+	assert(message);
+	print_log(LOG_INFO, "Heard from %s: \"%s\"", job->session->name, job->hyp);
+
+	size = sprintf(message, "%s %.6f %.3f %.3f %.3f %s", modes[job->mode], job->confidence, job->times[0], job->times[1], job->times[2], job->hyp);
+	if (size > SERVER_MESSAGE_SIZE - MESSAGE_HEADER_SIZE || send_message(job->session->fd, MESSAGE_HYPOTHESIS, message, size) == -1)
+	{
+		print_log(LOG_WARNING, "Unable to send hypothesis to capture client %s, disconnecting it", job->session->name);
+		close_session(job->session);
+	}
+
+	free(message);
+
+}
 
-			free(action_string);
-			ls = i + 1;
+/* Act on hypotheses of decoded utterances */
+void
+deliver_hypotheses(void)
+{
+
+	decoder_job_t*	job;
+	char		drain[64];
+	double		dispatched;
+	mode_t		previous_mode;
+
+	while (read(pool.notify[0], drain, sizeof(drain)) > 0);
 
+	while ((job = next_decoded_job()) != NULL)
+	{
+
+		record_decoding_latency(job);
+
+		/* Capture clients act on what they heard themselves */
+		if (config_server_port)
+		{
+			journal_commit(job->entry, job->hyp, job->score, job->confidence, get_time_ms() - job->started, job->cmn, job->cmn_size);
+			if (job->session)
+				send_hypothesis(job);
+			free_job(job);
+			continue;
 		}
+
+		/* Print hypothesis */
+		print_log(LOG_INFO, "Heard: \"%s\"", job->hyp);
+		journal_commit(job->entry, job->hyp, job->score, job->confidence, get_time_ms() - job->started, job->cmn, job->cmn_size);
+		/* Pick up actions reloaded while listening */
+		update_action_table();
+		/* Process hypothesis - utterances heard from now on are decoded in the mode it may switch to */
+		dispatched = get_time_ms();
+		previous_mode = mode;
+		if (check_confidence(job->hyp, job->confidence))
+			process_hypothesis(job->hyp);
+		report_timings(job->times, get_time_ms() - dispatched);
+		free_job(job);
+		/* Utterances heard since then may already be decoded in the mode it switched from */
+		if (mode != previous_mode)
+			redecode_jobs(NULL, mode);
+
 	}
-	while (*(hyp + i++) != '\0' && j < MAX_ACTIONS);
 
-	/* Check if the last command accepts an argument which was not given */
-	if (expect_arg)
+}
+
+void
+start_server(void)
+{
+
+	struct addrinfo		hints;
+	struct addrinfo*	addresses;
+	struct addrinfo*	address;
+	int			on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if (getaddrinfo(NULL, config_server_port, &hints, &addresses) != 0)
+		die("Unable to resolve decode server port %s", config_server_port);
+
+	for (address = addresses; address; address = address->ai_next)
 	{
-		/* If the command requires an argument, discard last action */
-		if (action->needs_argument)
+		if ((server_socket = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) == -1)
+			continue;
+		setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (bind(server_socket, address->ai_addr, address->ai_addrlen) == 0 && listen(server_socket, SERVER_SESSIONS) == 0)
+			break;
+		close(server_socket);
+		server_socket = -1;
+	}
+	freeaddrinfo(addresses);
+
+	if (server_socket == -1 || fcntl(server_socket, F_SETFL, O_NONBLOCK) == -1)
+		die("Unable to listen on decode server port %s: %s", config_server_port, strerror(errno));
+
+	print_log(LOG_INFO, "Accepting audio from capture clients on port %s", config_server_port);
+
+}
+
+/* Decode server - every client gets voice activity detection of its own, utterances of all of them share the decoders */
+void
+serve_clients(void)
+{
+
+	struct pollfd	fds[SERVER_SESSIONS + 2];
+	session_t*	polled[SERVER_SESSIONS];
+	int		nfds;
+	int		i;
+
+	if (config_control_socket)
+		print_log(LOG_WARNING, "Control socket is not available in decode server mode");
+	if (config_statefile)
+		print_log(LOG_WARNING, "Listening state is not saved in decode server mode");
+
+	/* Suppress verbose messages from pocketsphinx */
+	if (freopen("/dev/null", "w", stderr) == NULL)
+		die("Failed to redirect stderr");
+
+	start_decoders();
+	start_server();
+
+	/* Intercept SIGINT and SIGTERM for proper cleanup */
+	signal(SIGINT, set_exit_flag);
+	signal(SIGTERM, set_exit_flag);
+
+	/* Keep recent utterances of all clients for offline analysis */
+	if (config_journalfile)
+		journal_open();
+
+	if (config_rt_priority)
+		apply_scheduling_profile();
+
+	print_log(LOG_INFO, "Ready for decoding!");
+
+	while (!exit_flag)
+	{
+
+		/* Return hypotheses decoded in the meantime */
+		deliver_hypotheses();
+
+		nfds = 0;
+		fds[nfds].fd = pool.notify[0];
+		fds[nfds++].events = POLLIN;
+		fds[nfds].fd = server_socket;
+		fds[nfds++].events = POLLIN;
+		for (i=0; i<SERVER_SESSIONS; i++)
 		{
-			print_log(LOG_WARNING, "Action %s requires an argument, none given - ignoring action", action->word);
-			free(queue[j-1]->params);
-			free(queue[j-1]);
-			j--;
+			if (!sessions[i])
+				continue;
+			polled[nfds-2] = sessions[i];
+			fds[nfds].fd = sessions[i]->fd;
+			fds[nfds++].events = POLLIN;
 		}
-		else
-		/* If the command also works without an argument, process it with the default argument */
+
+		if (poll(fds, nfds, 100) == -1)
+			continue;
+
+		for (i=2; i<nfds; i++)
+			if (fds[i].revents)
+				read_session(polled[i-2]);
+		if (fds[1].revents & POLLIN)
+			accept_sessions();
+
+	}
+
+	print_log(LOG_INFO, "Signal caught - exiting");
+
+	for (i=0; i<SERVER_SESSIONS; i++)
+		if (sessions[i])
+			close_session(sessions[i]);
+	close(server_socket);
+	server_socket = -1;
+
+	/* Utterances which were not decoded yet are abandoned */
+	stop_decoders();
+	report_decoding_latency();
+	free_decoders();
+
+}
+
+/* Queue a whole message for flush_uplink(), -1 if it does not fit */
+int
+queue_message(uplink_t* uplink, const char type, const void* payload, const int size)
+{
+
+	uint32_t length = htonl(size);
+
+	assert(size <= SERVER_MESSAGE_SIZE - MESSAGE_HEADER_SIZE);
+	if (uplink->queued + MESSAGE_HEADER_SIZE + size > (int) sizeof(uplink->queue))
+		return -1;
+
+	uplink->queue[uplink->queued] = type;
+	memcpy(uplink->queue + uplink->queued + 1, &length, sizeof(length));
+	memcpy(uplink->queue + uplink->queued + MESSAGE_HEADER_SIZE, payload, size);
+	uplink->queued += MESSAGE_HEADER_SIZE + size;
+
+	return 0;
+
+}
+
+/* Send as much of the queue as the socket takes without waiting, -1 if the connection failed */
+int
+flush_uplink(uplink_t* uplink)
+{
+
+	ssize_t k;
+
+	while (uplink->queued > 0)
+	{
+		if ((k = send(uplink->fd, uplink->queue, uplink->queued, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1)
+			return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1);
+		uplink->queued -= k;
+		memmove(uplink->queue, uplink->queue + k, uplink->queued);
+	}
+
+	return 0;
+
+}
+
+/* A mode which does not fit into the queue is queued on a later read */
+void
+queue_mode(uplink_t* uplink)
+{
+
+	char byte = mode;
+
+	if (queue_message(uplink, MESSAGE_MODE, &byte, 1) == 0)
+		uplink->mode = mode;
+
+}
+
+int
+handle_uplink_message(void* context, const char type, const char* payload, const int size)
+{
+
+	uplink_t*	uplink = (uplink_t*) context;
+	char*		hyp;
+	char		decoded_mode[16];
+	double		confidence;
+	double		times[3];
+	double		dispatched;
+	uint32_t	rate;
+	int		n = 0;
+
+	/* The server decides the rate it decodes at, then learns which mode audio is in */
+	if (type == MESSAGE_RATE && !uplink->ready && size == sizeof(rate))
+	{
+		memcpy(&rate, payload, sizeof(rate));
+		rate = ntohl(rate);
+		if (rate != SAMPLE_RATE && rate != SAMPLE_RATE_NARROW)
+			return -1;
+		if ((int) rate != config_sample_rate)
 		{
-			/* Get param value for default action */
-			param = action->req[action->req_size-1];
-			/* Generate formatted param string */
-			params_fmt = malloc(strlen(action->params) + strlen(param) + 1);
-			assert(params_fmt);
-			sprintf(params_fmt, action->params, param);
-			/* Add formatted param string to last action's params */
-			append_param(&queue[j-1]->params, params_fmt);
-			/* Cleanup */
-			free(params_fmt);
+			config_sample_rate = rate;
+			if (config_sample_rate != SAMPLE_RATE)
+				initialize_decimator(&decimator);
 		}
+
+		queue_mode(uplink);
+		uplink->ready = 1;
+
+		return 0;
+	}
+
+	if (type != MESSAGE_HYPOTHESIS || !uplink->ready)
+		return -1;
+
+	hyp = strndup(payload, size);
+	assert(hyp);
+	if (sscanf(hyp, "%15s %lf %lf %lf %lf %n", decoded_mode, &confidence, &times[0], &times[1], &times[2], &n) < 5 || n == 0)
+	{
+		free(hyp);
+		return -1;
+	}
+
+	/* Decoded before the server learned of a mode change here, so it was decoded with the wrong models */
+	if (strcmp(decoded_mode, modes[mode]) != 0)
+	{
+		print_log(LOG_INFO, "Ignoring \"%s\" decoded in %s mode, as the mode is %s now", hyp + n, decoded_mode, modes[mode]);
+		free(hyp);
+		return 0;
+	}
+
+	/* Same as for hypotheses decoded here */
+	print_log(LOG_INFO, "Heard: \"%s\"", hyp + n);
+	update_action_table();
+	dispatched = get_time_ms();
+	if (check_confidence(hyp + n, confidence))
+		process_hypothesis(hyp + n);
+	report_timings(times, get_time_ms() - dispatched);
+
+	free(hyp);
+
+	return 0;
+
+}
+
+void
+close_uplink(uplink_t* uplink)
+{
+	if (uplink->fd != -1)
+		close(uplink->fd);
+	if (uplink->addresses)
+		freeaddrinfo(uplink->addresses);
+	uplink->fd = -1;
+	uplink->addresses = NULL;
+	uplink->address = NULL;
+	uplink->ready = 0;
+	uplink->length = 0;
+	uplink->queued = 0;
+	uplink->dropping = 0;
+}
+
+/* Start connecting to the current or a later address of the decode server, -1 once none is left */
+int
+connect_next_address(uplink_t* uplink)
+{
+
+	for (; uplink->address; uplink->address = uplink->address->ai_next)
+	{
+		if ((uplink->fd = socket(uplink->address->ai_family, uplink->address->ai_socktype, uplink->address->ai_protocol)) == -1)
+			continue;
+		if (fcntl(uplink->fd, F_SETFL, O_NONBLOCK) == 0 && (connect(uplink->fd, uplink->address->ai_addr, uplink->address->ai_addrlen) == 0 || errno == EINPROGRESS))
+			return 0;
+		close(uplink->fd);
+		uplink->fd = -1;
 	}
 
-	/* Execute all actions from queue */
-	for (i=0; i<j; i++)
+	return -1;
+
+}
+
+/* Start connecting to the decode server, which update_uplink() finishes without blocking capture */
+int
+connect_uplink(uplink_t* uplink)
+{
+
+	struct addrinfo	hints;
+	char*		host = strdup(config_decode_server);
+
+	assert(host);
+	*strrchr(host, ':') = '\0';
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, host + strlen(host) + 1, &hints, &uplink->addresses) != 0)
+		uplink->addresses = NULL;
+	free(host);
+
+	uplink->address = uplink->addresses;
+	uplink->deadline = get_time_ms() + SERVER_CONNECT_TIMEOUT;
+	if (connect_next_address(uplink) == -1)
 	{
-		/* Repeat each action the desired number of times in 200ms intervals */
-		for (k=0; k<queue[i]->repeats; k++)
-		{
-			send_json_rpc_request(queue[i]->method, queue[i]->params, NULL);
-			usleep(200000);
-		}
-		free(queue[i]->params);
-		free(queue[i]);
+		close_uplink(uplink);
+		return -1;
 	}
 
-	/* Cleanup */
-	free(response);
+	return 0;
 
 }
 
-void
-register_cmap(const char* string, const int character)
+/* Move on once the socket is connected, trying the next address if it failed */
+int
+poll_uplink(uplink_t* uplink)
 {
 
-	cmap_t* mapping = malloc(sizeof(cmap_t));
-	assert(mapping);
-	mapping->string = malloc(strlen(string) + 1);
-	strcpy(mapping->string, string);
-	mapping->character = character;
+	struct pollfd	fds = { .fd = uplink->fd, .events = POLLOUT };
+	int		error = 0;
+	socklen_t	size = sizeof(error);
+	int		on = 1;
+
+	if (poll(&fds, 1, 0) != 1)
+		return 0;
+
+	if (getsockopt(uplink->fd, SOL_SOCKET, SO_ERROR, &error, &size) == -1 || error != 0)
+	{
+		close(uplink->fd);
+		uplink->fd = -1;
+		uplink->address = uplink->address->ai_next;
+		return connect_next_address(uplink);
+	}
+
+	setsockopt(uplink->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	freeaddrinfo(uplink->addresses);
+	uplink->addresses = NULL;
+	uplink->address = NULL;
 
-	cmap = realloc(cmap, sizeof(cmap_t *) * (cmap_count + 1));
-	assert(cmap);
-	cmap[cmap_count] = mapping;
-	cmap_count++;
+	return 0;
 
 }
 
-void
-initialize_cmap(void)
+/* Act on hypotheses which arrived from the decode server, without waiting for any */
+int
+receive_hypotheses(uplink_t* uplink)
 {
 
-	/* Letters */
-	register_cmap("ALPHA",		'a');
-	register_cmap("BRAVO",		'b');
-	register_cmap("CHARLIE",	'c');
-	register_cmap("DELTA",		'd');
-	register_cmap("ECHO",		'e');
-	register_cmap("FOXTROT",	'f');
-	register_cmap("GOLF",		'g');
-	register_cmap("HOTEL",		'h');
-	register_cmap("INDIA",		'i');
-	register_cmap("JULIET",		'j');
-	register_cmap("KILO",		'k');
-	register_cmap("LIMA",		'l');
-	register_cmap("MIKE",		'm');
-	register_cmap("NOVEMBER",	'n');
-	register_cmap("OSCAR",		'o');
-	register_cmap("PAPA",		'p');
-	register_cmap("QUEBEC",		'q');
-	register_cmap("ROMEO",		'r');
-	register_cmap("SIERRA",		's');
-	register_cmap("TANGO",		't');
-	register_cmap("UNIFORM",	'u');
-	register_cmap("VICTOR",		'v');
-	register_cmap("WHISKEY",	'w');
-	register_cmap("X_RAY",		'x');
-	register_cmap("YANKEE",		'y');
-	register_cmap("ZULU",		'z');
+	ssize_t k;
 
-	/* Digits */
-	register_cmap("ZERO",		'0');
-	register_cmap("ONE",		'1');
-	register_cmap("TWO",		'2');
-	register_cmap("THREE",		'3');
-	register_cmap("FOUR",		'4');
-	register_cmap("FIVE",		'5');
-	register_cmap("SIX",		'6');
-	register_cmap("SEVEN",		'7');
-	register_cmap("EIGHT",		'8');
-	register_cmap("NINE",		'9');
+	while ((k = recv(uplink->fd, uplink->buffer + uplink->length, sizeof(uplink->buffer) - uplink->length, MSG_DONTWAIT)) > 0)
+	{
+		uplink->length += k;
+		if (handle_messages(uplink->buffer, &uplink->length, handle_uplink_message, uplink) == -1)
+			return -1;
+	}
 
-	/* Punctuation */
-	register_cmap("COLON",		':');
-	register_cmap("COMMA",		',');
-	register_cmap("DOT",		'.');
-	register_cmap("HYPHEN",		'-');
-	register_cmap("SPACE",		' ');
+	return (k == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ? -1 : 0);
 
 }
 
+/* Exchange audio, mode and hypotheses with the decode server without ever waiting for it, -1 if the connection failed */
 int
-find_cmap(const char* string)
+update_uplink(uplink_t* uplink, const int16* samples, const int count)
 {
 
-	int found = 0;
-	int i = 0;
-	int retval = -1;
+	/* Still connecting or waiting for the rate */
+	if (uplink->address)
+		return (poll_uplink(uplink) == -1 || get_time_ms() >= uplink->deadline ? -1 : 0);
+	if (!uplink->ready && receive_hypotheses(uplink) == -1)
+		return -1;
+	if (!uplink->ready)
+		return (get_time_ms() < uplink->deadline ? 0 : -1);
 
-	while(i < cmap_count && !found)
+	/* A server which falls behind loses audio rather than stalling capture */
+	if (count > 0 && queue_message(uplink, MESSAGE_AUDIO, samples, count * sizeof(int16)) == -1 && !uplink->dropping)
 	{
-		if (strcmp(cmap[i]->string, string) == 0)
-		{
-			retval = cmap[i]->character;
-			found = 1;
-		}
-		i++;
+		print_log(LOG_WARNING, "Decode server at %s falls behind, dropping audio", config_decode_server);
+		uplink->dropping = 1;
 	}
+	if (mode != uplink->mode)
+		queue_mode(uplink);
+	if (flush_uplink(uplink) == -1)
+		return -1;
+	if (uplink->queued == 0)
+		uplink->dropping = 0;
 
-	return retval;
+	return receive_hypotheses(uplink);
 
 }
 
+/* Capture client - audio goes to the decode server as it is read, hypotheses come back to be acted on here */
 void
-perform_spelling(const char* hyp)
+stream_audio(void)
 {
 
-	int	i = 0;
-	int	j = strlen(spelling_buffer);
-	int	ls = -1;
-	int	character;
-	char*	command;
+	uplink_t	uplink = { .fd = -1 };
+	ad_rec_t*	ad;
+	int16		adbuf[AUDIO_BLOCK_SIZE];
+	int32		k;
+	int		warned = 0;
+	int		failed = 0;
+	int		ready;
+	double		retry = 0;
+	double		slept;
+	int		i;
 
-	do
-	{
-		if (*(hyp + i) == ' ' || *(hyp + i) == '\0')
-		{
+	if (config_journalfile)
+		print_log(LOG_WARNING, "Utterance journal is only available on the decode server");
+	if (config_statefile)
+		print_log(LOG_WARNING, "Listening state is only saved on the decode server");
 
-			/* If spelling buffer is full, end processing */
-			if (j == SPELLING_BUFFER_SIZE - 1)
-				break;
+	/* Open audio device for recording */
+	if ((ad = ad_open_dev(config_audio_device, SAMPLE_RATE)) == NULL)
+		die("Failed to open audio device");
+	if (ad_start_rec(ad) < 0)
+		die("Failed to start recording");
 
-			/* Extract a single command */
-			command = malloc(i - ls);
-			assert(command);
-			memset(command, 0, i - ls);
-			memcpy(command, hyp + ls + 1, i - ls - 1);
+	/* Intercept SIGINT and SIGTERM for proper cleanup */
+	signal(SIGINT, set_exit_flag);
+	signal(SIGTERM, set_exit_flag);
 
-			/* DELETE command is treated separately as it doesn't add characters to the buffer */
-			if (strcmp("DELETE", command) == 0)
-			{
-				if (j > 0)
-				{
-					spelling_buffer[j - 1] = '\0';
-					j--;
-				}
-			}
-			else if (strcmp("LOWER", command) == 0)
-			{
-				spelling_case = 0;
-			}
-			else if (strcmp("UPPER", command) == 0)
-			{
-				spelling_case = 1;
-			}
-			else
-			{
-				/* Try to find a character matching the command */
-				character = find_cmap(command);
-				if (character != -1)
-					/* If the command is valid, append the character mapped to it to the buffer */
-					spelling_buffer[j++] = spelling_case ? toupper(character) : character;
-				else if (strlen(command) > 0)
-					/* If the command is invalid, print out a warning */
-					print_log(LOG_WARNING, "Unknown spelling mode command \"%s\"", command);
-			}
+	/* Accept commands from other processes */
+	if (config_control_socket)
+		start_control();
 
-			ls = i;
-			free(command);
+	if (config_rt_priority)
+		apply_scheduling_profile();
 
-		}
-	}
-	while (*(hyp + i++) != '\0');
+	print_log(LOG_INFO, "Ready for listening!");
 
-}
+	while (!exit_flag)
+	{
 
-int
-process_hypothesis(const char* hyp)
-{
+		/* Audio is read and dropped while the server is unreachable, so that it does not pile up */
+		if (uplink.fd == -1 && get_time_ms() >= retry && connect_uplink(&uplink) == -1)
+			failed = 1;
 
-	char*	hyp_new = strdup(hyp);
-	char*	next_word;
-	char*	params;
-	int	retval = 0;
+		if ((k = (config_sample_rate == SAMPLE_RATE ? ad_read : ad_read_decimated)(ad, adbuf, ARRAY_SIZE(adbuf))) < 0)
+			die("Failed to read audio");
 
-	if (config_locking)
-	{
-		/* If we are locked and... */
-		if (locked)
+		if (uplink.fd != -1)
 		{
-			/* ...the first command heard is the unlock command, unlock and continue */
-			if (strstr(hyp, COMMAND_UNLOCK) == hyp)
+			for (i=0; i<k; i++)
+				adbuf[i] = htole16(adbuf[i]);
+			ready = uplink.ready;
+			if (update_uplink(&uplink, adbuf, k) == -1)
 			{
-				locked = 0;
-				print_log(LOG_INFO, "kodivc is now unlocked");
-				/* Check if there are further commands after the unlock command */
-				next_word = strchr(hyp, ' ');
-				if (next_word)
+				/* A lost connection is set up again right away */
+				if (ready)
 				{
-					/* If yes, remove the unlock command from the hypothesis */
-					free(hyp_new);
-					hyp_new = strdup(next_word + 1);
+					print_log(LOG_WARNING, "Lost connection to decode server at %s", config_decode_server);
+					warned = 1;
 				}
 				else
-				{
-					/* If not, send GUI notification confirming unlocking */
-					params = malloc(strlen("Current mode: %s") + strlen(modes[mode]));
-					assert(params);
-					sprintf(params, "Current mode: %s", modes[mode]);
-					send_gui_notification("Voice recognition enabled", params, "warning");
-					print_log(LOG_INFO, "Current mode: %s", modes[mode]);
-					free(params);
-					free(hyp_new);
-					hyp_new = strdup("");
-				}
+					failed = 1;
+				close_uplink(&uplink);
 			}
-			/* ...the first command heard is not the unlock command, warn and ignore all commands */
-			else
+			else if (!ready && uplink.ready)
 			{
-				print_log(LOG_WARNING, "kodivc is locked and not processing commands, say " COMMAND_UNLOCK " to unlock");
+				print_log(warned ? LOG_NOTICE : LOG_INFO, "Streaming audio to decode server at %s", config_decode_server);
+				warned = 0;
 			}
 		}
-		/* If we are unlocked and the only command heard is the lock command, lock */
-		else if (strcmp(COMMAND_LOCK, hyp_new) == 0)
+
+		if (failed)
 		{
-			locked = 1;
-			send_gui_notification("Voice recognition disabled", "Not listening for commands", "warning");
-			print_log(LOG_INFO, "kodivc is now locked");
+			if (!warned)
+				print_log(LOG_WARNING, "Unable to stream audio to decode server at %s, retrying every %d s", config_decode_server, SERVER_RECONNECT_INTERVAL / 1000);
+			warned = 1;
+			failed = 0;
+			retry = get_time_ms() + SERVER_RECONNECT_INTERVAL;
 		}
-	}
 
-	/* If we are unlocked or we don't care about locking... */
-	if ((config_locking && !locked) || !config_locking)
-	{
-		/* Check for mode-changing keywords */
-		switch(mode)
+		if (k == 0)
 		{
-
-			case MODE_NORMAL:
-				/* Change to spelling mode */
-				if (strcmp("SPELL", hyp_new) == 0)
-				{
-					if (kodi_version >= KODI_VERSION_FRODO)
-					{
-						memset(spelling_buffer, 0, SPELLING_BUFFER_SIZE);
-						send_json_rpc_request("Input.SendText", "\"text\":\"\",\"done\":false", NULL);
-						spelling_case = 0;
-						mode = MODE_SPELLING;
-						retval = 1;
-						print_log(LOG_INFO, "Changed to spelling mode");
-						send_gui_notification("Voice recognition mode changed", "Current mode: spelling", "warning");
-					}
-					else
-					{
-						print_log(LOG_ERR, "Spelling mode not available before Frodo");
-					}
-				}
-				else if (strlen(hyp_new) > 0)
-				{
-					/* Send GUI notification with the commands heard */
-					send_gui_notification("Voice command heard", hyp_new, "info");
-					/* Perform requested actions */
-					perform_actions(hyp_new);
-				}
-				break;
-
-			case MODE_SPELLING:
-				/* Return to normal mode, accepting input */
-				if (strcmp("ACCEPT", hyp_new) == 0)
-				{
-					send_json_rpc_request("Input.ExecuteAction", "\"action\":\"enter\"", NULL);
-					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
-					mode = MODE_NORMAL;
-					retval = 1;
-					print_log(LOG_INFO, "Changed to normal mode");
-				}
-				/* Return to normal mode, rejecting input */
-				else if (strcmp("CANCEL", hyp_new) == 0)
-				{
-					send_json_rpc_request("Input.ExecuteAction", "\"action\":\"previousmenu\"", NULL);
-					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
-					mode = MODE_NORMAL;
-					retval = 1;
-					print_log(LOG_INFO, "Changed to normal mode");
-				}
-				/* Clear input */
-				else if (strcmp("CLEAR", hyp_new) == 0)
-				{
-					memset(spelling_buffer, 0, SPELLING_BUFFER_SIZE);
-					send_json_rpc_request("Input.SendText", "\"text\":\"\",\"done\":false", NULL);
-				}
-				/* Return to normal mode */
-				else if (strcmp("NORMAL", hyp_new) == 0)
-				{
-					/* Send GUI notification and change mode */
-					send_gui_notification("Voice recognition mode changed", "Current mode: normal", "warning");
-					mode = MODE_NORMAL;
-					retval = 1;
-					print_log(LOG_INFO, "Changed to normal mode");
-				}
-				else
-				{
-					perform_spelling(hyp_new);
-					params = malloc(strlen("\"text\":\"%s\",\"done\":false") + strlen(spelling_buffer));
-					assert(params);
-					sprintf(params, "\"text\":\"%s\",\"done\":false", spelling_buffer);
-					send_json_rpc_request("Input.SendText", params, NULL);
-					free(params);
-				}
+			/* Send spelling input once no more edits arrive */
+			spelling_flush(0);
+			/* Reload actions if requested */
+			update_action_table();
+			/* Wait for audio, serving control requests in the meantime */
+			slept = get_time_ms();
+			serve_control(20);
+			if (exit_flag)
 				break;
-
+			record_wakeup(20, get_time_ms() - slept);
 		}
+
 	}
 
-	free(hyp_new);
+	print_log(LOG_INFO, "Signal caught - exiting");
 
-	return retval;
+	close_uplink(&uplink);
+
+	report_confidence_statistics();
+	report_wakeup_statistics();
+	report_total_timings();
+
+	ad_close(ad);
 
 }
 
+/* The microbenchmark and replay tool include this file and bring their own main() */
+#ifndef KODIVC_NO_MAIN
 int
 main(int argc, char* argv[])
 {
@@ -1256,16 +7854,18 @@ main(int argc, char* argv[])
 	int		pid;
 	int		i;
 	char*		dict;
+	char*		lm;
+	double		dispatched;
 	char		hyp_test[255];
-	cmd_ln_t*	config;
-	ps_decoder_t*	ps;
 	ad_rec_t*	ad;
 	cont_ad_t*	cont;
-	int16		adbuf[4096];
+	decoder_job_t*	job;
+	int16		adbuf[AUDIO_BLOCK_SIZE];
 	int32		k;
 	int32		timestamp;
-	int32		result;
-	const char*	hyp;
+	double		slept;
+	double		traced;
+	int		revalidate = 0;
 
 	/* Enable core dumps */
 	core_limit.rlim_cur = RLIM_INFINITY;
@@ -1274,9 +7874,20 @@ main(int argc, char* argv[])
 
 	/* Register a memory-freeing routine to run upon exiting */
 	assert(atexit(cleanup) == 0);
+	/* Registered later so that these run before cleanup() */
+	assert(atexit(stop_logger) == 0);
+	assert(atexit(stop_tracer) == 0);
+	assert(atexit(stop_health_prober) == 0);
+	assert(atexit(stop_lanes) == 0);
+	assert(atexit(stop_media_index) == 0);
+
+	/* Initialize libcurl before any threads are started */
+	if (curl_global_init(CURL_GLOBAL_ALL) != 0)
+		die("Error initializing libcurl");
 
 	/* Parse command line options */
 	parse_options(argc, argv);
+	prepare_json_rpc_url();
 
 	if (config_daemon)
 	{
@@ -1305,18 +7916,31 @@ main(int argc, char* argv[])
 
 	}
 
-	/* Check if language model files were properly installed */
-	if (access(MODEL_HMM, R_OK) == -1)
-		die("Hidden Markov acoustic model not found at %s. Please check your Pocketsphinx installation.", MODEL_HMM);
+	/* From now on, log from a background thread */
+	start_logger();
+	signal(SIGUSR1, change_loglevel);
+	signal(SIGUSR2, change_loglevel);
 
-	if (access(MODEL_LM, R_OK) == -1)
-		die("kodivc language model not found at %s. Please check your Pocketsphinx installation.", MODEL_LM);
+	/* Trace every thread from the start */
+	if (config_tracefile)
+		start_tracer();
+	trace_thread("listening");
 
-	for (i=0; i<MODE_NONE; i++)
+	/* Start workers sending requests to Kodi - actions never wait for notifications */
+	start_lane(&action_lane);
+	start_lane(&notification_lane);
+
+	/* Check if language model files were properly installed - capture clients leave decoding to the server */
+	if (!config_decode_server && access(MODEL_HMM, R_OK) == -1)
+		die("Hidden Markov acoustic model not found at %s. Please check your Pocketsphinx installation.", MODEL_HMM);
+
+	for (i=0; i<MODE_NONE && !config_decode_server; i++)
 	{
-		dict = malloc(strlen(MODELDIR "/lm/en/kodivc/.dic") + strlen(modes[i]) + 1);
-		assert(dict);
-		sprintf(dict, MODELDIR "/lm/en/kodivc/%s.dic", modes[i]);
+		lm = get_mode_model(i, "lm");
+		if (access(lm, R_OK) == -1)
+			die("kodivc language model %s not found. Please check your kodivc installation.", lm);
+		free(lm);
+		dict = get_mode_model(i, "dic");
 		if (access(dict, R_OK) == -1)
 			die("kodivc dictionary %s not found. Please check your kodivc installation.", dict);
 		free(dict);
@@ -1324,26 +7948,69 @@ main(int argc, char* argv[])
 
 	print_log(LOG_INFO, "Initializing, please wait...");
 
-	/* Check Kodi version */
-	kodi_version = get_json_rpc_response_int("Application.GetProperties", "\"properties\":[\"version\"]", "major");
+	/* A decode server leaves talking to Kodi to its clients */
+	if (config_server_port)
+	{
+		serve_clients();
+		return 0;
+	}
+
+	/* A snapshot of this host saves waiting for Kodi before listening - it is checked later */
+	if (config_capabilitiesfile && (capabilities = load_capabilities()) != NULL)
+	{
+		kodi_version = capabilities->version;
+		revalidate = 1;
+	}
+	else
+	{
+
+		/* Check Kodi version */
+		kodi_version = get_json_rpc_response_int("Application.GetProperties", "\"properties\":[\"version\"]", "major");
+
+		if (kodi_version == -2)
+			die("Unable to connect to Kodi running at %s:%s", config_json_rpc_host, config_json_rpc_port);
+		else if (kodi_version == -1)
+			die("Unable to determine Kodi version running at %s:%s", config_json_rpc_host, config_json_rpc_port);
+		else if (kodi_version < KODI_VERSION_MIN)
+			die("Kodi version %d, which is running at %s:%s, is unsupported", kodi_version, config_json_rpc_host, config_json_rpc_port);
+
+		/* Remember which methods Kodi supports for the next start */
+		if (config_capabilitiesfile)
+		{
+			if ((capabilities = fetch_capabilities(kodi_version)) != NULL)
+				save_capabilities(capabilities);
+			else
+				print_log(LOG_WARNING, "Unable to determine methods supported by Kodi, assuming all of them exist");
+		}
+
+	}
 
-	if (kodi_version == -2)
-		die("Unable to connect to Kodi running at %s:%s", config_json_rpc_host, config_json_rpc_port);
-	else if (kodi_version == -1)
-		die("Unable to determine Kodi version running at %s:%s", config_json_rpc_host, config_json_rpc_port);
-	else if (kodi_version < KODI_VERSION_MIN)
-		die("Kodi version %d, which is running at %s:%s, is unsupported", kodi_version, config_json_rpc_host, config_json_rpc_port);
-	else if (kodi_version > KODI_VERSION_MAX)
+	if (kodi_version > KODI_VERSION_MAX)
 		print_log(LOG_WARNING, "Support for Kodi version %d, which is running at %s:%s, is EXPERIMENTAL", kodi_version, config_json_rpc_host, config_json_rpc_port);
 
-	/* Setup action database */
-	initialize_actions();
-	/* Setup command to character mapping database */
-	initialize_cmap();
+	/* Setup action and command to character mapping databases */
+	if ((action_table = load_action_table()) == NULL)
+		die("Unable to load actions from %s", config_actionfile ? config_actionfile : "built-in actions");
+	signal(SIGHUP, set_reload_flag);
+
+	if (config_media_port)
+		start_media_index();
+
+	/* Like reloads, revalidation only blocks in test mode */
+	if (revalidate && config_test_mode)
+		revalidate_capabilities(NULL);
+	else if (revalidate && pthread_create(&revalidator, NULL, revalidate_capabilities, NULL) != 0)
+		print_log(LOG_WARNING, "Unable to start revalidating Kodi capabilities");
+	else if (revalidate)
+		revalidating = 1;
 
 	if (config_test_mode)
 	{
 		print_log(LOG_INFO, "Test mode enabled - enter space-separated commands in ALL CAPS. Enter blank line to end.");
+		if (config_control_socket)
+			print_log(LOG_WARNING, "Control socket is not available in test mode");
+		if (config_journalfile)
+			print_log(LOG_WARNING, "Utterance journal is not available in test mode");
 		for (;;)
 		{
 			if (fgets(hyp_test, 255, stdin) == NULL || hyp_test[0] == '\n')
@@ -1356,12 +8023,22 @@ main(int argc, char* argv[])
 				*(hyp_test + strlen(hyp_test) - 1) = '\0';
 				/* Log */
 				print_log(LOG_INFO, "Line read: \"%s\"", hyp_test);
+				/* Pick up reloaded actions */
+				update_action_table();
 				/* Process hypothesis */
+				dispatched = get_time_ms();
 				process_hypothesis(hyp_test);
+				report_timings(NULL, get_time_ms() - dispatched);
+				/* There is no idle loop in test mode - send spelling input right away */
+				spelling_flush(1);
 			}
 		}
 		print_log(LOG_INFO, "Blank line read, exiting");
 	}
+	else if (config_decode_server)
+	{
+		stream_audio();
+	}
 	else
 	{
 
@@ -1369,36 +8046,60 @@ main(int argc, char* argv[])
 		if (freopen("/dev/null", "w", stderr) == NULL)
 			die("Failed to redirect stderr");
 
-		/* Initialize pocketsphinx */
-		config = cmd_ln_init(NULL, ps_args(), TRUE,
-			"-hmm", MODEL_HMM,
-			"-lm", MODEL_LM,
-			"-dict", MODEL_DICT,
-			NULL);
-		if (config == NULL)
-			die("Error creating pocketsphinx configuration");
+		/* Restore listening state saved by a previous run */
+		if (config_statefile)
+			load_state();
 
-		ps = ps_init(config);
-		if (ps == NULL)
-			die("Error initializing pocketsphinx");
+		start_decoders();
 
 		/* Open audio device for recording */
-		if ((ad = ad_open_dev(config_audio_device, 16000)) == NULL)
+		if ((ad = ad_open_dev(config_audio_device, SAMPLE_RATE)) == NULL)
 			die("Failed to open audio device");
-		/* Initialize continous listening module */
-		if ((cont = cont_ad_init(ad, ad_read)) == NULL)
+		/* Initialize continous listening module, which has to know the rate of samples it gets */
+		if (config_sample_rate == SAMPLE_RATE)
+		{
+			cont = cont_ad_init(ad, ad_read);
+		}
+		else
+		{
+			initialize_decimator(&decimator);
+			ad->sps = config_sample_rate;
+			cont = cont_ad_init(ad, ad_read_decimated);
+			ad->sps = SAMPLE_RATE;
+		}
+		if (cont == NULL)
 			die("Failed to initialize voice activity detection");
 		/* Start recording */
 		if (ad_start_rec(ad) < 0)
 			die("Failed to start recording");
-		/* Calibrate voice detection */
-		if (cont_ad_calib(cont) < 0)
+		/* Calibrate voice detection, unless a saved calibration is available */
+		if (state.calibrated)
+		{
+			cont->noise_level = state.noise_level;
+			cont_ad_set_thresh(cont, state.thresh_sil, state.thresh_speech);
+		}
+		else if (cont_ad_calib(cont) < 0)
+		{
 			die("Failed to calibrate voice activity detection");
+		}
+		remember_calibration(cont);
+		state.saved_at = get_time_ms();
 
 		/* Intercept SIGINT and SIGTERM for proper cleanup */
 		signal(SIGINT, set_exit_flag);
 		signal(SIGTERM, set_exit_flag);
 
+		/* Accept commands from other processes */
+		if (config_control_socket)
+			start_control();
+
+		/* Keep recent utterances for offline analysis */
+		if (config_journalfile)
+			journal_open();
+
+		if (config_rt_priority)
+			apply_scheduling_profile();
+
 		print_log(LOG_INFO, "Ready for listening!");
 
 		/* Main listening loop */
@@ -1406,10 +8107,31 @@ main(int argc, char* argv[])
 		{
 
 			/* Wait until we get any samples */
-			while ((k = cont_ad_read(cont, adbuf, 4096)) == 0)
+			for (;;)
 			{
-				if (usleep(100000) == -1)
+				/* Only the read which finds speech is traced, idle ones would fill the trace while nothing happens */
+				traced = trace_begin();
+				k = cont_ad_read(cont, adbuf, AUDIO_BLOCK_SIZE);
+				if (k != 0)
+				{
+					trace_end(traced, "audio", "cont_ad_read", "%d samples", k);
+					break;
+				}
+				/* Act on utterances decoded in the meantime */
+				deliver_hypotheses();
+				/* Send spelling input once no more edits arrive */
+				spelling_flush(0);
+				/* Reload actions if requested */
+				update_action_table();
+				/* Periodically save listening state while idle */
+				if (config_statefile && get_time_ms() - state.saved_at > STATE_SAVE_INTERVAL && decoders_idle())
+					save_state(cont, pool.workers[0].ps);
+				/* Wait for audio or hypotheses, serving control requests in the meantime */
+				slept = get_time_ms();
+				serve_control(100);
+				if (exit_flag)
 					break;
+				record_wakeup(100, get_time_ms() - slept);
 			}
 
 			/* Exit main loop if we were interrupted */
@@ -1419,12 +8141,11 @@ main(int argc, char* argv[])
 			if (k < 0)
 				die("Failed to read audio");
 
-			/* Start collecting utterance data */
-			if (ps_start_utt(ps, NULL) < 0)
-				die("Failed to start utterance");
+			trace_instant("audio", "speech started", NULL);
 
-			if ((result = ps_process_raw(ps, adbuf, k, FALSE, FALSE)) < 0)
-				die("Failed to process utterance data");
+			/* Hand utterance data to the next decoder as it arrives */
+			job = begin_job(mode);
+			append_job(job, adbuf, k);
 
 			/* Save timestamp for initial utterance samples */
 			timestamp = cont->read_ts;
@@ -1433,74 +8154,79 @@ main(int argc, char* argv[])
 			for (;;)
 			{
 
-				if ((k = cont_ad_read(cont, adbuf, 4096)) < 0)
+				traced = trace_begin();
+				k = cont_ad_read(cont, adbuf, AUDIO_BLOCK_SIZE);
+				trace_end(traced, "audio", "cont_ad_read", "%d samples", k);
+				if (k < 0)
 					die("Failed to read audio");
 
 				if (k == 0)
 				{
 					/* Has it been 500ms since we last read any samples? */
-					if ((cont->read_ts - timestamp) > DEFAULT_SAMPLES_PER_SEC/8)
+					if ((cont->read_ts - timestamp) > config_sample_rate/8)
 						/* YES - Break the listening loop */
 						break;
 					else
-						/* NO - Wait a bit before reading further data */
-						if (usleep(20000) == -1)
+					{
+						/* NO - Act on earlier utterances and wait a bit before reading further data */
+						deliver_hypotheses();
+						slept = get_time_ms();
+						usleep(20000);
+						if (exit_flag)
 							break;
+						record_wakeup(20, get_time_ms() - slept);
+					}
 				}
 				else
 				{
 					/* New samples received - update timestamp */
 					timestamp = cont->read_ts;
 					/* Process the samples received */
-					result = ps_process_raw(ps, adbuf, k, FALSE, FALSE);
+					append_job(job, adbuf, k);
 				}
 
 			}
 
-			/* Stop listening */
-			ad_stop_rec(ad);
-			/* Flush any samples remaining in buffer - they will not be processed */
-			while (ad_read(ad, adbuf, 4096) >= 0);
+			trace_instant("audio", "speech ended", "%d samples", job->count);
+
+			/* Recording goes on while the utterance is being decoded */
+			finish_job(job);
 			/* Reset continous listening module */
 			cont_ad_reset(cont);
-			/* End utterance */
-			ps_end_utt(ps);
+			/* Follow changes in background noise */
+			track_noise_floor(cont);
 
 			/* Exit main loop if we were interrupted */
 			if (exit_flag)
 				break;
 
-			/* Get hypothesis for utterance */
-			hyp = ps_get_hyp(ps, NULL, NULL);
-			/* Print hypothesis */
-			print_log(LOG_INFO, "Heard: \"%s\"", hyp);
-			/* Process hypothesis */
-			if (process_hypothesis(hyp) == 1)
-			{
-				/* If process_hypothesis() returns 1, mode of operation has changed - load a proper dictionary */
-				dict = malloc(strlen(MODELDIR "/lm/en/kodivc/.dic") + strlen(modes[mode]) + 1);
-				assert(dict);
-				sprintf(dict, MODELDIR "/lm/en/kodivc/%s.dic", modes[mode]);
-				ps_load_dict(ps, dict, NULL, NULL);
-				free(dict);
-			}
-
-			/* Resume recording */
-			if (ad_start_rec(ad) < 0)
-				die("Failed to start recording");
-
 		}
 
 		print_log(LOG_INFO, "Signal caught - exiting");
 
+		/* Utterances which were not decoded yet are abandoned */
+		stop_decoders();
+
+		report_confidence_statistics();
+		report_wakeup_statistics();
+		report_decoding_latency();
+		report_total_timings();
+
+		if (config_statefile)
+			save_state(cont, pool.workers[0].ps);
+
 		/* Cleanup */
 		cont_ad_close(cont);
 		ad_close(ad);
-		ps_free(ps);
+		free_decoders();
 
 	}
 
+	/* Compiled command cache */
+	report_cache_statistics();
+	cache_flush();
+
 	return 0;
 
 }
-
+#endif
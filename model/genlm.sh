@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# Generate a language model for a kodivc mode from its dictionary.
+#
+# Every command is a sentence of its own, so the model only has to know which
+# words can start and end an utterance. Probabilities are computed the way
+# QuickLM does it, using a fixed discount mass of 0.5 and ratio backoffs.
+#
+# Usage: genlm.sh <dictionary> > <language model>
+
+if [ $# -ne 1 ] || [ ! -r "$1" ]; then
+	echo "Usage: $0 <dictionary>" >&2
+	exit 1
+fi
+
+# Alternate pronunciations are marked with a (N) suffix - strip it
+sed -e 's/[ \t].*//' -e 's/([0-9]*)$//' "$1" | grep -v '^$' | sort -u | awk -v dict="$(basename "$1")" '
+{
+	words[n++] = $0
+}
+END {
+	if (n == 0)
+	{
+		print "No words found in " dict > "/dev/stderr"
+		exit 1
+	}
+
+	discount = 0.5
+	total = 3 * n
+	# Probability of a word and of the end of sentence
+	p_word = discount / total
+	p_end = discount * n / total
+	# Bigrams starting a sentence and trigrams ending it
+	p_start = discount / n
+	backoff = discount / (1 - p_end)
+
+	print "Language model generated by kodivc from " dict
+	print ""
+	print "This model is based on a corpus of " n " sentences and " n + 2 " words"
+	print ""
+	print "\\data\\"
+	print "ngram 1=" n + 2
+	print "ngram 2=" 2 * n
+	print "ngram 3=" n
+	print ""
+	print "\\1-grams:"
+	printf "%.4f </s> %.4f\n", log10(p_end), log10(discount)
+	printf "%.4f <s> %.4f\n", log10(p_end), log10(discount / (1 - n * p_word))
+	for (i = 0; i < n; i++)
+		printf "%.4f %s %.4f\n", log10(p_word), words[i], log10(backoff)
+	print ""
+	print "\\2-grams:"
+	for (i = 0; i < n; i++)
+		printf "%.4f <s> %s 0.0000\n", log10(p_start), words[i]
+	for (i = 0; i < n; i++)
+		printf "%.4f %s </s> %.4f\n", log10(discount), words[i], log10(discount)
+	print ""
+	print "\\3-grams:"
+	for (i = 0; i < n; i++)
+		printf "%.4f <s> %s </s>\n", log10(discount), words[i]
+	print ""
+	print "\\end\\"
+}
+
+function log10(x)
+{
+	return log(x) / log(10)
+}
+'
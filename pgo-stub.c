@@ -0,0 +1,72 @@
+/*
+ *
+ * pgo-stub - answers requests of a kodivc build trained for profile-guided
+ * optimization in place of Kodi
+ *
+ * Copyright (C) Michal Kepien, 2012-2015.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; see the file LICENSE. If not, write to
+ * the Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Linked into the training build only, where it replaces the transport
+ * of kodivc before main() runs. Training therefore never needs a running
+ * Kodi instance and never sends it a command, while kodivc.c is compiled
+ * exactly as it is for the optimized build.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Responses of the stub transport, as from the newest supported Kodi version */
+#define STUB_RESPONSE_VERSION		"{\"id\":1,\"jsonrpc\":\"2.0\",\"result\":{\"version\":{\"major\":15,\"minor\":0}}}"
+#define STUB_RESPONSE_PLAYERS		"{\"id\":1,\"jsonrpc\":\"2.0\",\"result\":[{\"playerid\":1,\"type\":\"video\"}]}"
+#define STUB_RESPONSE_DEFAULT		"{\"id\":1,\"jsonrpc\":\"2.0\",\"result\":\"OK\"}"
+
+/* Defined in kodivc.c */
+extern int (*json_rpc_transport)(const char* post, const long timeout, char** dst);
+
+int
+stub_transport(const char* post, const long timeout, char** dst)
+{
+
+	const char* response = STUB_RESPONSE_DEFAULT;
+
+	if (strstr(post, "Application.GetProperties"))
+		response = STUB_RESPONSE_VERSION;
+	else if (strstr(post, "Player.GetActivePlayers"))
+		response = STUB_RESPONSE_PLAYERS;
+
+	if (dst)
+	{
+		*dst = realloc(*dst, strlen(response) + 1);
+		assert(*dst);
+		strcpy(*dst, response);
+	}
+
+	/* CURLE_OK */
+	return 0;
+
+}
+
+__attribute__((constructor))
+void
+install_stub_transport(void)
+{
+	json_rpc_transport = stub_transport;
+}
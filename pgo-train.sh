@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Train a profiling build of kodivc by replaying the commands from
+# pgo-train.txt in test mode. The build has to be linked with pgo-stub.c,
+# which answers in place of Kodi, so nothing is sent to a real instance.
+#
+# Usage: pgo-train.sh <kodivc binary>
+
+ROUNDS=20
+
+if [ $# -ne 1 ]; then
+	echo "Usage: $0 <kodivc binary>" >&2
+	exit 1
+fi
+
+TRAINING="$(dirname "$0")/pgo-train.txt"
+
+# A blank line ends test mode
+i=0
+{
+	while [ $i -lt $ROUNDS ]; do
+		grep -v '^#' "$TRAINING"
+		i=$((i + 1))
+	done
+	echo
+} | "$1" -t -l -n > /dev/null